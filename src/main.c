@@ -1,12 +1,55 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/memfd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+// memfd seals from linux/fcntl.h, which clashes with fcntl.h
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "../libs/stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "../libs/stb_image_write.h"
+// Reference implementation, only used by the compare command. Its op macros are dropped as this
+// file has its own QOI_OP_* constants.
+#define QOI_IMPLEMENTATION
+#define QOI_NO_STDIO
+#include "../libs/qoi.h"
+#undef QOI_OP_INDEX
+#undef QOI_OP_DIFF
+#undef QOI_OP_LUMA
+#undef QOI_OP_RUN
+#undef QOI_OP_RGB
+#undef QOI_OP_RGBA
 
 
 struct qoi_header {
@@ -19,6 +62,56 @@ struct qoi_header {
 
 const uint8_t headerSize = 4+4+4+1+1; // Cannot use sizeof() due to struct padding.
 
+// Largest image (width * height) that is encoded or decoded. Sizes are computed in size_t, this
+// keeps the worst case encoded size (5 bytes per pixel) and the decoded size (4 bytes per pixel)
+// far from overflowing it, also with a 32-bit size_t.
+const uint64_t qoiMaxPixels = SIZE_MAX > UINT32_MAX ? 1ull << 40 : (1ull << 32) / 8;
+
+// Outcome of the codec functions. They do not print anything: they return NULL or 0 on failure
+// and record why in an optional struct qoi_error, which the command line layer prints.
+// Statuses before QOI_ERROR_IO are warnings, the result is still usable.
+enum qoi_status {
+  QOI_OK = 0,
+  QOI_BAD_END_CHUNK, // The image is complete, but the end chunk is missing or wrong
+  QOI_PARTIAL, // The data ended early, the missing pixels are zero
+  QOI_ERROR_IO, // File not found, not readable or not writable
+  QOI_ERROR_FORMAT, // Not a (supported) qoi, qoiz or qoit file
+  QOI_ERROR_CORRUPT, // Implausible sizes, corrupt blocks, tiles or offset tables
+  QOI_ERROR_CHECKSUM,
+  QOI_ERROR_TOO_LARGE, // Over qoiMaxPixels, a limit or what png output can hold
+  QOI_ERROR_TIMEOUT,
+  QOI_ERROR_NO_MEMORY,
+  QOI_ERROR_ARGUMENT, // Rectangle, thumbnail or raw layout that does not fit the image or file
+  QOI_STATUS_COUNT
+};
+
+const char* qoiStatusNames[QOI_STATUS_COUNT] = {
+  "ok", "bad end chunk", "partial", "io", "format", "corrupt", "checksum", "too large", "timeout", "no memory", "argument"
+};
+
+#define QOI_FAILED(status) ((status) >= QOI_ERROR_IO)
+
+// Status of a call and the message for it. Start with {QOI_OK} and pass it down the calls.
+struct qoi_error {
+  enum qoi_status status;
+  char detail[192];
+};
+
+// Records status with a printf style detail in error (may be NULL). The first failure is kept,
+// warnings only replace milder warnings. Returns 0 for `return qoiFail(...)`.
+__attribute__((format(printf, 3, 4)))
+int qoiFail(struct qoi_error* error, enum qoi_status status, const char* format, ...) {
+  if (error == NULL || QOI_FAILED(error->status) || (!QOI_FAILED(status) && status <= error->status)) {
+    return 0;
+  }
+  error->status = status;
+  va_list arguments;
+  va_start(arguments, format);
+  vsnprintf(error->detail, sizeof(error->detail), format, arguments);
+  va_end(arguments);
+  return 0;
+}
+
 struct rgba {
   uint8_t r;
   uint8_t g;
@@ -29,6 +122,17 @@ struct rgba {
 // 64-bit end chunk (format specified, not needed for decoding)
 const uint64_t QOI_END_CHUNK = 0x0000000000000001;
 
+// Magic of the compressed container written with --lz, see compressQoiz
+const char QOIZ_MAGIC[4] = "qoiz";
+
+// Magic of the tiled container written with --tile, see encodeTiled
+const char QOIT_MAGIC[4] = "qoit";
+
+// Optional chunk after QOI_END_CHUNK written with --checksum: magic, uint64 BE pixel checksum,
+// uint64 BE stream checksum (see struct qoi_checksums). Decoders that stop at the end chunk ignore it.
+const char QOI_CHECKSUM_MAGIC[4] = "qoih";
+const uint8_t checksumChunkSize = 4+8+8;
+
 // 8-bit tags
 const uint8_t QOI_OP_RGB = 0b11111110; // this, R byte, G byte, B byte
 const uint8_t QOI_OP_RGBA = 0b11111111; // this, R byte, G byte, B byte, A byte
@@ -39,85 +143,554 @@ const uint8_t QOI_OP_DIFF = 0b01 << 6; // this, 2 bit R, 2 bit G, 2 bit B (-2..1
 const uint8_t QOI_OP_LUMA = 0b10 << 6; // this, 6 bit G, 4 bit R-G, 4 bit B-G. G (-32..31) with bias 32, R-G and B-G (-8..7) with bias 8. Wraparound
 const uint8_t QOI_OP_RUN = 0b11 << 6; // this, 6 bit run length (1..62) with bias -1 (0b00 = 1). 63 and 64 are forbidden due to clash with 8-bit tags.
 
+// Optional encoder instrumentation. Compile with -DQOI_STATS to enable, all
+// counting compiles away otherwise.
+#ifdef QOI_STATS
+struct qoi_encode_stats {
+  uint64_t pixels;
+  uint64_t bytes; // Total file size including header and end chunk
+  uint64_t opIndex;
+  uint64_t opDiff;
+  uint64_t opLuma;
+  uint64_t opRgb;
+  uint64_t opRgba;
+  uint64_t opRun; // Run ops written, including the capped ones
+  uint64_t runMax; // Runs that hit the 62 cap
+  uint64_t indexLookups; // Pixels that probed runningArray
+  uint64_t indexCollisions; // Probes that found a slot holding a different, previously stored pixel
+};
+
+// Stats of the last encode on this thread. Thread local, so encodes on the pool (tiles, batch)
+// do not race: they count into their worker's copy and only single-threaded callers such as
+// the benchmark in main() read them.
+_Thread_local struct qoi_encode_stats qoiEncodeStats;
+
+#define QOI_STAT(statement) statement
+#else
+#define QOI_STAT(statement)
+#endif
+
 uint8_t getIndex(struct rgba rbgaStruct) {
   return (rbgaStruct.r * 3 + rbgaStruct.g * 5 + rbgaStruct.b * 7 + rbgaStruct.a * 11) % 64;
 }
 
-void decode(const char* infile, const char* outfile) {
-  FILE* file = fopen(infile, "rb");
-  if (file == NULL) {
-    printf("FILE NOT FOUND\n");
+// xxHash64 (XXH64 by Yann Collet, BSD 2-clause), streaming. Used for cache keys and the pixel and stream checksums.
+const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+struct xxh64_state {
+  uint64_t total;
+  uint64_t v[4];
+  uint8_t buffer[32];
+  uint32_t buffered;
+  uint64_t seed;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64Round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME64_2;
+  return rotl64(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64Merge(uint64_t acc, uint64_t value) {
+  acc ^= xxh64Round(0, value);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Little endian reads, the hash is defined on little endian words
+static inline uint64_t readLE64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, 8);
+  return __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? __builtin_bswap64(value) : value;
+}
+
+static inline uint32_t readLE32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? __builtin_bswap32(value) : value;
+}
+
+void xxh64Init(struct xxh64_state* state, uint64_t seed) {
+  memset(state, 0, sizeof(struct xxh64_state));
+  state->seed = seed;
+  state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+  state->v[1] = seed + XXH_PRIME64_2;
+  state->v[2] = seed;
+  state->v[3] = seed - XXH_PRIME64_1;
+}
+
+void xxh64Update(struct xxh64_state* state, const void* data, size_t size) {
+  const uint8_t* p = data;
+  state->total += size;
+  if (state->buffered + size < 32) {
+    memcpy(state->buffer + state->buffered, p, size);
+    state->buffered += size;
     return;
   }
+  if (state->buffered > 0) {
+    size_t fill = 32 - state->buffered;
+    memcpy(state->buffer + state->buffered, p, fill);
+    for (int i = 0; i < 4; i++) {
+      state->v[i] = xxh64Round(state->v[i], readLE64(state->buffer + i * 8));
+    }
+    p += fill;
+    size -= fill;
+    state->buffered = 0;
+  }
+  uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+  for (; size >= 32; p += 32, size -= 32) {
+    v0 = xxh64Round(v0, readLE64(p));
+    v1 = xxh64Round(v1, readLE64(p + 8));
+    v2 = xxh64Round(v2, readLE64(p + 16));
+    v3 = xxh64Round(v3, readLE64(p + 24));
+  }
+  state->v[0] = v0; state->v[1] = v1; state->v[2] = v2; state->v[3] = v3;
+  memcpy(state->buffer, p, size);
+  state->buffered = size;
+}
 
-  struct qoi_header qoiHeader;
-  if (fread(&qoiHeader, headerSize, 1, file) != 1) {
-    printf("Could not read fileheader\n");
-    return;
+uint64_t xxh64Digest(const struct xxh64_state* state) {
+  uint64_t hash;
+  if (state->total >= 32) {
+    hash = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+    for (int i = 0; i < 4; i++) {
+      hash = xxh64Merge(hash, state->v[i]);
+    }
+  } else {
+    hash = state->seed + XXH_PRIME64_5;
   }
-  if (memcmp(qoiHeader.magic, "qoif", 4) != 0) {
-    printf("File is not a qoi file\n");
-    return;
+  hash += state->total;
+  const uint8_t* p = state->buffer;
+  uint32_t size = state->buffered;
+  for (; size >= 8; p += 8, size -= 8) {
+    hash ^= xxh64Round(0, readLE64(p));
+    hash = rotl64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
   }
-  // NOTE! width and height are in big endian. We swap them now for easy usage.
-  qoiHeader.width = __builtin_bswap32(qoiHeader.width);
-  qoiHeader.height = __builtin_bswap32(qoiHeader.height);
+  if (size >= 4) {
+    hash ^= (uint64_t)readLE32(p) * XXH_PRIME64_1;
+    hash = rotl64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+    size -= 4;
+  }
+  for (; size > 0; p++, size--) {
+    hash ^= *p * XXH_PRIME64_5;
+    hash = rotl64(hash, 11) * XXH_PRIME64_1;
+  }
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+uint64_t xxHash64(const void* data, size_t size, uint64_t seed) {
+  struct xxh64_state state;
+  xxh64Init(&state, seed);
+  xxh64Update(&state, data, size);
+  return xxh64Digest(&state);
+}
 
-  // printf("QOI w:%u h:%u channels:%u color:%u\n", qoiHeader.width, qoiHeader.height, qoiHeader.channels, qoiHeader.colorspace);
+// Checksums of a qoi file, computed inside the encode and decode loops (--checksum)
+struct qoi_checksums {
+  uint64_t pixels; // xxHash64 of the image as RGBA, as stored in the stream (after near-lossless)
+  uint64_t stream; // xxHash64 of the file up to and including the end chunk
+};
 
-  size_t totalValues = qoiHeader.height * qoiHeader.width * 4;
-  // printf("Reserving %lu bytes for the image.\n", totalValues);
-  uint8_t* imageData = malloc(totalValues);
-  if (imageData == NULL) {
-    printf("Not enough memory for the image!\n");
-    return;
+struct qoi_checksum_state {
+  struct xxh64_state pixels;
+  struct xxh64_state stream;
+  size_t streamHashed; // Bytes of the output hashed so far
+  uint8_t* row; // One row of RGBA pixels (encoder only)
+};
+
+void initChecksumState(struct qoi_checksum_state* state) {
+  xxh64Init(&state->pixels, 0);
+  xxh64Init(&state->stream, 0);
+  state->streamHashed = 0;
+  state->row = NULL;
+}
+
+// Returns 1 and the stored checksums if the file ends with a checksum chunk after the end chunk.
+int readChecksumChunk(const uint8_t* bytes, size_t size, struct qoi_checksums* checksums) {
+  if (size < headerSize + sizeof(QOI_END_CHUNK) + checksumChunkSize) {
+    return 0;
+  }
+  const uint8_t* chunk = bytes + size - checksumChunkSize;
+  uint64_t endChunkBE = __builtin_bswap64(QOI_END_CHUNK);
+  if (memcmp(chunk, QOI_CHECKSUM_MAGIC, 4) != 0 || memcmp(chunk - 8, &endChunkBE, 8) != 0) {
+    return 0;
+  }
+  memcpy(&checksums->pixels, chunk + 4, 8);
+  memcpy(&checksums->stream, chunk + 12, 8);
+  checksums->pixels = __builtin_bswap64(checksums->pixels);
+  checksums->stream = __builtin_bswap64(checksums->stream);
+  return 1;
+}
+
+// Returns 1 if an image of this size can be handled.
+int checkDimensions(uint32_t width, uint32_t height, struct qoi_error* error) {
+  if ((uint64_t)width * height > qoiMaxPixels) {
+    return qoiFail(error, QOI_ERROR_TOO_LARGE, "Image of %ux%u pixels is larger than the supported %llu pixels",
+                   width, height, (unsigned long long)qoiMaxPixels);
+  }
+  return 1;
+}
+
+// Reads and checks the 14 byte header. Width and height are converted to host byte order.
+// Returns 1 on success.
+int readHeader(const uint8_t* bytes, size_t size, struct qoi_header* qoiHeader, struct qoi_error* error) {
+  if (size < headerSize) {
+    return qoiFail(error, QOI_ERROR_FORMAT, "Could not read fileheader");
+  }
+  memcpy(qoiHeader, bytes, headerSize);
+  if (memcmp(qoiHeader->magic, "qoif", 4) != 0) {
+    return qoiFail(error, QOI_ERROR_FORMAT, "File is not a qoi file");
   }
+  // NOTE! width and height are in big endian. We swap them now for easy usage.
+  qoiHeader->width = __builtin_bswap32(qoiHeader->width);
+  qoiHeader->height = __builtin_bswap32(qoiHeader->height);
+  return checkDimensions(qoiHeader->width, qoiHeader->height, error);
+}
 
+// Decoder state that can be carried over between calls to decodeOps.
+struct qoi_decoder {
+  struct rgba prev;
   struct rgba runningArray[64];
-  struct rgba prev = {0, 0, 0, 255};
-  uint8_t tagByte;
+  uint32_t run; // Pixels of the last QOI_OP_RUN that have not been output yet
+};
+
+void initDecoder(struct qoi_decoder* decoder) {
+  memset(decoder, 0, sizeof(*decoder));
+  decoder->prev = (struct rgba){0, 0, 0, 255};
+}
+
+// Output pixel layouts of the decoder. QOI_FORMAT_PREMULTIPLIED can be or'ed to any
+// of them to multiply the colours by alpha (formats without alpha are then composited on black).
+enum qoi_pixel_format {
+  QOI_FORMAT_RGBA = 0,
+  QOI_FORMAT_BGRA = 1,
+  QOI_FORMAT_ARGB = 2,
+  QOI_FORMAT_RGB = 3,
+  QOI_FORMAT_BGR = 4,
+  QOI_FORMAT_GRAY = 5, // Rec. 601 luma
+  QOI_FORMAT_PREMULTIPLIED = 0x10
+};
+
+uint8_t formatSize(int format) {
+  switch (format & ~QOI_FORMAT_PREMULTIPLIED) {
+    case QOI_FORMAT_RGB:
+    case QOI_FORMAT_BGR:
+      return 3;
+    case QOI_FORMAT_GRAY:
+      return 1;
+    default:
+      return 4;
+  }
+}
+
+// Resource limits for decoding untrusted files (decode and serve --max-*). 0 means no limit,
+// qoiMaxPixels applies regardless.
+struct qoi_limits {
+  uint64_t maxPixels;
+  uint64_t maxBytes; // Of the decoded image in the output format
+  double maxSeconds; // Time budget of one decode
+};
+
+const struct qoi_limits noLimits = {0, 0, 0};
+
+double secondsNow(void);
+
+// Returns 1 if a width x height image decoded to format is within the limits.
+int checkLimits(uint32_t width, uint32_t height, int format, const struct qoi_limits* limits, struct qoi_error* error) {
+  uint64_t pixelCount = (uint64_t)width * height;
+  if (limits->maxPixels > 0 && pixelCount > limits->maxPixels) {
+    return qoiFail(error, QOI_ERROR_TOO_LARGE, "Image of %ux%u pixels is larger than the limit of %llu pixels",
+                   width, height, (unsigned long long)limits->maxPixels);
+  }
+  if (limits->maxBytes > 0 && pixelCount * formatSize(format) > limits->maxBytes) {
+    return qoiFail(error, QOI_ERROR_TOO_LARGE, "Image of %ux%u pixels is larger than the limit of %llu bytes",
+                   width, height, (unsigned long long)limits->maxBytes);
+  }
+  return 1;
+}
+
+// An op takes at least one byte and outputs at most 62 pixels, so opBytes bytes of ops cannot
+// describe more than 62 * opBytes pixels (the bound qoiInfo checks too). Checked before anything
+// is allocated, so a tiny file cannot claim a huge image. Returns 1 if the size is plausible.
+int checkPlausibleSize(uint32_t width, uint32_t height, uint64_t opBytes, struct qoi_error* error) {
+  if ((uint64_t)width * height > opBytes * 62) {
+    return qoiFail(error, QOI_ERROR_CORRUPT, "%llu bytes of ops are too few for an image of %ux%u pixels",
+                   (unsigned long long)opBytes, width, height);
+  }
+  return 1;
+}
+
+// Pixels decoded between two checks of the time budget and the size the output grows by at least
+#define QOI_OUTPUT_BAND (1 << 20)
+
+// Output of a decode, grown while the ops are decoded: memory is committed as the ops really
+// produce pixels instead of as the header claims, and every reserveOutput checks the time budget.
+struct qoi_output {
+  uint8_t* pixels;
+  size_t capacity; // Pixels
+  size_t pixelCount;
+  size_t pixelSize;
+  const struct qoi_limits* limits;
+  double start;
+  struct qoi_error* error;
+};
+
+// Returns 0 if the image is over the limits.
+int initOutput(struct qoi_output* output, uint32_t width, uint32_t height, int format, const struct qoi_limits* limits,
+               struct qoi_error* error) {
+  if (!checkLimits(width, height, format, limits, error)) {
+    return 0;
+  }
+  output->pixels = NULL;
+  output->capacity = 0;
+  output->pixelCount = (size_t)width * height;
+  output->pixelSize = formatSize(format);
+  output->limits = limits;
+  output->start = limits->maxSeconds > 0 ? secondsNow() : 0;
+  output->error = error;
+  return 1;
+}
+
+// Releases the pixels, the output is then empty.
+void freeOutput(struct qoi_output* output) {
+  free(output->pixels);
+  output->pixels = NULL;
+  output->capacity = 0;
+}
+
+// Makes room for the first needed pixels. Returns 0 if out of memory or time, the output is
+// then freed.
+int reserveOutput(struct qoi_output* output, size_t needed) {
+  if (output->limits->maxSeconds > 0 && secondsNow() - output->start > output->limits->maxSeconds) {
+    freeOutput(output);
+    return qoiFail(output->error, QOI_ERROR_TIMEOUT, "Decoding took longer than the limit of %g seconds",
+                   output->limits->maxSeconds);
+  }
+  if (needed <= output->capacity) {
+    return 1;
+  }
+  size_t capacity = output->capacity * 2 > needed ? output->capacity * 2 : needed;
+  capacity = capacity < output->pixelCount ? capacity : output->pixelCount;
+  uint8_t* pixels = realloc(output->pixels, capacity * output->pixelSize + 1);
+  if (pixels == NULL) {
+    freeOutput(output);
+    return qoiFail(output->error, QOI_ERROR_NO_MEMORY, "Not enough memory for the image");
+  }
+  output->pixels = pixels;
+  output->capacity = capacity;
+  return 1;
+}
+
+// Returns the whole image, pixels from decoded on (missing data) are zeroed. NULL if out of memory.
+uint8_t* finishOutput(struct qoi_output* output, size_t decoded) {
+  if (decoded != output->pixelCount) {
+    qoiFail(output->error, QOI_PARTIAL, "Missing data, partially decoded");
+    output->limits = &noLimits;
+    if (!reserveOutput(output, output->pixelCount)) {
+      return NULL;
+    }
+    memset(output->pixels + decoded * output->pixelSize, 0, (output->pixelCount - decoded) * output->pixelSize);
+  }
+  if (output->pixels == NULL) {
+    // Empty image
+    output->pixels = malloc(1);
+    if (output->pixels == NULL) {
+      qoiFail(output->error, QOI_ERROR_NO_MEMORY, "Not enough memory for the image");
+    }
+  }
+  return output->pixels;
+}
+
+// c * a / 255 rounded, without a division
+static inline uint8_t premultiply(uint8_t c, uint8_t a) {
+  uint32_t x = c * a + 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+// Converts a decoded pixel to the output format. With a constant format this inlines to
+// just the needed shuffles.
+static inline __attribute__((always_inline)) uint32_t convertPixel(struct rgba px, const int format) {
+  if ((format & QOI_FORMAT_PREMULTIPLIED) && px.a != 255) {
+    px.r = premultiply(px.r, px.a);
+    px.g = premultiply(px.g, px.a);
+    px.b = premultiply(px.b, px.a);
+  }
+  uint8_t bytes[4];
+  switch (format & ~QOI_FORMAT_PREMULTIPLIED) {
+    case QOI_FORMAT_BGRA:
+    case QOI_FORMAT_BGR:
+      bytes[0] = px.b; bytes[1] = px.g; bytes[2] = px.r; bytes[3] = px.a;
+      break;
+    case QOI_FORMAT_ARGB:
+      bytes[0] = px.a; bytes[1] = px.r; bytes[2] = px.g; bytes[3] = px.b;
+      break;
+    case QOI_FORMAT_GRAY:
+      bytes[0] = (77 * px.r + 150 * px.g + 29 * px.b + 128) >> 8;
+      bytes[1] = bytes[2] = bytes[3] = 0;
+      break;
+    default:
+      bytes[0] = px.r; bytes[1] = px.g; bytes[2] = px.b; bytes[3] = px.a;
+      break;
+  }
+  uint32_t packed;
+  memcpy(&packed, bytes, 4);
+  return packed;
+}
+
+// Outputs as much of the pending run as fits before pixelCount. Returns the new pixel index.
+static inline __attribute__((always_inline)) size_t outputRun(struct qoi_decoder* decoder, uint8_t* out, size_t pixelIndex,
+                                                              size_t pixelCount, uint32_t converted, const size_t pixelSize) {
+  size_t count = pixelCount - pixelIndex < decoder->run ? pixelCount - pixelIndex : decoder->run;
+  decoder->run -= count;
+  if (out != NULL) {
+    for (size_t end = pixelIndex + count; pixelIndex < end; pixelIndex++) {
+      memcpy(out + pixelIndex * pixelSize, &converted, pixelSize);
+    }
+    return pixelIndex;
+  }
+  return pixelIndex + count;
+}
+
+// Longest op in bytes and longest run in pixels. The fast tier of the decoder also stores
+// every pixel with 4 bytes, which needs up to 3 more pixels of room for 1 byte formats.
+#define QOI_MAX_OP_BYTES 5
+#define QOI_FAST_PIXEL_MARGIN (62 + 3)
+
+// The decode loop, instantiated per output format by decodeOps. The pixel is converted
+// once per op, runs store the already converted value.
+//
+// Two tiers: while at least QOI_MAX_OP_BYTES of input and QOI_FAST_PIXEL_MARGIN pixels of
+// output remain, no op can read or write out of bounds, so the fast loop checks nothing per op
+// and writes runs without clamping. The careful loop then checks each op against the input left
+// and clamps runs to the output left (carrying the rest over to the next call) for the last ops.
+static inline __attribute__((always_inline)) size_t decodeOpsKernel(
+    struct qoi_decoder* decoder, const uint8_t* bytes, size_t size, size_t* consumed,
+    uint8_t* out, size_t pixelCount, const int format) {
+  const size_t pixelSize = formatSize(format);
+  struct rgba* runningArray = decoder->runningArray;
+  struct rgba curr = decoder->prev;
+  uint32_t converted = convertPixel(curr, format);
+  size_t p = 0;
   size_t pixelIndex = 0;
-  while (pixelIndex < totalValues && fread(&tagByte, 1, 1, file) == 1) {
-    struct rgba curr = prev;
+
+  // Finish a run that did not fit into the previous call
+  pixelIndex = outputRun(decoder, out, pixelIndex, pixelCount, converted, pixelSize);
+
+  // Fast tier
+  if (size >= QOI_MAX_OP_BYTES && pixelCount >= QOI_FAST_PIXEL_MARGIN) {
+    const size_t fastBytes = size - QOI_MAX_OP_BYTES;
+    const size_t fastPixels = pixelCount - QOI_FAST_PIXEL_MARGIN;
+    while (p <= fastBytes && pixelIndex <= fastPixels) {
+      uint8_t tagByte = bytes[p];
+      if (tagByte == QOI_OP_RGB) {
+        curr.r = bytes[p + 1];
+        curr.g = bytes[p + 2];
+        curr.b = bytes[p + 3];
+        runningArray[getIndex(curr)] = curr;
+        p += 4;
+      } else if (tagByte == QOI_OP_RGBA) {
+        curr.r = bytes[p + 1];
+        curr.g = bytes[p + 2];
+        curr.b = bytes[p + 3];
+        curr.a = bytes[p + 4];
+        runningArray[getIndex(curr)] = curr;
+        p += 5;
+      } else {
+        uint8_t tag2 = tagByte & 0b11000000;
+        int8_t tagRest = tagByte & 0b00111111;
+        if (tag2 == QOI_OP_INDEX) {
+          curr = runningArray[tagRest];
+          p += 1;
+        } else if (tag2 == QOI_OP_DIFF) {
+          curr.r += ((tagRest & 0b00110000) >> 4) - 2;
+          curr.g += ((tagRest & 0b00001100) >> 2) - 2;
+          curr.b += ((tagRest & 0b00000011) >> 0) - 2;
+          runningArray[getIndex(curr)] = curr;
+          p += 1;
+        } else if (tag2 == QOI_OP_LUMA) {
+          int8_t diffGreen = tagRest - 32;
+          uint8_t diffOther = bytes[p + 1];
+          curr.g += diffGreen;
+          int8_t drdg = ((diffOther & 0xF0) >> 4) - 8;
+          int8_t dbdg = (diffOther & 0x0F) - 8;
+          curr.r += drdg + diffGreen;
+          curr.b += dbdg + diffGreen;
+          runningArray[getIndex(curr)] = curr;
+          p += 2;
+        } else {
+          // QOI_OP_RUN, at most 62 pixels which the margin leaves room for
+          runningArray[getIndex(curr)] = curr;
+          p += 1;
+          if (out != NULL) {
+            uint8_t* pixel = out + pixelIndex * pixelSize;
+            for (int i = 0; i <= tagRest; i++) {
+              memcpy(pixel + i * pixelSize, &converted, 4);
+            }
+          }
+          pixelIndex += tagRest + 1;
+          continue;
+        }
+      }
+      if (out != NULL) {
+        converted = convertPixel(curr, format);
+        memcpy(out + pixelIndex * pixelSize, &converted, 4);
+      }
+      pixelIndex++;
+    }
+  }
+
+  // Careful tier
+  while (pixelIndex < pixelCount && p < size) {
+    uint8_t tagByte = bytes[p];
     if (tagByte == QOI_OP_RGB) {
-      size_t read = 0;
-      read += fread(&curr.r, 1, 1, file);
-      read += fread(&curr.g, 1, 1, file);
-      read += fread(&curr.b, 1, 1, file);
-      runningArray[getIndex(curr)] = curr;
-      if (read != 3) {
-        printf("QOI_OP_RGB read failed...\n");
+      if (p + 4 > size) {
         break;
       }
-    } else if (tagByte == QOI_OP_RGBA) {
-      size_t read = 0;
-      read += fread(&curr.r, 1, 1, file);
-      read += fread(&curr.g, 1, 1, file);
-      read += fread(&curr.b, 1, 1, file);
-      read += fread(&curr.a, 1, 1, file);
+      curr.r = bytes[p + 1];
+      curr.g = bytes[p + 2];
+      curr.b = bytes[p + 3];
       runningArray[getIndex(curr)] = curr;
-      if (read != 4) {
-        printf("QOI_OP_RGBA read failed...\n");
+      p += 4;
+    } else if (tagByte == QOI_OP_RGBA) {
+      if (p + 5 > size) {
         break;
       }
+      curr.r = bytes[p + 1];
+      curr.g = bytes[p + 2];
+      curr.b = bytes[p + 3];
+      curr.a = bytes[p + 4];
+      runningArray[getIndex(curr)] = curr;
+      p += 5;
     } else {
       uint8_t tag2 = tagByte & 0b11000000;
       int8_t tagRest = tagByte & 0b00111111;
       if (tag2 == QOI_OP_INDEX) {
         curr = runningArray[tagRest];
+        p += 1;
       } else if (tag2 == QOI_OP_DIFF) {
         curr.r += ((tagRest & 0b00110000) >> 4) - 2;
         curr.g += ((tagRest & 0b00001100) >> 2) - 2;
         curr.b += ((tagRest & 0b00000011) >> 0) - 2;
         runningArray[getIndex(curr)] = curr;
+        p += 1;
       } else if (tag2 == QOI_OP_LUMA) {
-        int8_t diffGreen = tagRest - 32;
-        uint8_t diffOther;
-        size_t read = fread(&diffOther, 1, 1, file);
-        if (read != 1) {
-          printf("QOI_OP_LUMA read failed...\n");
+        if (p + 2 > size) {
           break;
         }
+        int8_t diffGreen = tagRest - 32;
+        uint8_t diffOther = bytes[p + 1];
         curr.g += diffGreen;
         int8_t drdg = ((diffOther & 0xF0) >> 4) - 8;
         int8_t dbdg = (diffOther & 0x0F) - 8;
@@ -125,207 +698,7015 @@ void decode(const char* infile, const char* outfile) {
         curr.b += dbdg + diffGreen;
 
         runningArray[getIndex(curr)] = curr;
-      } else if (tag2 == QOI_OP_RUN) {
-        for (uint8_t i = 0; i < tagRest; i++) {
-          imageData[pixelIndex++] = curr.r;
-          imageData[pixelIndex++] = curr.g;
-          imageData[pixelIndex++] = curr.b;
-          imageData[pixelIndex++] = curr.a;
-        }
+        p += 2;
       } else {
-        printf("Error with decoding...\n");
-        break;
+        // QOI_OP_RUN. The pixel is also stored to runningArray as the run can start
+        // with the default previous pixel that was never stored.
+        runningArray[getIndex(curr)] = curr;
+        p += 1;
+        decoder->run = tagRest + 1;
+        pixelIndex = outputRun(decoder, out, pixelIndex, pixelCount, converted, pixelSize);
+        continue;
       }
     }
 
-    prev = curr;
-    imageData[pixelIndex++] = curr.r;
-    imageData[pixelIndex++] = curr.g;
-    imageData[pixelIndex++] = curr.b;
-    imageData[pixelIndex++] = curr.a;
+    if (out != NULL) {
+      converted = convertPixel(curr, format);
+      memcpy(out + pixelIndex * pixelSize, &converted, pixelSize);
+    }
+    pixelIndex++;
   }
 
-  // Sanity check end chunk (unnecessary for decoding)
-  uint64_t qoiEnd;
-  if (fread(&qoiEnd, sizeof(uint64_t), 1, file) != 1) {
-    printf("Decoded qoi has missing or partially missing end chunk!\n");
+  decoder->prev = curr;
+  *consumed = p;
+  return pixelIndex;
+}
+
+#define QOI_DECODE_CASE(f) case f: return decodeOpsKernel(decoder, bytes, size, consumed, out, pixelCount, f);
+
+// Decodes ops from bytes[0..size) until pixelCount pixels are output or the next op
+// is not completely available. Pixels are written in the given format to out (formatSize
+// bytes each), or skipped if out is NULL. Returns the number of pixels output and sets
+// consumed to the number of bytes used. Can be called again with the rest of the stream
+// (starting with the unconsumed bytes).
+size_t decodeOps(struct qoi_decoder* decoder, const uint8_t* bytes, size_t size, size_t* consumed,
+                 uint8_t* out, size_t pixelCount, int format) {
+  if (out == NULL) {
+    // State only variant for skipped pixels, without any stores
+    return decodeOpsKernel(decoder, bytes, size, consumed, NULL, pixelCount, QOI_FORMAT_RGBA);
   }
-  qoiEnd = __builtin_bswap64(qoiEnd);
-  if (qoiEnd != QOI_END_CHUNK) {
-    printf("Decoded qoi has incorrect end chunk %lX\n", qoiEnd);
+  switch (format) {
+    QOI_DECODE_CASE(QOI_FORMAT_BGRA)
+    QOI_DECODE_CASE(QOI_FORMAT_ARGB)
+    QOI_DECODE_CASE(QOI_FORMAT_RGB)
+    QOI_DECODE_CASE(QOI_FORMAT_BGR)
+    QOI_DECODE_CASE(QOI_FORMAT_GRAY)
+    QOI_DECODE_CASE(QOI_FORMAT_RGBA | QOI_FORMAT_PREMULTIPLIED)
+    QOI_DECODE_CASE(QOI_FORMAT_BGRA | QOI_FORMAT_PREMULTIPLIED)
+    QOI_DECODE_CASE(QOI_FORMAT_ARGB | QOI_FORMAT_PREMULTIPLIED)
+    QOI_DECODE_CASE(QOI_FORMAT_RGB | QOI_FORMAT_PREMULTIPLIED)
+    QOI_DECODE_CASE(QOI_FORMAT_BGR | QOI_FORMAT_PREMULTIPLIED)
+    QOI_DECODE_CASE(QOI_FORMAT_GRAY | QOI_FORMAT_PREMULTIPLIED)
+    default:
+      return decodeOpsKernel(decoder, bytes, size, consumed, out, pixelCount, QOI_FORMAT_RGBA);
   }
+}
 
-  if (pixelIndex != totalValues) {
-    printf("Missing data, partially decoded!\n");
+// Decodes the rectangle [fromX, toX) x [fromY, toY) of an image that is imageWidth pixels wide
+// from its ops. Pixels before the rectangle only update the decoder state, only the columns
+// of the rectangle are stored (rows outStride bytes apart in out) and decoding stops after
+// the last row of the rectangle. Returns 1 if all needed ops were present.
+int decodeOpsRect(struct qoi_decoder* decoder, const uint8_t* ops, size_t size, uint32_t imageWidth,
+                  uint32_t fromX, uint32_t toX, uint32_t fromY, uint32_t toY, uint8_t* out, size_t outStride, int format) {
+  const size_t width = toX - fromX;
+  size_t skip = (size_t)fromY * imageWidth + fromX;
+  size_t consumed;
+  size_t p = 0;
+  for (uint32_t y = fromY; y < toY; y++, out += outStride) {
+    if (skip > 0) {
+      if (decodeOps(decoder, ops + p, size - p, &consumed, NULL, skip, format) != skip) {
+        return 0;
+      }
+      p += consumed;
+    }
+    if (decodeOps(decoder, ops + p, size - p, &consumed, out, width, format) != width) {
+      return 0;
+    }
+    p += consumed;
+    // Right of this row and left of the next
+    skip = imageWidth - width;
   }
-  stbi_write_png(outfile, qoiHeader.width, qoiHeader.height, 4, imageData, qoiHeader.width * 4);
+  return 1;
+}
 
-  free(imageData);
+// Decodes a rectangle of a qoi file in memory to a malloc'd buffer of width * height pixels in the
+// given format, without materializing the rest of the image (see decodeOpsRect). The header is
+// returned unchanged. Returns NULL on failure.
+uint8_t* decodeRect(const uint8_t* bytes, size_t size, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                    int format, struct qoi_header* qoiHeader, struct qoi_error* error) {
+  if (!readHeader(bytes, size, qoiHeader, error) ||
+      !checkPlausibleSize(qoiHeader->width, qoiHeader->height, size - headerSize, error)) {
+    return NULL;
+  }
+  if (width == 0 || height == 0 || x >= qoiHeader->width || y >= qoiHeader->height ||
+      width > qoiHeader->width - x || height > qoiHeader->height - y) {
+    qoiFail(error, QOI_ERROR_ARGUMENT, "Rectangle is outside of the image");
+    return NULL;
+  }
+  const size_t pixelSize = formatSize(format);
+  // Zeroed, so pixels missing from a truncated file are zero as in the other decoders
+  uint8_t* out = calloc((size_t)width * height, pixelSize);
+  if (out == NULL) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the image");
+    return NULL;
+  }
+  struct qoi_decoder decoder;
+  initDecoder(&decoder);
+  if (!decodeOpsRect(&decoder, bytes + headerSize, size - headerSize, qoiHeader->width,
+                     x, x + width, y, y + height, out, (size_t)width * pixelSize, format)) {
+    qoiFail(error, QOI_PARTIAL, "Missing data, partially decoded");
+  }
+  return out;
 }
 
-void encode(const char* infile, const char* outfile) {
-  int width;
-  int height;
-  int channels;
-  if(!stbi_info(infile, &width, &height, &channels)) {
-    printf("Cannot read image info from infile %s.\n", infile);
-    return;
+// Reads a whole file into a malloc'd buffer. Returns NULL on failure.
+uint8_t* readFile(const char* path, size_t* size, struct qoi_error* error) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    qoiFail(error, QOI_ERROR_IO, "File %s not found", path);
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long fileSize = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t* bytes = fileSize >= 0 ? malloc(fileSize > 0 ? fileSize : 1) : NULL;
+  if (bytes == NULL) {
+    qoiFail(error, fileSize >= 0 ? QOI_ERROR_NO_MEMORY : QOI_ERROR_IO, "Could not load file %s", path);
+    fclose(file);
+    return NULL;
+  }
+  if (fread(bytes, 1, fileSize, file) != (size_t)fileSize) {
+    qoiFail(error, QOI_ERROR_IO, "Could not read file %s", path);
+    free(bytes);
+    fclose(file);
+    return NULL;
   }
+  fclose(file);
+  *size = fileSize;
+  return bytes;
+}
 
-  if(channels != 3) {
-    channels = 4;
+// Sanity check end chunk (unnecessary for decoding), a problem is only a warning
+void checkEndChunk(const uint8_t* bytes, size_t size, struct qoi_error* error) {
+  uint64_t qoiEnd;
+  if (size < sizeof(uint64_t)) {
+    qoiFail(error, QOI_BAD_END_CHUNK, "Decoded qoi has missing or partially missing end chunk");
+    return;
+  }
+  memcpy(&qoiEnd, bytes, sizeof(uint64_t));
+  qoiEnd = __builtin_bswap64(qoiEnd);
+  if (qoiEnd != QOI_END_CHUNK) {
+    qoiFail(error, QOI_BAD_END_CHUNK, "Decoded qoi has incorrect end chunk %lX", qoiEnd);
   }
+}
 
-  uint8_t* pixels = (uint8_t *)stbi_load(infile, &width, &height, NULL, channels);
+// Decodes a qoi file in memory to a malloc'd buffer in the given pixel format, within the limits.
+// Returns NULL on failure.
+uint8_t* decodeVerified(const uint8_t* bytes, size_t size, struct qoi_header* qoiHeader, int format,
+                        const struct qoi_checksums* expected, struct qoi_checksums* checksums,
+                        const struct qoi_limits* limits, struct qoi_error* error);
 
-  if (pixels == NULL) {
-    printf("Couldn't load image file.\n");
-    return;
+uint8_t* decodeLimited(const uint8_t* bytes, size_t size, struct qoi_header* qoiHeader, int format,
+                       const struct qoi_limits* limits, struct qoi_error* error) {
+  struct qoi_checksums checksums;
+  if (readChecksumChunk(bytes, size, &checksums)) {
+    // Files with a checksum chunk are always verified
+    return decodeVerified(bytes, size, qoiHeader, format, &checksums, NULL, limits, error);
+  }
+  struct qoi_output output;
+  if (!readHeader(bytes, size, qoiHeader, error) ||
+      !checkPlausibleSize(qoiHeader->width, qoiHeader->height, size - headerSize, error) ||
+      !initOutput(&output, qoiHeader->width, qoiHeader->height, format, limits, error)) {
+    return NULL;
   }
 
-  FILE* file = fopen(outfile, "wb");
-  if (file == NULL) {
-    printf("FILE NOT FOUND\n");
-    return;
+  // printf("QOI w:%u h:%u channels:%u color:%u\n", qoiHeader->width, qoiHeader->height, qoiHeader->channels, qoiHeader->colorspace);
+
+  struct qoi_decoder decoder;
+  initDecoder(&decoder);
+  size_t p = headerSize;
+  size_t decoded = 0;
+  while (decoded < output.pixelCount) {
+    size_t count = output.pixelCount - decoded < QOI_OUTPUT_BAND ? output.pixelCount - decoded : QOI_OUTPUT_BAND;
+    if (!reserveOutput(&output, decoded + count)) {
+      return NULL;
+    }
+    size_t consumed;
+    size_t done = decodeOps(&decoder, bytes + p, size - p, &consumed, output.pixels + decoded * output.pixelSize,
+                            count, format);
+    p += consumed;
+    decoded += done;
+    if (done < count) {
+      break;
+    }
   }
+  checkEndChunk(bytes + p, size - p, error);
+  return finishOutput(&output, decoded);
+}
 
-  // TODO: now all images are marked as sRGB. Enable linear rgb
-  const uint8_t colorspace = 1;
-  struct qoi_header qoiHeader = {"qoif", width, height, channels, colorspace};
+uint8_t* decodeMemory(const uint8_t* bytes, size_t size, struct qoi_header* qoiHeader, int format,
+                      struct qoi_error* error) {
+  return decodeLimited(bytes, size, qoiHeader, format, &noLimits, error);
+}
 
-  size_t totalValues = ((size_t)qoiHeader.width) * qoiHeader.height * qoiHeader.channels;
-  // printf("Width %u height %u channels %u (%lu).\n", qoiHeader.width, qoiHeader.height, channels, totalValues);
+// Converts RGBA pixels to format, instantiated per format like decodeOps.
+static inline __attribute__((always_inline)) void convertPixelsKernel(const uint8_t* rgba, uint8_t* out, size_t count,
+                                                                      const int format) {
+  const size_t pixelSize = formatSize(format);
+  for (size_t i = 0; i < count; i++) {
+    struct rgba px;
+    memcpy(&px, rgba + i * 4, 4);
+    uint32_t converted = convertPixel(px, format);
+    memcpy(out + i * pixelSize, &converted, pixelSize);
+  }
+}
 
-  uint32_t widthBE = __builtin_bswap32(qoiHeader.width);
-  uint32_t heightBE = __builtin_bswap32(qoiHeader.height);
-  fwrite(&qoiHeader.magic, 4, 1, file);
-  fwrite(&widthBE, 4, 1, file);
-  fwrite(&heightBE, 4, 1, file);
-  fwrite(&channels, 1, 1, file);
-  fwrite(&qoiHeader.colorspace, 1, 1, file);
+#define QOI_CONVERT_CASE(f) case f: convertPixelsKernel(rgba, out, count, f); break;
 
-  const int hasAlpha = channels == 4;
-  uint8_t runlength = 0;
-  size_t pixelIndex = 0;
-  struct rgba prev = {0, 0, 0, 255};
-  struct rgba runningArray[64]; // Zero-initialized
-  while (pixelIndex < totalValues) {
-    uint8_t r = *(pixels + pixelIndex++);
-    uint8_t g = *(pixels + pixelIndex++);
-    uint8_t b = *(pixels + pixelIndex++);
-    uint8_t a = hasAlpha ? *(pixels + pixelIndex++) : 255;
-    struct rgba curr = {r, g, b, a};
-    if (prev.r == curr.r && prev.g == curr.g && prev.b == curr.b && prev.a == curr.a) {
-      // RUN using previous pixel
-      ++runlength;
-      // Max 62 runlength. 63 and 64 are reserved.
-      // Note that we use bias -1 so check against 62.
-      if (runlength == 62) {
-        runlength--;
-        runlength |= QOI_OP_RUN;
-        fwrite(&runlength, 1, 1, file);
-        // printf("Max run %02X\n", runlength);
-        runlength = 0;
-      }
+void convertPixels(const uint8_t* rgba, uint8_t* out, size_t count, int format) {
+  switch (format) {
+    QOI_CONVERT_CASE(QOI_FORMAT_BGRA)
+    QOI_CONVERT_CASE(QOI_FORMAT_ARGB)
+    QOI_CONVERT_CASE(QOI_FORMAT_RGB)
+    QOI_CONVERT_CASE(QOI_FORMAT_BGR)
+    QOI_CONVERT_CASE(QOI_FORMAT_GRAY)
+    QOI_CONVERT_CASE(QOI_FORMAT_RGBA | QOI_FORMAT_PREMULTIPLIED)
+    QOI_CONVERT_CASE(QOI_FORMAT_BGRA | QOI_FORMAT_PREMULTIPLIED)
+    QOI_CONVERT_CASE(QOI_FORMAT_ARGB | QOI_FORMAT_PREMULTIPLIED)
+    QOI_CONVERT_CASE(QOI_FORMAT_RGB | QOI_FORMAT_PREMULTIPLIED)
+    QOI_CONVERT_CASE(QOI_FORMAT_BGR | QOI_FORMAT_PREMULTIPLIED)
+    QOI_CONVERT_CASE(QOI_FORMAT_GRAY | QOI_FORMAT_PREMULTIPLIED)
+    default:
+      memcpy(out, rgba, count * 4);
+      break;
+  }
+}
 
-      // Edgecase, using default prev pixel at the start requires runningArray to be updated.
-      // This is due to alpha of default pixel being 255, not 0.
-      if (pixelIndex == (hasAlpha ? 4 : 3)) {
-        runningArray[getIndex(curr)] = curr;
-      }
-      continue;
-    }
+// Decodes like decodeMemory and computes the checksums on the way: the image is decoded in
+// chunks of RGBA pixels that are hashed (and converted to format) while still in cache, together
+// with the ops they came from. If expected is not NULL the result has to match it, otherwise
+// NULL is returned. The computed checksums are returned in checksums when not NULL.
+uint8_t* decodeVerified(const uint8_t* bytes, size_t size, struct qoi_header* qoiHeader, int format,
+                        const struct qoi_checksums* expected, struct qoi_checksums* checksums,
+                        const struct qoi_limits* limits, struct qoi_error* error) {
+  struct qoi_output output;
+  if (!readHeader(bytes, size, qoiHeader, error) ||
+      !checkPlausibleSize(qoiHeader->width, qoiHeader->height, size - headerSize, error) ||
+      !initOutput(&output, qoiHeader->width, qoiHeader->height, format, limits, error)) {
+    return NULL;
+  }
+  const size_t chunkPixels = 4096;
+  size_t pixelCount = output.pixelCount;
+  const size_t pixelSize = output.pixelSize;
+  // RGBA output is hashed in place, other formats go through a small RGBA buffer
+  uint8_t* chunk = format != QOI_FORMAT_RGBA ? malloc(chunkPixels * 4) : NULL;
+  if (format != QOI_FORMAT_RGBA && chunk == NULL) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the image");
+    return NULL;
+  }
 
-    // Save RUN that was stopped before max
-    if (runlength > 0) {
-      // Note that we use bias -1
-      runlength--;
-      runlength |= QOI_OP_RUN;
-      fwrite(&runlength, 1, 1, file);
-      runlength = 0;
+  struct qoi_checksum_state state;
+  initChecksumState(&state);
+  xxh64Update(&state.stream, bytes, headerSize);
+  struct qoi_decoder decoder;
+  initDecoder(&decoder);
+  size_t p = headerSize;
+  size_t decoded = 0;
+  while (decoded < pixelCount) {
+    size_t count = pixelCount - decoded < chunkPixels ? pixelCount - decoded : chunkPixels;
+    if (decoded % QOI_OUTPUT_BAND == 0 && !reserveOutput(&output, decoded + QOI_OUTPUT_BAND)) {
+      free(chunk);
+      return NULL;
+    }
+    uint8_t* rgba = chunk != NULL ? chunk : output.pixels + decoded * 4;
+    size_t consumed;
+    size_t done = decodeOps(&decoder, bytes + p, size - p, &consumed, rgba, count, QOI_FORMAT_RGBA);
+    xxh64Update(&state.pixels, rgba, done * 4);
+    xxh64Update(&state.stream, bytes + p, consumed);
+    if (chunk != NULL) {
+      convertPixels(chunk, output.pixels + decoded * pixelSize, done, format);
     }
+    p += consumed;
+    decoded += done;
+    if (done < count) {
+      break;
+    }
+  }
+  free(chunk);
+  checkEndChunk(bytes + p, size - p, error);
+  xxh64Update(&state.stream, bytes + p, size - p < sizeof(QOI_END_CHUNK) ? size - p : sizeof(QOI_END_CHUNK));
+
+  uint8_t* imageData = finishOutput(&output, decoded);
+  if (imageData == NULL) {
+    return NULL;
+  }
+  struct qoi_checksums result = {xxh64Digest(&state.pixels), xxh64Digest(&state.stream)};
+  if (checksums != NULL) {
+    *checksums = result;
+  }
+  if (expected != NULL && (result.pixels != expected->pixels || result.stream != expected->stream)) {
+    qoiFail(error, QOI_ERROR_CHECKSUM, "Checksum mismatch");
+    free(imageData);
+    return NULL;
+  }
+  return imageData;
+}
 
-    // INDEX
-    uint8_t possibleIndex = getIndex(curr);
-    struct rgba possibleMatch = runningArray[possibleIndex];
-    if (possibleMatch.r == curr.r &&
-        possibleMatch.g == curr.g &&
-        possibleMatch.b == curr.b &&
-        possibleMatch.a == curr.a) {
+// Area (box) filter downscaler fed one decoded row at a time. A source pixel covers
+// [x * dstWidth, (x + 1) * dstWidth) and a destination pixel [d * srcWidth, (d + 1) * srcWidth)
+// on a common integer axis (same for rows), so each source pixel adds to at most two
+// destination pixels per axis with exact integer weights. Colours are weighted by alpha
+// so transparent pixels do not darken the result.
+struct qoi_downscaler {
+  uint32_t srcWidth;
+  uint32_t srcHeight;
+  uint32_t dstWidth;
+  uint32_t dstHeight;
+  uint32_t srcY; // Next source row
+  uint32_t dstY; // Destination row accumulated in acc[0]
+  uint64_t* rowSum; // dstWidth * 4, horizontally filtered current source row
+  uint64_t* acc[2]; // dstWidth * 4 each, destination rows dstY and dstY + 1
+  uint8_t* out; // dstWidth * dstHeight * 4 RGBA
+};
 
-      possibleIndex |= QOI_OP_INDEX;
-      fwrite(&possibleIndex, 1, 1, file);
-      prev = curr;
-      continue;
-    }
+int initDownscaler(struct qoi_downscaler* scaler, uint32_t srcWidth, uint32_t srcHeight, uint32_t dstWidth, uint32_t dstHeight) {
+  memset(scaler, 0, sizeof(*scaler));
+  scaler->srcWidth = srcWidth;
+  scaler->srcHeight = srcHeight;
+  scaler->dstWidth = dstWidth;
+  scaler->dstHeight = dstHeight;
+  scaler->rowSum = malloc((size_t)dstWidth * 4 * sizeof(uint64_t));
+  scaler->acc[0] = calloc((size_t)dstWidth * 4, sizeof(uint64_t));
+  scaler->acc[1] = calloc((size_t)dstWidth * 4, sizeof(uint64_t));
+  scaler->out = malloc((size_t)dstWidth * dstHeight * 4);
+  return scaler->rowSum != NULL && scaler->acc[0] != NULL && scaler->acc[1] != NULL && scaler->out != NULL;
+}
 
-    // Update pixel to runningArray
-    runningArray[getIndex(curr)] = curr;
+void freeDownscaler(struct qoi_downscaler* scaler) {
+  free(scaler->rowSum);
+  free(scaler->acc[0]);
+  free(scaler->acc[1]);
+  free(scaler->out);
+}
 
-    if (hasAlpha && curr.a != prev.a) {
-      // Only way to change alpha (besides index) is RGBA
-      fwrite(&QOI_OP_RGBA, 1, 1, file);
-      fwrite(&curr.r, 1, 1, file);
-      fwrite(&curr.g, 1, 1, file);
-      fwrite(&curr.b, 1, 1, file);
-      fwrite(&curr.a, 1, 1, file);
-      prev = curr;
-      continue;
-    }
-    
-    // Take advantage or wrapping and bias for easy comparisons
-    uint8_t diffr2 = curr.r - prev.r + 2;
-    uint8_t diffg2 = curr.g - prev.g + 2;
-    uint8_t diffb2 = curr.b - prev.b + 2;
-    if (diffr2 <= 3 && diffg2 <= 3 && diffb2 <= 3) {
-      uint8_t fullbyte = QOI_OP_DIFF | (diffr2 << 4) | (diffg2 << 2) | diffb2;
-      fwrite(&fullbyte, 1, 1, file);
-      prev = curr;
-      continue;
+void finishDownscalerRow(struct qoi_downscaler* scaler) {
+  const uint64_t area = (uint64_t)scaler->srcWidth * scaler->srcHeight;
+  uint64_t* acc = scaler->acc[0];
+  uint8_t* out = scaler->out + (size_t)scaler->dstY * scaler->dstWidth * 4;
+  for (uint32_t d = 0; d < scaler->dstWidth; d++) {
+    uint64_t alpha = acc[d * 4 + 3];
+    for (int c = 0; c < 3; c++) {
+      out[d * 4 + c] = alpha > 0 ? (acc[d * 4 + c] + alpha / 2) / alpha : 0;
     }
+    out[d * 4 + 3] = (alpha + area / 2) / area;
+  }
+  memset(acc, 0, (size_t)scaler->dstWidth * 4 * sizeof(uint64_t));
+  scaler->acc[0] = scaler->acc[1];
+  scaler->acc[1] = acc;
+  scaler->dstY++;
+}
 
-    // Take advantage or wrapping and bias for easy comparisons
-    uint8_t diffg3 = curr.g - prev.g;
-    uint8_t diffgg = curr.g - prev.g + 32;
-    uint8_t diffrg = curr.r - prev.r - diffg3 + 8;
-    uint8_t diffbg = curr.b - prev.b - diffg3 + 8;
-    if (diffgg <= 63 && diffrg <= 15 && diffbg <= 15) {
-      uint8_t fullbyte1 = QOI_OP_LUMA | diffgg;
-      uint8_t fullbyte2 = (diffrg << 4) | diffbg;
-      fwrite(&fullbyte1, 1, 1, file);
-      fwrite(&fullbyte2, 1, 1, file);
-      prev = curr;
-      continue;
+// Adds one source row of RGBA pixels.
+void downscaleRow(struct qoi_downscaler* scaler, const uint8_t* row) {
+  const uint32_t srcWidth = scaler->srcWidth;
+  const uint32_t dstWidth = scaler->dstWidth;
+  uint64_t* rowSum = scaler->rowSum;
+  memset(rowSum, 0, (size_t)dstWidth * 4 * sizeof(uint64_t));
+  uint64_t start = 0;
+  for (uint32_t x = 0; x < srcWidth; x++, row += 4, start += dstWidth) {
+    uint32_t d = start / srcWidth;
+    uint64_t boundary = (uint64_t)(d + 1) * srcWidth;
+    uint64_t weight = start + dstWidth <= boundary ? dstWidth : boundary - start;
+    uint64_t alpha = row[3];
+    uint64_t* sum = rowSum + (size_t)d * 4;
+    sum[0] += row[0] * alpha * weight;
+    sum[1] += row[1] * alpha * weight;
+    sum[2] += row[2] * alpha * weight;
+    sum[3] += alpha * weight;
+    if (weight < dstWidth) {
+      // Rest goes to the next destination pixel
+      weight = dstWidth - weight;
+      sum += 4;
+      sum[0] += row[0] * alpha * weight;
+      sum[1] += row[1] * alpha * weight;
+      sum[2] += row[2] * alpha * weight;
+      sum[3] += alpha * weight;
     }
+  }
 
-    // Use RGB if nothing else works
-    fwrite(&QOI_OP_RGB, 1, 1, file);
-    fwrite(&curr.r, 1, 1, file);
-    fwrite(&curr.g, 1, 1, file);
-    fwrite(&curr.b, 1, 1, file);
-    prev = curr;
+  uint64_t top = (uint64_t)scaler->srcY * scaler->dstHeight;
+  uint64_t boundary = (uint64_t)(scaler->dstY + 1) * scaler->srcHeight;
+  uint64_t weight = top + scaler->dstHeight <= boundary ? scaler->dstHeight : boundary - top;
+  for (size_t i = 0; i < (size_t)dstWidth * 4; i++) {
+    scaler->acc[0][i] += rowSum[i] * weight;
+    scaler->acc[1][i] += rowSum[i] * (scaler->dstHeight - weight);
+  }
+  scaler->srcY++;
+  if ((uint64_t)scaler->srcY * scaler->dstHeight >= boundary) {
+    finishDownscalerRow(scaler);
   }
+}
 
-  // Save RUN if it was still ongoing
-  if (runlength > 0) {
-    // Note that we use bias -1
-    runlength--;
-    runlength |= QOI_OP_RUN;
-    fwrite(&runlength, 1, 1, file);
-    runlength = 0;
+// Decodes a qoi file in memory straight into a dstWidth x dstHeight thumbnail (area filter).
+// Only one source row and a few destination row accumulators are held besides the result.
+// The pixel limit applies to the source image, which is what gets decoded, the byte limit to
+// the thumbnail and the time budget is checked once per band of source pixels.
+// Returns malloc'd RGBA pixels or NULL.
+uint8_t* decodeThumbnail(const uint8_t* bytes, size_t size, uint32_t dstWidth, uint32_t dstHeight, struct qoi_header* qoiHeader,
+                         const struct qoi_limits* limits, struct qoi_error* error) {
+  const struct qoi_limits sourceLimits = {limits->maxPixels, 0, 0};
+  const struct qoi_limits thumbnailLimits = {0, limits->maxBytes, 0};
+  if (!readHeader(bytes, size, qoiHeader, error) ||
+      !checkPlausibleSize(qoiHeader->width, qoiHeader->height, size - headerSize, error) ||
+      !checkLimits(qoiHeader->width, qoiHeader->height, QOI_FORMAT_RGBA, &sourceLimits, error) ||
+      !checkLimits(dstWidth, dstHeight, QOI_FORMAT_RGBA, &thumbnailLimits, error)) {
+    return NULL;
+  }
+  if (dstWidth == 0 || dstHeight == 0 || dstWidth > qoiHeader->width || dstHeight > qoiHeader->height) {
+    qoiFail(error, QOI_ERROR_ARGUMENT, "Thumbnail must be between 1x1 and the image size");
+    return NULL;
+  }
+  struct qoi_downscaler scaler = {0}; // Freeable also when initDownscaler is skipped
+  uint8_t* row = malloc((size_t)qoiHeader->width * 4);
+  if (row == NULL || !initDownscaler(&scaler, qoiHeader->width, qoiHeader->height, dstWidth, dstHeight)) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the thumbnail");
+    free(row);
+    freeDownscaler(&scaler);
+    return NULL;
   }
 
-  // printf("Pixels %lu total %lu\n", pixelIndex, totalValues);
+  struct qoi_decoder decoder;
+  initDecoder(&decoder);
+  const uint8_t* ops = bytes + headerSize;
+  size_t opsSize = size - headerSize;
+  size_t consumed;
+  const double start = limits->maxSeconds > 0 ? secondsNow() : 0;
+  uint64_t nextCheck = 0;
+  for (uint32_t y = 0; y < qoiHeader->height; y++) {
+    if ((uint64_t)y * qoiHeader->width >= nextCheck) {
+      nextCheck = (uint64_t)y * qoiHeader->width + QOI_OUTPUT_BAND;
+      if (limits->maxSeconds > 0 && secondsNow() - start > limits->maxSeconds) {
+        qoiFail(error, QOI_ERROR_TIMEOUT, "Decoding took longer than the limit of %g seconds", limits->maxSeconds);
+        free(row);
+        freeDownscaler(&scaler);
+        return NULL;
+      }
+    }
+    size_t decoded = decodeOps(&decoder, ops, opsSize, &consumed, row, qoiHeader->width, QOI_FORMAT_RGBA);
+    if (decoded != qoiHeader->width) {
+      qoiFail(error, QOI_PARTIAL, "Missing data, partially decoded");
+      memset(row + decoded * 4, 0, (qoiHeader->width - decoded) * 4);
+    }
+    ops += consumed;
+    opsSize -= consumed;
+    downscaleRow(&scaler, row);
+  }
+  checkEndChunk(ops, opsSize, error);
+  free(row);
 
-  uint64_t endChunkBE = __builtin_bswap64(QOI_END_CHUNK);
-  fwrite(&endChunkBE, 8, 1, file);
+  uint8_t* out = scaler.out;
+  scaler.out = NULL;
+  freeDownscaler(&scaler);
+  qoiHeader->width = dstWidth;
+  qoiHeader->height = dstHeight;
+  return out;
+}
 
-  fclose(file);
+// qoiz container: a qoi file compressed in independent blocks with a byte oriented
+// LZ77 coder (LZ4 style sequences) whose literals are Huffman coded.
+//
+//   "qoiz", uint32 BE max uncompressed block size
+//   per block: uint32 BE stored size (top bit set = stored uncompressed), uint32 BE uncompressed size, data
+//   a block with stored size 0 ends the container
+//
+// Compressed block data:
+//   uint32 BE literal count, [if > 0: 128 bytes of 4 bit code lengths for bytes 0..255,
+//   uint32 BE bitstream size, Huffman bitstream (LSB first)], sequences
+// Sequences:
+//   token (4 bit literal count, 4 bit match length - 4), [extra literal count bytes],
+//   uint16 LE match offset, [extra match length bytes]
+// where a count nibble of 15 continues with bytes that are added until a byte < 255.
+// The literals of a sequence are taken from the decoded literals in order. The last
+// sequence has literals only.
 
-  free(pixels);
-}
+#define QOIZ_BLOCK_SIZE (1 << 20)
+#define QOIZ_STORED 0x80000000u
+#define LZ_HASH_BITS 16
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define HUFFMAN_MAX_BITS 12
+
+// Working memory for compressing one block
+struct lz_workspace {
+  uint32_t hashTable[1 << LZ_HASH_BITS];
+  uint8_t* literals;
+  uint8_t* sequences;
+};
+
+size_t lzCompressBound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+uint8_t* lzWriteCount(uint8_t* dst, size_t count) {
+  for (; count >= 255; count -= 255) {
+    *dst++ = 255;
+  }
+  *dst++ = count;
+  return dst;
+}
+
+uint8_t* lzWriteSequence(uint8_t* dst, size_t literalCount, size_t offset, size_t matchLength) {
+  uint8_t* token = dst++;
+  *token = (literalCount < 15 ? literalCount : 15) << 4;
+  if (literalCount >= 15) {
+    dst = lzWriteCount(dst, literalCount - 15);
+  }
+  if (matchLength == 0) {
+    return dst;
+  }
+  dst[0] = offset & 0xFF;
+  dst[1] = offset >> 8;
+  dst += 2;
+  matchLength -= LZ_MIN_MATCH;
+  *token |= matchLength < 15 ? matchLength : 15;
+  if (matchLength >= 15) {
+    dst = lzWriteCount(dst, matchLength - 15);
+  }
+  return dst;
+}
+
+// Splits src into literals and sequences. Returns the sequence size, literalCount is set.
+size_t lzParse(const uint8_t* src, size_t size, struct lz_workspace* work, size_t* literalCount) {
+  memset(work->hashTable, 0, sizeof(work->hashTable));
+  uint8_t* out = work->sequences;
+  uint8_t* literals = work->literals;
+  size_t anchor = 0;
+  size_t ip = 0;
+  while (ip + LZ_MIN_MATCH <= size) {
+    uint32_t sequence;
+    memcpy(&sequence, src + ip, 4);
+    uint32_t h = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    // Positions are stored + 1 so that 0 means empty
+    size_t candidate = work->hashTable[h];
+    work->hashTable[h] = ip + 1;
+    if (candidate == 0 || ip - (candidate - 1) > LZ_MAX_OFFSET || memcmp(src + candidate - 1, src + ip, 4) != 0) {
+      ip++;
+      continue;
+    }
+    candidate--;
+
+    size_t matchLength = LZ_MIN_MATCH;
+    while (ip + matchLength < size && src[candidate + matchLength] == src[ip + matchLength]) {
+      matchLength++;
+    }
+    memcpy(literals, src + anchor, ip - anchor);
+    literals += ip - anchor;
+    out = lzWriteSequence(out, ip - anchor, ip - candidate, matchLength);
+    ip += matchLength;
+    anchor = ip;
+  }
+  memcpy(literals, src + anchor, size - anchor);
+  literals += size - anchor;
+  out = lzWriteSequence(out, size - anchor, 0, 0);
+  *literalCount = literals - work->literals;
+  return out - work->sequences;
+}
+
+// Computes Huffman code lengths (at most HUFFMAN_MAX_BITS) for the byte frequencies.
+// Frequencies are halved until the tree is shallow enough.
+void huffmanLengths(const uint32_t* frequencies, uint8_t* lengths) {
+  uint32_t freq[256];
+  memcpy(freq, frequencies, sizeof(freq));
+  while (1) {
+    // Nodes 0..255 are leaves, 256.. internal. Simple O(n^2) selection is fine for 256 symbols.
+    uint64_t weight[512];
+    int parent[512];
+    int alive[512];
+    int nodeCount = 256;
+    int symbols = 0;
+    for (int i = 0; i < 256; i++) {
+      weight[i] = freq[i];
+      parent[i] = -1;
+      alive[i] = freq[i] > 0;
+      symbols += alive[i];
+      lengths[i] = 0;
+    }
+    if (symbols <= 1) {
+      for (int i = 0; i < 256; i++) {
+        lengths[i] = freq[i] > 0;
+      }
+      return;
+    }
+    for (int remaining = symbols; remaining > 1; remaining--) {
+      int a = -1;
+      int b = -1;
+      for (int i = 0; i < nodeCount; i++) {
+        if (!alive[i]) {
+          continue;
+        }
+        if (a < 0 || weight[i] < weight[a]) {
+          b = a;
+          a = i;
+        } else if (b < 0 || weight[i] < weight[b]) {
+          b = i;
+        }
+      }
+      weight[nodeCount] = weight[a] + weight[b];
+      parent[nodeCount] = -1;
+      alive[nodeCount] = 1;
+      alive[a] = alive[b] = 0;
+      parent[a] = parent[b] = nodeCount;
+      nodeCount++;
+    }
+    int maxLength = 0;
+    for (int i = 0; i < 256; i++) {
+      if (freq[i] == 0) {
+        continue;
+      }
+      int length = 0;
+      for (int n = i; parent[n] >= 0; n = parent[n]) {
+        length++;
+      }
+      lengths[i] = length;
+      maxLength = length > maxLength ? length : maxLength;
+    }
+    if (maxLength <= HUFFMAN_MAX_BITS) {
+      return;
+    }
+    for (int i = 0; i < 256; i++) {
+      freq[i] = freq[i] > 0 ? (freq[i] + 1) / 2 : 0;
+    }
+  }
+}
+
+// Canonical codes from the lengths, bit reversed for the LSB first bitstream
+void huffmanCodes(const uint8_t* lengths, uint16_t* codes) {
+  uint16_t next = 0;
+  for (int length = 1; length <= HUFFMAN_MAX_BITS; length++) {
+    for (int i = 0; i < 256; i++) {
+      if (lengths[i] != length) {
+        continue;
+      }
+      uint16_t reversed = 0;
+      for (int bit = 0; bit < length; bit++) {
+        reversed |= ((next >> bit) & 1) << (length - 1 - bit);
+      }
+      codes[i] = reversed;
+      next++;
+    }
+    next <<= 1;
+  }
+}
+
+// Huffman codes the literals to dst. Returns the bytes written.
+size_t huffmanCompress(const uint8_t* literals, size_t count, uint8_t* dst) {
+  uint32_t frequencies[256] = {0};
+  for (size_t i = 0; i < count; i++) {
+    frequencies[literals[i]]++;
+  }
+  uint8_t lengths[256];
+  uint16_t codes[256];
+  huffmanLengths(frequencies, lengths);
+  huffmanCodes(lengths, codes);
+  for (int i = 0; i < 256; i += 2) {
+    dst[i / 2] = (lengths[i] << 4) | lengths[i + 1];
+  }
+  uint8_t* out = dst + 128 + 4;
+  uint64_t bitBuffer = 0;
+  int bitCount = 0;
+  for (size_t i = 0; i < count; i++) {
+    bitBuffer |= (uint64_t)codes[literals[i]] << bitCount;
+    bitCount += lengths[literals[i]];
+    while (bitCount >= 8) {
+      *out++ = bitBuffer & 0xFF;
+      bitBuffer >>= 8;
+      bitCount -= 8;
+    }
+  }
+  if (bitCount > 0) {
+    *out++ = bitBuffer & 0xFF;
+  }
+  uint32_t streamSizeBE = __builtin_bswap32(out - (dst + 128 + 4));
+  memcpy(dst + 128, &streamSizeBE, 4);
+  return out - dst;
+}
+
+// Decodes count literals. Returns the bytes read from src, or (size_t)-1 on corrupt input.
+size_t huffmanDecompress(const uint8_t* src, size_t size, uint8_t* literals, size_t count) {
+  if (size < 128 + 4) {
+    return (size_t)-1;
+  }
+  uint8_t lengths[256];
+  uint16_t codes[256];
+  for (int i = 0; i < 256; i += 2) {
+    lengths[i] = src[i / 2] >> 4;
+    lengths[i + 1] = src[i / 2] & 0x0F;
+  }
+  uint32_t streamSize;
+  memcpy(&streamSize, src + 128, 4);
+  streamSize = __builtin_bswap32(streamSize);
+  if (streamSize > size - 128 - 4) {
+    return (size_t)-1;
+  }
+  // Check the Kraft sum so that every table entry gets at most one symbol
+  uint32_t kraft = 0;
+  for (int i = 0; i < 256; i++) {
+    if (lengths[i] > HUFFMAN_MAX_BITS) {
+      return (size_t)-1;
+    }
+    kraft += lengths[i] ? 1u << (HUFFMAN_MAX_BITS - lengths[i]) : 0;
+  }
+  if (kraft > (1u << HUFFMAN_MAX_BITS)) {
+    return (size_t)-1;
+  }
+  huffmanCodes(lengths, codes);
+
+  // Table entry: symbol << 4 | length, length 0 = invalid code
+  uint16_t table[1 << HUFFMAN_MAX_BITS] = {0};
+  for (int i = 0; i < 256; i++) {
+    for (uint32_t e = codes[i]; lengths[i] > 0 && e < (1u << HUFFMAN_MAX_BITS); e += 1u << lengths[i]) {
+      table[e] = (i << 4) | lengths[i];
+    }
+  }
+
+  const uint8_t* in = src + 128 + 4;
+  size_t inPos = 0;
+  uint64_t bitBuffer = 0;
+  int bitCount = 0;
+  uint64_t bitsLeft = (uint64_t)streamSize * 8;
+  for (size_t i = 0; i < count; i++) {
+    while (bitCount <= 56) {
+      // Past the end reads zeros, checked with bitsLeft below
+      bitBuffer |= (uint64_t)(inPos < streamSize ? in[inPos] : 0) << bitCount;
+      inPos++;
+      bitCount += 8;
+    }
+    uint16_t entry = table[bitBuffer & ((1u << HUFFMAN_MAX_BITS) - 1)];
+    uint8_t length = entry & 0x0F;
+    if (length == 0 || length > bitsLeft) {
+      return (size_t)-1;
+    }
+    literals[i] = entry >> 4;
+    bitBuffer >>= length;
+    bitCount -= length;
+    bitsLeft -= length;
+  }
+  return 128 + 4 + streamSize;
+}
+
+// Compresses one block into dst (at least 4 + 132 + lzCompressBound(size) bytes). Returns the size.
+size_t lzCompress(const uint8_t* src, size_t size, uint8_t* dst, struct lz_workspace* work) {
+  size_t literalCount;
+  size_t sequenceSize = lzParse(src, size, work, &literalCount);
+  uint32_t literalCountBE = __builtin_bswap32(literalCount);
+  memcpy(dst, &literalCountBE, 4);
+  size_t p = 4;
+  if (literalCount > 0) {
+    p += huffmanCompress(work->literals, literalCount, dst + p);
+  }
+  memcpy(dst + p, work->sequences, sequenceSize);
+  return p + sequenceSize;
+}
+
+int lzReadCount(const uint8_t* src, size_t size, size_t* ip, size_t* count) {
+  uint8_t b;
+  do {
+    if (*ip >= size) {
+      return 0;
+    }
+    b = src[(*ip)++];
+    *count += b;
+  } while (b == 255);
+  return 1;
+}
+
+// Decompresses a block. literals must hold capacity bytes.
+// Returns the decompressed size, or (size_t)-1 on corrupt input.
+size_t lzDecompress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, uint8_t* literals) {
+  if (size < 4) {
+    return (size_t)-1;
+  }
+  uint32_t literalCount;
+  memcpy(&literalCount, src, 4);
+  literalCount = __builtin_bswap32(literalCount);
+  size_t ip = 4;
+  if (literalCount > capacity) {
+    return (size_t)-1;
+  }
+  if (literalCount > 0) {
+    size_t read = huffmanDecompress(src + ip, size - ip, literals, literalCount);
+    if (read == (size_t)-1) {
+      return (size_t)-1;
+    }
+    ip += read;
+  }
+
+  size_t lp = 0;
+  size_t op = 0;
+  while (ip < size) {
+    uint8_t token = src[ip++];
+    size_t count = token >> 4;
+    if (count == 15 && !lzReadCount(src, size, &ip, &count)) {
+      return (size_t)-1;
+    }
+    if (count > literalCount - lp || count > capacity - op) {
+      return (size_t)-1;
+    }
+    memcpy(dst + op, literals + lp, count);
+    lp += count;
+    op += count;
+    if (ip == size) {
+      break; // Last sequence has no match
+    }
+
+    if (ip + 2 > size) {
+      return (size_t)-1;
+    }
+    size_t offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    size_t matchLength = token & 0x0F;
+    if (matchLength == 15 && !lzReadCount(src, size, &ip, &matchLength)) {
+      return (size_t)-1;
+    }
+    matchLength += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || matchLength > capacity - op) {
+      return (size_t)-1;
+    }
+    const uint8_t* match = dst + op - offset;
+    if (offset >= matchLength) {
+      memcpy(dst + op, match, matchLength);
+    } else {
+      // Overlapping copy repeats the last offset bytes
+      for (size_t i = 0; i < matchLength; i++) {
+        dst[op + i] = match[i];
+      }
+    }
+    op += matchLength;
+  }
+  return lp == literalCount ? op : (size_t)-1;
+}
+
+// Compresses a complete qoi file into a malloc'd qoiz container. Returns NULL on failure.
+uint8_t* compressQoiz(const uint8_t* qoi, size_t qoiSize, size_t* outSize, struct qoi_error* error) {
+  size_t blockCount = (qoiSize + QOIZ_BLOCK_SIZE - 1) / QOIZ_BLOCK_SIZE;
+  size_t maxSize = 8 + blockCount * (8 + 4 + 132) + lzCompressBound(qoiSize) + blockCount * 16 + 8;
+  uint8_t* bytes = malloc(maxSize);
+  struct lz_workspace* work = malloc(sizeof(struct lz_workspace));
+  uint8_t* scratch = malloc(QOIZ_BLOCK_SIZE + lzCompressBound(QOIZ_BLOCK_SIZE));
+  if (bytes == NULL || work == NULL || scratch == NULL) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for compression");
+    free(bytes);
+    free(work);
+    free(scratch);
+    return NULL;
+  }
+  work->literals = scratch;
+  work->sequences = scratch + QOIZ_BLOCK_SIZE;
+
+  size_t p = 0;
+  uint32_t blockSizeBE = __builtin_bswap32(QOIZ_BLOCK_SIZE);
+  memcpy(bytes + p, QOIZ_MAGIC, 4); p += 4;
+  memcpy(bytes + p, &blockSizeBE, 4); p += 4;
+  for (size_t start = 0; start < qoiSize; start += QOIZ_BLOCK_SIZE) {
+    uint32_t rawSize = qoiSize - start < QOIZ_BLOCK_SIZE ? qoiSize - start : QOIZ_BLOCK_SIZE;
+    uint32_t storedSize = lzCompress(qoi + start, rawSize, bytes + p + 8, work);
+    if (storedSize >= rawSize) {
+      // Incompressible, store as is
+      memcpy(bytes + p + 8, qoi + start, rawSize);
+      storedSize = rawSize | QOIZ_STORED;
+    }
+    uint32_t storedSizeBE = __builtin_bswap32(storedSize);
+    uint32_t rawSizeBE = __builtin_bswap32(rawSize);
+    memcpy(bytes + p, &storedSizeBE, 4);
+    memcpy(bytes + p + 4, &rawSizeBE, 4);
+    p += 8 + (storedSize & ~QOIZ_STORED);
+  }
+  memset(bytes + p, 0, 8); p += 8;
+
+  free(scratch);
+  free(work);
+  *outSize = p;
+  return bytes;
+}
+
+// Decompresses a qoiz container and decodes the qoi stream block by block in one pass:
+// every block is decompressed into a buffer that stays in cache and decoded right away.
+// Ops split between blocks are carried over to the next block. Returns malloc'd pixels in the given
+// format or NULL. The size of the qoi stream is only known once it is decompressed, so a stream
+// that ends early is only zero filled (QOI_PARTIAL) when it was plausible for the image size. A
+// block that does not decompress fails with QOI_ERROR_CORRUPT and no pixels.
+uint8_t* decodeQoiz(const uint8_t* bytes, size_t size, struct qoi_header* qoiHeader, int format,
+                    const struct qoi_limits* limits, struct qoi_error* error) {
+  if (size < 8) {
+    qoiFail(error, QOI_ERROR_FORMAT, "Could not read fileheader");
+    return NULL;
+  }
+  uint32_t blockSize;
+  memcpy(&blockSize, bytes + 4, 4);
+  blockSize = __builtin_bswap32(blockSize);
+  // The block size sizes the buffers below, so it is bounded by what compressQoiz writes
+  if (blockSize == 0 || blockSize > QOIZ_BLOCK_SIZE) {
+    qoiFail(error, QOI_ERROR_CORRUPT, "Compressed qoi has an invalid block size");
+    return NULL;
+  }
+
+  // Up to 4 bytes of an incomplete op are carried over in front of the next block
+  const size_t carryMax = 8;
+  uint8_t* block = malloc(carryMax + (size_t)blockSize);
+  uint8_t* literals = malloc(blockSize);
+  if (block == NULL || literals == NULL) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for decompression");
+    free(block);
+    free(literals);
+    return NULL;
+  }
+
+  struct qoi_output output;
+  int started = 0;
+  int failed = 0;
+  uint64_t streamSize = 0;
+  size_t decoded = 0;
+  struct qoi_decoder decoder;
+  initDecoder(&decoder);
+  uint8_t endChunk[8];
+  size_t endChunkSize = 0;
+  size_t carry = 0;
+  size_t p = 8;
+  while (!failed) {
+    if (p + 8 > size) {
+      qoiFail(error, QOI_PARTIAL, "Compressed qoi is truncated");
+      break;
+    }
+    uint32_t storedSize;
+    uint32_t rawSize;
+    memcpy(&storedSize, bytes + p, 4);
+    memcpy(&rawSize, bytes + p + 4, 4);
+    storedSize = __builtin_bswap32(storedSize);
+    rawSize = __builtin_bswap32(rawSize);
+    p += 8;
+    if (storedSize == 0) {
+      break;
+    }
+    size_t dataSize = storedSize & ~QOIZ_STORED;
+    if (dataSize > size - p) {
+      qoiFail(error, QOI_PARTIAL, "Compressed qoi is truncated");
+      break;
+    }
+    // A block that is present but does not decompress fails the whole decode. A stored block
+    // holds exactly its raw bytes.
+    if (rawSize > blockSize || ((storedSize & QOIZ_STORED) && dataSize != rawSize) ||
+        (!(storedSize & QOIZ_STORED) && lzDecompress(bytes + p, dataSize, block + carry, rawSize, literals) != rawSize)) {
+      failed = !qoiFail(error, QOI_ERROR_CORRUPT, "Compressed qoi block is corrupt");
+      break;
+    }
+    if (storedSize & QOIZ_STORED) {
+      memcpy(block + carry, bytes + p, dataSize);
+    }
+    p += dataSize;
+    streamSize += rawSize;
+
+    size_t available = carry + rawSize;
+    size_t start = 0;
+    if (!started) {
+      if (!readHeader(block, available, qoiHeader, error) ||
+          !initOutput(&output, qoiHeader->width, qoiHeader->height, format, limits, error)) {
+        break;
+      }
+      started = 1;
+      start = headerSize;
+    }
+
+    // A block can expand to many pixels, the output grows band by band
+    size_t count;
+    size_t done;
+    do {
+      count = output.pixelCount - decoded < QOI_OUTPUT_BAND ? output.pixelCount - decoded : QOI_OUTPUT_BAND;
+      if (!reserveOutput(&output, decoded + count)) {
+        failed = 1;
+        break;
+      }
+      size_t consumed;
+      done = decodeOps(&decoder, block + start, available - start, &consumed,
+                       output.pixels + decoded * output.pixelSize, count, format);
+      start += consumed;
+      decoded += done;
+    } while (done == count && decoded < output.pixelCount);
+    if (decoded == output.pixelCount) {
+      // Whatever follows the last op is the end chunk
+      for (; start < available && endChunkSize < 8; start++) {
+        endChunk[endChunkSize++] = block[start];
+      }
+      carry = 0;
+    } else {
+      carry = available - start;
+      memmove(block, block + start, carry);
+    }
+  }
+  free(block);
+  free(literals);
+
+  if (!started || failed) {
+    if (started) {
+      freeOutput(&output);
+    }
+    qoiFail(error, QOI_ERROR_CORRUPT, "Compressed qoi holds no image");
+    return NULL;
+  }
+  checkEndChunk(endChunk, endChunkSize, error);
+  if (decoded != output.pixelCount &&
+      !checkPlausibleSize(qoiHeader->width, qoiHeader->height, streamSize - headerSize, error)) {
+    freeOutput(&output);
+    return NULL;
+  }
+  return finishOutput(&output, decoded);
+}
+
+struct qoi_encode_options {
+  // 0 = greedy, first matching op in spec order. Smallest possible raw QOI already.
+  // 1 = among ops of equal size pick the one that repeats earlier output (gzip/brotli friendlier).
+  // 2 = as 1 but scores the candidates by match length with lookahead of the following ops.
+  int effort;
+  // 0 = lossless. Otherwise the largest allowed difference per colour channel (alpha stays exact).
+  // Pixels are nudged within the bound so that they fit cheaper ops, with error diffusion against banding.
+  int maxError;
+  // Write a qoiz container (qoi stream compressed with an LZ coder) instead of a plain qoi file
+  int compress;
+  // > 0 writes a qoit container of independently encoded square tiles of this size
+  uint32_t tileSize;
+  // Threads for tiled encoding, 0 = one per CPU
+  int threads;
+  // Append a checksum chunk after the end chunk (plain qoi only)
+  int checksum;
+};
+
+const struct qoi_encode_options defaultEncodeOptions = {0, 0, 0, 0, 0, 0};
+
+// A position in the encoded stream where more than one 1-byte op decodes to the same pixel.
+struct qoi_tie {
+  size_t pos;
+  uint8_t count;
+  uint8_t candidates[3];
+};
+
+#define QOI_TIE_HASH_BITS 16
+#define QOI_TIE_LOOKAHEAD 64
+
+uint32_t tieHash(const uint8_t* bytes) {
+  uint32_t v;
+  memcpy(&v, bytes, 4);
+  return (v * 2654435761u) >> (32 - QOI_TIE_HASH_BITS);
+}
+
+// Rewrites the tie positions of a finished stream so that the chosen byte continues
+// a sequence that already appeared earlier in the stream. The decoder state (prev and
+// runningArray) does not depend on which op was used for a pixel, so every candidate
+// keeps the stream valid and the raw size stays the same. Only the redundancy seen by
+// a general purpose compressor on top of it changes.
+void resolveTies(uint8_t* bytes, size_t start, size_t size, const struct qoi_tie* ties, size_t tieCount, int effort) {
+  size_t* lastSeen = calloc(1 << QOI_TIE_HASH_BITS, sizeof(size_t));
+  if (lastSeen == NULL) {
+    return; // Keep greedy choices
+  }
+  size_t pos = start;
+  for (size_t t = 0; t < tieCount; t++) {
+    const struct qoi_tie* tie = &ties[t];
+    if (tie->pos < start + 3) {
+      continue;
+    }
+    // Record history up to the tie (positions store index+1 so that 0 means empty)
+    for (; pos + 4 <= tie->pos; pos++) {
+      lastSeen[tieHash(bytes + pos)] = pos + 1;
+    }
+
+    uint8_t best = bytes[tie->pos];
+    size_t bestScore = 0;
+    for (uint8_t c = 0; c < tie->count; c++) {
+      bytes[tie->pos] = tie->candidates[c];
+      size_t match = lastSeen[tieHash(bytes + tie->pos - 3)];
+      if (match == 0 || memcmp(bytes + match - 1, bytes + tie->pos - 3, 4) != 0) {
+        continue;
+      }
+      size_t score = 1;
+      if (effort >= 2) {
+        // Count how far the match continues into the following (greedy) ops
+        const uint8_t* from = bytes + match - 1 + 4;
+        const uint8_t* to = bytes + tie->pos + 1;
+        size_t limit = size - (tie->pos + 1);
+        limit = limit < QOI_TIE_LOOKAHEAD ? limit : QOI_TIE_LOOKAHEAD;
+        while (score <= limit && from[score - 1] == to[score - 1]) {
+          score++;
+        }
+      }
+      if (score > bestScore) {
+        bestScore = score;
+        best = tie->candidates[c];
+      }
+    }
+    bytes[tie->pos] = best;
+  }
+  free(lastSeen);
+}
+
+// Near-lossless encoding state. Errors are kept per channel in 1/16 units for
+// Floyd-Steinberg diffusion to the next pixel and to the row below.
+struct qoi_near_lossless {
+  int maxError;
+  uint32_t width;
+  uint32_t x;
+  int32_t* errCurr; // (width + 2) * 3, offset by one pixel so x - 1 and x + 1 are always valid
+  int32_t* errNext;
+};
+
+int clampInt(int v, int lo, int hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// Picks the pixel closest to the error diffused target that is still within maxError
+// of orig for every colour channel, preferring pixels that fit a cheap op:
+// RUN, INDEX or DIFF (1 byte or less), LUMA (2 bytes), and finally RGB/RGBA with the target itself.
+// Alpha is always kept exact. The returned pixel is then encoded losslessly.
+struct rgba nearLosslessPixel(struct qoi_near_lossless* nl, struct rgba orig, struct rgba prev, const struct rgba* runningArray) {
+  const int e = nl->maxError;
+  const int o[3] = {orig.r, orig.g, orig.b};
+  const int p[3] = {prev.r, prev.g, prev.b};
+  int lo[3], hi[3], t[3];
+  for (int c = 0; c < 3; c++) {
+    lo[c] = clampInt(o[c] - e, 0, 255);
+    hi[c] = clampInt(o[c] + e, 0, 255);
+    int diffused = o[c] * 16 + nl->errCurr[(nl->x + 1) * 3 + c];
+    t[c] = clampInt((diffused + 8) >> 4, lo[c], hi[c]);
+  }
+
+  struct rgba best = {t[0], t[1], t[2], orig.a};
+  int found = 0;
+  int bestDist = 0;
+  if (prev.a == orig.a &&
+      p[0] >= lo[0] && p[0] <= hi[0] && p[1] >= lo[1] && p[1] <= hi[1] && p[2] >= lo[2] && p[2] <= hi[2]) {
+    // RUN
+    best = prev;
+    found = 1;
+  }
+
+  if (!found) {
+    // INDEX, any slot within bounds can be referenced
+    for (int i = 0; i < 64; i++) {
+      struct rgba s = runningArray[i];
+      if (s.a != orig.a || s.r < lo[0] || s.r > hi[0] || s.g < lo[1] || s.g > hi[1] || s.b < lo[2] || s.b > hi[2]) {
+        continue;
+      }
+      int dist = abs(s.r - t[0]) + abs(s.g - t[1]) + abs(s.b - t[2]);
+      if (!found || dist < bestDist) {
+        best = s;
+        bestDist = dist;
+        found = 1;
+      }
+    }
+  }
+
+  if (prev.a == orig.a && (!found || bestDist > 0)) {
+    // DIFF, -2..1 from prev per channel
+    int v[3];
+    int ok = 1;
+    for (int c = 0; c < 3 && ok; c++) {
+      int vlo = p[c] - 2 > lo[c] ? p[c] - 2 : lo[c];
+      int vhi = p[c] + 1 < hi[c] ? p[c] + 1 : hi[c];
+      ok = vlo <= vhi;
+      v[c] = clampInt(t[c], vlo, vhi);
+    }
+    int dist = abs(v[0] - t[0]) + abs(v[1] - t[1]) + abs(v[2] - t[2]);
+    if (ok && (!found || dist < bestDist)) {
+      best = (struct rgba){v[0], v[1], v[2], orig.a};
+      bestDist = dist;
+      found = 1;
+    }
+  }
+
+  if (!found && prev.a == orig.a) {
+    // LUMA, green -32..31 from prev and red/blue -8..7 relative to the green difference.
+    // Intersect the green difference ranges allowed by each channel.
+    int dgLo = lo[1] - p[1] > -32 ? lo[1] - p[1] : -32;
+    int dgHi = hi[1] - p[1] < 31 ? hi[1] - p[1] : 31;
+    for (int c = 0; c < 3; c += 2) {
+      dgLo = lo[c] - p[c] - 7 > dgLo ? lo[c] - p[c] - 7 : dgLo;
+      dgHi = hi[c] - p[c] + 8 < dgHi ? hi[c] - p[c] + 8 : dgHi;
+    }
+    if (dgLo <= dgHi) {
+      int dg = clampInt(t[1] - p[1], dgLo, dgHi);
+      int v[3];
+      v[1] = p[1] + dg;
+      for (int c = 0; c < 3; c += 2) {
+        int vlo = p[c] + dg - 8 > lo[c] ? p[c] + dg - 8 : lo[c];
+        int vhi = p[c] + dg + 7 < hi[c] ? p[c] + dg + 7 : hi[c];
+        v[c] = clampInt(t[c], vlo, vhi);
+      }
+      best = (struct rgba){v[0], v[1], v[2], orig.a};
+      found = 1;
+    }
+  }
+
+  // Diffuse the error between the wanted and the chosen value
+  const int chosen[3] = {best.r, best.g, best.b};
+  for (int c = 0; c < 3; c++) {
+    int err = o[c] * 16 + nl->errCurr[(nl->x + 1) * 3 + c] - chosen[c] * 16;
+    nl->errCurr[(nl->x + 2) * 3 + c] += err * 7 / 16;
+    nl->errNext[(nl->x + 0) * 3 + c] += err * 3 / 16;
+    nl->errNext[(nl->x + 1) * 3 + c] += err * 5 / 16;
+    nl->errNext[(nl->x + 2) * 3 + c] += err * 1 / 16;
+  }
+
+  if (++nl->x == nl->width) {
+    int32_t* swap = nl->errCurr;
+    nl->errCurr = nl->errNext;
+    nl->errNext = swap;
+    memset(nl->errNext, 0, (nl->width + 2) * 3 * sizeof(int32_t));
+    nl->x = 0;
+  }
+  return best;
+}
+
+// Pixels to encode. Any enum qoi_pixel_format layout; with QOI_FORMAT_PREMULTIPLIED the
+// colours are converted back to straight alpha while reading.
+struct qoi_source {
+  const uint8_t* pixels;
+  uint32_t width;
+  uint32_t height;
+  size_t stride; // Bytes from one row to the next, 0 = tightly packed
+  int format;
+};
+
+// Reads one source pixel as straight alpha RGBA. With a constant format this inlines to loads and shuffles.
+static inline __attribute__((always_inline)) struct rgba readPixel(const uint8_t* in, const int format) {
+  struct rgba px;
+  switch (format & ~QOI_FORMAT_PREMULTIPLIED) {
+    case QOI_FORMAT_BGRA:
+      px = (struct rgba){in[2], in[1], in[0], in[3]};
+      break;
+    case QOI_FORMAT_ARGB:
+      px = (struct rgba){in[1], in[2], in[3], in[0]};
+      break;
+    case QOI_FORMAT_RGB:
+      px = (struct rgba){in[0], in[1], in[2], 255};
+      break;
+    case QOI_FORMAT_BGR:
+      px = (struct rgba){in[2], in[1], in[0], 255};
+      break;
+    case QOI_FORMAT_GRAY:
+      px = (struct rgba){in[0], in[0], in[0], 255};
+      break;
+    default:
+      memcpy(&px, in, 4);
+      break;
+  }
+  if ((format & QOI_FORMAT_PREMULTIPLIED) && px.a != 255) {
+    // Back to straight alpha, rounded. Fully transparent pixels become transparent black.
+    if (px.a == 0) {
+      px.r = px.g = px.b = 0;
+    } else {
+      px.r = px.r >= px.a ? 255 : (px.r * 255 + px.a / 2) / px.a;
+      px.g = px.g >= px.a ? 255 : (px.g * 255 + px.a / 2) / px.a;
+      px.b = px.b >= px.a ? 255 : (px.b * 255 + px.a / 2) / px.a;
+    }
+  }
+  return px;
+}
+
+// The encode loop, instantiated per source format by encodeOps. Writes the ops to bytes
+// starting at start and returns the position after the last op.
+static inline __attribute__((always_inline)) size_t encodeOpsKernel(
+    const struct qoi_source* source, uint8_t* bytes, size_t start, struct qoi_tie* ties, size_t* tieCountOut,
+    struct qoi_near_lossless* nearLosslessState, struct qoi_checksum_state* checksum, const int format) {
+  const size_t pixelSize = formatSize(format);
+  const size_t stride = source->stride > 0 ? source->stride : (size_t)source->width * pixelSize;
+  struct qoi_near_lossless nearLossless = *nearLosslessState;
+  uint8_t runlength = 0;
+  size_t pixelIndex = 0; // Pixels read so far
+  size_t p = start;
+  size_t tieCount = 0;
+  struct rgba prev = {0, 0, 0, 255};
+  struct rgba runningArray[64] = {0}; // Zero-initialized
+
+  QOI_STAT(memset(&qoiEncodeStats, 0, sizeof(qoiEncodeStats)));
+  QOI_STAT(uint64_t indexUsed = 0); // Bit per runningArray slot that has been written
+  for (uint32_t y = 0; y < source->height; y++) {
+    const uint8_t* row = source->pixels + y * stride;
+    for (uint32_t x = 0; x < source->width; x++) {
+      struct rgba curr = readPixel(row + x * pixelSize, format);
+      pixelIndex++;
+      if (nearLossless.maxError > 0) {
+        curr = nearLosslessPixel(&nearLossless, curr, prev, runningArray);
+      }
+      if (checksum != NULL) {
+        memcpy(checksum->row + (size_t)x * 4, &curr, 4);
+      }
+      QOI_STAT(qoiEncodeStats.pixels++);
+      if (prev.r == curr.r && prev.g == curr.g && prev.b == curr.b && prev.a == curr.a) {
+        // RUN using previous pixel
+        ++runlength;
+        // Max 62 runlength. 63 and 64 are reserved.
+        // Note that we use bias -1 so check against 62.
+        if (runlength == 62) {
+          runlength--;
+          runlength |= QOI_OP_RUN;
+          bytes[p++] = runlength;
+          // printf("Max run %02X\n", runlength);
+          runlength = 0;
+          QOI_STAT(qoiEncodeStats.opRun++);
+          QOI_STAT(qoiEncodeStats.runMax++);
+        }
+
+        // Edgecase, using default prev pixel at the start requires runningArray to be updated.
+        // This is due to alpha of default pixel being 255, not 0.
+        if (pixelIndex == 1) {
+          runningArray[getIndex(curr)] = curr;
+          QOI_STAT(indexUsed |= 1ull << getIndex(curr));
+        }
+        continue;
+      }
+
+      // Save RUN that was stopped before max
+      if (runlength > 0) {
+        // A single pixel run can also be written as a zero QOI_OP_DIFF, or as QOI_OP_INDEX
+        // unless the run is the very first pixel (the decoder has not stored it yet).
+        if (ties != NULL && runlength == 1) {
+          struct qoi_tie* tie = &ties[tieCount++];
+          tie->pos = p;
+          tie->count = 0;
+          tie->candidates[tie->count++] = QOI_OP_RUN;
+          tie->candidates[tie->count++] = QOI_OP_DIFF | 0b101010;
+          if (pixelIndex != 2) {
+            tie->candidates[tie->count++] = QOI_OP_INDEX | getIndex(prev);
+          }
+        }
+        // Note that we use bias -1
+        runlength--;
+        runlength |= QOI_OP_RUN;
+        bytes[p++] = runlength;
+        runlength = 0;
+        QOI_STAT(qoiEncodeStats.opRun++);
+      }
+
+      // Take advantage or wrapping and bias for easy comparisons
+      uint8_t diffr2 = curr.r - prev.r + 2;
+      uint8_t diffg2 = curr.g - prev.g + 2;
+      uint8_t diffb2 = curr.b - prev.b + 2;
+      const int diffFits = curr.a == prev.a && diffr2 <= 3 && diffg2 <= 3 && diffb2 <= 3;
+
+      // INDEX
+      uint8_t possibleIndex = getIndex(curr);
+      struct rgba possibleMatch = runningArray[possibleIndex];
+      if (possibleMatch.r == curr.r &&
+          possibleMatch.g == curr.g &&
+          possibleMatch.b == curr.b &&
+          possibleMatch.a == curr.a) {
+
+        possibleIndex |= QOI_OP_INDEX;
+        if (ties != NULL && diffFits) {
+          struct qoi_tie* tie = &ties[tieCount++];
+          tie->pos = p;
+          tie->count = 2;
+          tie->candidates[0] = possibleIndex;
+          tie->candidates[1] = QOI_OP_DIFF | (diffr2 << 4) | (diffg2 << 2) | diffb2;
+        }
+        bytes[p++] = possibleIndex;
+        prev = curr;
+        QOI_STAT(qoiEncodeStats.indexLookups++);
+        QOI_STAT(qoiEncodeStats.opIndex++);
+        continue;
+      }
+      QOI_STAT(qoiEncodeStats.indexLookups++);
+      QOI_STAT(if (indexUsed & (1ull << possibleIndex)) qoiEncodeStats.indexCollisions++);
+      QOI_STAT(indexUsed |= 1ull << possibleIndex);
+
+      // Update pixel to runningArray
+      runningArray[getIndex(curr)] = curr;
+
+      if (curr.a != prev.a) {
+        // Only way to change alpha (besides index) is RGBA
+        bytes[p++] = QOI_OP_RGBA;
+        bytes[p++] = curr.r;
+        bytes[p++] = curr.g;
+        bytes[p++] = curr.b;
+        bytes[p++] = curr.a;
+        prev = curr;
+        QOI_STAT(qoiEncodeStats.opRgba++);
+        continue;
+      }
+
+      if (diffFits) {
+        uint8_t fullbyte = QOI_OP_DIFF | (diffr2 << 4) | (diffg2 << 2) | diffb2;
+        bytes[p++] = fullbyte;
+        prev = curr;
+        QOI_STAT(qoiEncodeStats.opDiff++);
+        continue;
+      }
+
+      // Take advantage or wrapping and bias for easy comparisons
+      uint8_t diffg3 = curr.g - prev.g;
+      uint8_t diffgg = curr.g - prev.g + 32;
+      uint8_t diffrg = curr.r - prev.r - diffg3 + 8;
+      uint8_t diffbg = curr.b - prev.b - diffg3 + 8;
+      if (diffgg <= 63 && diffrg <= 15 && diffbg <= 15) {
+        uint8_t fullbyte1 = QOI_OP_LUMA | diffgg;
+        uint8_t fullbyte2 = (diffrg << 4) | diffbg;
+        bytes[p++] = fullbyte1;
+        bytes[p++] = fullbyte2;
+        prev = curr;
+        QOI_STAT(qoiEncodeStats.opLuma++);
+        continue;
+      }
+
+      // Use RGB if nothing else works
+      bytes[p++] = QOI_OP_RGB;
+      bytes[p++] = curr.r;
+      bytes[p++] = curr.g;
+      bytes[p++] = curr.b;
+      prev = curr;
+      QOI_STAT(qoiEncodeStats.opRgb++);
+    }
+    // Hash the row and its ops while they are still in cache. Ops can still change when ties are
+    // resolved, then the stream is hashed afterwards.
+    if (checksum != NULL) {
+      xxh64Update(&checksum->pixels, checksum->row, (size_t)source->width * 4);
+      if (ties == NULL) {
+        xxh64Update(&checksum->stream, bytes + checksum->streamHashed, p - checksum->streamHashed);
+        checksum->streamHashed = p;
+      }
+    }
+  }
+
+  // Save RUN if it was still ongoing
+  if (runlength > 0) {
+    // Note that we use bias -1
+    runlength--;
+    runlength |= QOI_OP_RUN;
+    bytes[p++] = runlength;
+    runlength = 0;
+    QOI_STAT(qoiEncodeStats.opRun++);
+  }
+
+  *tieCountOut = tieCount;
+  return p;
+}
+
+#define QOI_ENCODE_CASE(f) case f: return encodeOpsKernel(source, bytes, start, ties, tieCount, nearLossless, checksum, f);
+
+size_t encodeOps(const struct qoi_source* source, uint8_t* bytes, size_t start, struct qoi_tie* ties, size_t* tieCount,
+                 struct qoi_near_lossless* nearLossless, struct qoi_checksum_state* checksum) {
+  switch (source->format) {
+    QOI_ENCODE_CASE(QOI_FORMAT_BGRA)
+    QOI_ENCODE_CASE(QOI_FORMAT_ARGB)
+    QOI_ENCODE_CASE(QOI_FORMAT_RGB)
+    QOI_ENCODE_CASE(QOI_FORMAT_BGR)
+    QOI_ENCODE_CASE(QOI_FORMAT_GRAY)
+    QOI_ENCODE_CASE(QOI_FORMAT_RGBA | QOI_FORMAT_PREMULTIPLIED)
+    QOI_ENCODE_CASE(QOI_FORMAT_BGRA | QOI_FORMAT_PREMULTIPLIED)
+    QOI_ENCODE_CASE(QOI_FORMAT_ARGB | QOI_FORMAT_PREMULTIPLIED)
+    QOI_ENCODE_CASE(QOI_FORMAT_RGB | QOI_FORMAT_PREMULTIPLIED)
+    QOI_ENCODE_CASE(QOI_FORMAT_BGR | QOI_FORMAT_PREMULTIPLIED)
+    QOI_ENCODE_CASE(QOI_FORMAT_GRAY | QOI_FORMAT_PREMULTIPLIED)
+    default:
+      return encodeOpsKernel(source, bytes, start, ties, tieCount, nearLossless, checksum, QOI_FORMAT_RGBA);
+  }
+}
+
+// Channels in the header of a qoi file encoded from source: 4 if the source format has alpha, otherwise 3.
+uint8_t encodedChannels(const struct qoi_source* source) {
+  return formatSize(source->format & ~QOI_FORMAT_PREMULTIPLIED) == 4 ? 4 : 3;
+}
+
+// Size of the buffer encodeInto needs for source: worst case every pixel is a QOI_OP_RGBA
+// (or QOI_OP_RGB for 3 channels), plus the checksum chunk.
+size_t encodedMaxSize(const struct qoi_source* source) {
+  return headerSize + (size_t)source->width * source->height * (encodedChannels(source) + 1) + sizeof(QOI_END_CHUNK) +
+         checksumChunkSize;
+}
+
+// Encodes the source pixels into a plain qoi file at bytes, which has encodedMaxSize bytes.
+// When checksums is not NULL (or the options ask for a checksum chunk) the checksums are
+// computed in the encode loop. Returns the size of the file, 0 on failure.
+size_t encodeInto(const struct qoi_source* source, const struct qoi_encode_options* options, uint8_t* bytes,
+                  struct qoi_checksums* checksums, struct qoi_error* error) {
+  // TODO: now all images are marked as sRGB. Enable linear rgb
+  const uint8_t colorspace = 0;
+  const uint8_t channels = encodedChannels(source);
+  struct qoi_header qoiHeader = {"qoif", source->width, source->height, channels, colorspace};
+
+  // printf("Width %u height %u channels %u.\n", qoiHeader.width, qoiHeader.height, channels);
+  if (!checkDimensions(qoiHeader.width, qoiHeader.height, error)) {
+    return 0;
+  }
+
+  const int writeChecksum = options != NULL && options->checksum;
+  struct qoi_checksum_state checksumState;
+  struct qoi_checksum_state* checksum = NULL;
+  if (checksums != NULL || writeChecksum) {
+    initChecksumState(&checksumState);
+    checksumState.row = malloc((size_t)qoiHeader.width * 4);
+    if (checksumState.row == NULL) {
+      return qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the checksum");
+    }
+    checksum = &checksumState;
+  }
+  size_t p = 0;
+
+  // Ties are only tracked when effort > 0
+  const int effort = options != NULL ? options->effort : 0;
+  struct qoi_tie* ties = NULL;
+  if (effort > 0) {
+    // At most one tie per pixel. Without memory for them the greedy encoding is used, which
+    // is the same size.
+    ties = malloc(((size_t)qoiHeader.width) * qoiHeader.height * sizeof(struct qoi_tie));
+  }
+
+  struct qoi_near_lossless nearLossless = {0};
+  if (options != NULL && options->maxError > 0) {
+    nearLossless.maxError = options->maxError;
+    nearLossless.width = qoiHeader.width;
+    nearLossless.errCurr = calloc(((size_t)qoiHeader.width + 2) * 3, sizeof(int32_t));
+    nearLossless.errNext = calloc(((size_t)qoiHeader.width + 2) * 3, sizeof(int32_t));
+    if (nearLossless.errCurr == NULL || nearLossless.errNext == NULL) {
+      free(nearLossless.errCurr);
+      free(nearLossless.errNext);
+      free(ties);
+      free(checksum != NULL ? checksum->row : NULL);
+      return qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for near-lossless encoding");
+    }
+  }
+
+  uint32_t widthBE = __builtin_bswap32(qoiHeader.width);
+  uint32_t heightBE = __builtin_bswap32(qoiHeader.height);
+  memcpy(bytes + p, qoiHeader.magic, 4); p += 4;
+  memcpy(bytes + p, &widthBE, 4); p += 4;
+  memcpy(bytes + p, &heightBE, 4); p += 4;
+  bytes[p++] = qoiHeader.channels;
+  bytes[p++] = qoiHeader.colorspace;
+
+  size_t tieCount = 0;
+  p = encodeOps(source, bytes, p, ties, &tieCount, &nearLossless, checksum);
+
+  uint64_t endChunkBE = __builtin_bswap64(QOI_END_CHUNK);
+  memcpy(bytes + p, &endChunkBE, 8); p += 8;
+  QOI_STAT(qoiEncodeStats.bytes = p);
+
+  free(nearLossless.errCurr);
+  free(nearLossless.errNext);
+
+  if (ties != NULL) {
+    resolveTies(bytes, headerSize, p, ties, tieCount, effort);
+    free(ties);
+  }
+
+  if (checksum != NULL) {
+    // The rest of the stream: the last run and the end chunk (everything after resolving ties)
+    xxh64Update(&checksum->stream, bytes + checksum->streamHashed, p - checksum->streamHashed);
+    free(checksum->row);
+    struct qoi_checksums result = {xxh64Digest(&checksum->pixels), xxh64Digest(&checksum->stream)};
+    if (checksums != NULL) {
+      *checksums = result;
+    }
+    if (writeChecksum) {
+      uint64_t pixelsBE = __builtin_bswap64(result.pixels);
+      uint64_t streamBE = __builtin_bswap64(result.stream);
+      memcpy(bytes + p, QOI_CHECKSUM_MAGIC, 4); p += 4;
+      memcpy(bytes + p, &pixelsBE, 8); p += 8;
+      memcpy(bytes + p, &streamBE, 8); p += 8;
+    }
+  }
+
+  return p;
+}
+
+// Encodes the source pixels into a malloc'd qoi file in memory, see encodeInto.
+// Returns NULL on failure, otherwise the buffer which the caller must free.
+uint8_t* encodeChecked(const struct qoi_source* source, const struct qoi_encode_options* options, size_t* outSize,
+                       struct qoi_checksums* checksums, struct qoi_error* error) {
+  if (!checkDimensions(source->width, source->height, error)) {
+    return NULL;
+  }
+  uint8_t* bytes = malloc(encodedMaxSize(source));
+  if (bytes == NULL) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the encoded image");
+    return NULL;
+  }
+  *outSize = encodeInto(source, options, bytes, checksums, error);
+  if (*outSize == 0) {
+    free(bytes);
+    return NULL;
+  }
+  return bytes;
+}
+
+uint8_t* encodeSource(const struct qoi_source* source, const struct qoi_encode_options* options, size_t* outSize,
+                      struct qoi_error* error) {
+  return encodeChecked(source, options, outSize, NULL, error);
+}
+
+// Encodes packed RGB (channels 3) or RGBA (channels 4) pixels into a malloc'd qoi file in memory.
+// Returns NULL on failure, otherwise the buffer which the caller must free.
+uint8_t* encodePixels(const uint8_t* pixels, uint32_t width, uint32_t height, uint8_t channels,
+                      const struct qoi_encode_options* options, size_t* outSize, struct qoi_error* error) {
+  struct qoi_source source = {pixels, width, height, 0, channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB};
+  return encodeSource(&source, options, outSize, error);
+}
+
+// Minimal pthread pool. Jobs run in submission order on any worker.
+struct pool_job {
+  void (*function)(void* argument);
+  void* argument;
+  struct pool_job* next;
+};
+
+struct thread_pool {
+  pthread_t* threads;
+  int threadCount;
+  pthread_mutex_t mutex;
+  pthread_cond_t hasJobs;
+  pthread_cond_t idle;
+  struct pool_job* head;
+  struct pool_job* tail;
+  size_t unfinished; // Queued and running jobs
+  int stop;
+};
+
+void* poolWorker(void* argument) {
+  struct thread_pool* pool = argument;
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    while (pool->head == NULL && !pool->stop) {
+      pthread_cond_wait(&pool->hasJobs, &pool->mutex);
+    }
+    if (pool->head == NULL) {
+      break; // Stopping and nothing left
+    }
+    struct pool_job* job = pool->head;
+    pool->head = job->next;
+    if (pool->head == NULL) {
+      pool->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    job->function(job->argument);
+    free(job);
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->unfinished == 0) {
+      pthread_cond_broadcast(&pool->idle);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+int defaultThreadCount(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? cpus : 1;
+}
+
+// Creates a pool with threadCount workers (0 = one per CPU). Returns NULL on failure.
+struct thread_pool* poolCreate(int threadCount) {
+  struct thread_pool* pool = calloc(1, sizeof(struct thread_pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->threadCount = threadCount > 0 ? threadCount : defaultThreadCount();
+  pool->threads = calloc(pool->threadCount, sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->hasJobs, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  for (int i = 0; i < pool->threadCount; i++) {
+    if (pthread_create(&pool->threads[i], NULL, poolWorker, pool) != 0) {
+      pool->threadCount = i;
+      break;
+    }
+  }
+  return pool;
+}
+
+// Queues a job. Runs it right away on the calling thread if the pool has no workers.
+void poolSubmit(struct thread_pool* pool, void (*function)(void*), void* argument) {
+  struct pool_job* job = malloc(sizeof(struct pool_job));
+  if (job == NULL || pool->threadCount == 0) {
+    free(job);
+    function(argument);
+    return;
+  }
+  job->function = function;
+  job->argument = argument;
+  job->next = NULL;
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->tail != NULL) {
+    pool->tail->next = job;
+  } else {
+    pool->head = job;
+  }
+  pool->tail = job;
+  pool->unfinished++;
+  pthread_cond_signal(&pool->hasJobs);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+// Waits until all submitted jobs have finished.
+void poolWait(struct thread_pool* pool) {
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->unfinished > 0) {
+    pthread_cond_wait(&pool->idle, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+// Finishes the queued jobs and frees the pool.
+void poolDestroy(struct thread_pool* pool) {
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->hasJobs);
+  pthread_mutex_unlock(&pool->mutex);
+  for (int i = 0; i < pool->threadCount; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->hasJobs);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->threads);
+  free(pool);
+}
+
+// qoit container: the image split into tiles that are encoded as independent qoi files
+// (each with its own header, fresh prev and runningArray, and end chunk).
+//
+//   "qoit", uint32 BE width, uint32 BE height, uint8 channels, uint8 colorspace,
+//   uint32 BE tile width, uint32 BE tile height,
+//   uint64 BE offsets[tile count + 1] from the start of the file, the last one is the file size,
+//   tile qoi files in row major tile order
+//
+// Edge tiles on the right and bottom are smaller when the image is not a multiple of the tile size.
+
+const uint8_t tiledHeaderSize = 4+4+4+1+1+4+4;
+
+struct qoi_tiled_header {
+  uint32_t width;
+  uint32_t height;
+  uint8_t channels;
+  uint8_t colorspace;
+  uint32_t tileWidth;
+  uint32_t tileHeight;
+  uint32_t tilesX;
+  uint32_t tilesY;
+  const uint8_t* offsets; // Big endian table inside the file
+};
+
+uint64_t tileOffset(const struct qoi_tiled_header* tiled, size_t tile) {
+  uint64_t offset;
+  memcpy(&offset, tiled->offsets + tile * 8, 8);
+  return __builtin_bswap64(offset);
+}
+
+// Reads and checks the header and offset table. Returns 1 on success.
+int readTiledHeader(const uint8_t* bytes, size_t size, struct qoi_tiled_header* tiled, struct qoi_error* error) {
+  if (size < tiledHeaderSize || memcmp(bytes, QOIT_MAGIC, 4) != 0) {
+    return qoiFail(error, QOI_ERROR_FORMAT, "File is not a tiled qoi file");
+  }
+  uint32_t values[2];
+  memcpy(values, bytes + 4, 8);
+  tiled->width = __builtin_bswap32(values[0]);
+  tiled->height = __builtin_bswap32(values[1]);
+  tiled->channels = bytes[12];
+  tiled->colorspace = bytes[13];
+  memcpy(values, bytes + 14, 8);
+  tiled->tileWidth = __builtin_bswap32(values[0]);
+  tiled->tileHeight = __builtin_bswap32(values[1]);
+  if (tiled->tileWidth == 0 || tiled->tileHeight == 0) {
+    return qoiFail(error, QOI_ERROR_CORRUPT, "Tiled qoi has zero tile size");
+  }
+  // Rounded up without width + tileWidth - 1, which wraps for widths near 2^32
+  tiled->tilesX = tiled->width / tiled->tileWidth + (tiled->width % tiled->tileWidth != 0);
+  tiled->tilesY = tiled->height / tiled->tileHeight + (tiled->height % tiled->tileHeight != 0);
+  size_t tileCount = (size_t)tiled->tilesX * tiled->tilesY;
+  if ((size - tiledHeaderSize) / 8 < tileCount + 1) {
+    return qoiFail(error, QOI_ERROR_CORRUPT, "Tiled qoi offset table is truncated");
+  }
+  tiled->offsets = bytes + tiledHeaderSize;
+  size_t tableEnd = tiledHeaderSize + (tileCount + 1) * 8;
+  uint64_t previous = tableEnd;
+  for (size_t tile = 0; tile <= tileCount; tile++) {
+    uint64_t offset = tileOffset(tiled, tile);
+    if (offset < previous || offset > size) {
+      return qoiFail(error, QOI_ERROR_CORRUPT, "Tiled qoi offset table is corrupt");
+    }
+    previous = offset;
+  }
+  return 1;
+}
+
+struct tile_job {
+  // Shared by all tiles
+  const struct qoi_source* source;
+  uint32_t tileWidth;
+  uint32_t tileHeight;
+  uint32_t tilesX;
+  const struct qoi_encode_options* options;
+  // Per tile
+  size_t tile;
+  uint8_t* encoded;
+  size_t encodedSize;
+};
+
+void encodeTileJob(void* argument) {
+  struct tile_job* job = argument;
+  const struct qoi_source* image = job->source;
+  uint32_t x0 = (job->tile % job->tilesX) * job->tileWidth;
+  uint32_t y0 = (job->tile / job->tilesX) * job->tileHeight;
+  uint32_t w = image->width - x0 < job->tileWidth ? image->width - x0 : job->tileWidth;
+  uint32_t h = image->height - y0 < job->tileHeight ? image->height - y0 : job->tileHeight;
+  // The tile is read in place through the row stride
+  size_t pixelSize = formatSize(image->format);
+  size_t stride = image->stride > 0 ? image->stride : (size_t)image->width * pixelSize;
+  struct qoi_source source = {image->pixels + y0 * stride + x0 * pixelSize, w, h, stride, image->format};
+  job->encoded = encodeSource(&source, job->options, &job->encodedSize, NULL);
+}
+
+// Encodes the source as a malloc'd qoit file with the tiles encoded on the pool.
+// Returns NULL on failure.
+uint8_t* encodeTiled(const struct qoi_source* source, uint32_t tileWidth, uint32_t tileHeight,
+                     const struct qoi_encode_options* options, struct thread_pool* pool, size_t* outSize,
+                     struct qoi_error* error) {
+  const uint32_t width = source->width;
+  const uint32_t height = source->height;
+  uint32_t tilesX = width / tileWidth + (width % tileWidth != 0);
+  uint32_t tilesY = height / tileHeight + (height % tileHeight != 0);
+  size_t tileCount = (size_t)tilesX * tilesY;
+  struct tile_job* jobs = calloc(tileCount, sizeof(struct tile_job));
+  if (jobs == NULL) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the tiles");
+    return NULL;
+  }
+  for (size_t tile = 0; tile < tileCount; tile++) {
+    jobs[tile] = (struct tile_job){source, tileWidth, tileHeight, tilesX, options, tile, NULL, 0};
+    poolSubmit(pool, encodeTileJob, &jobs[tile]);
+  }
+  poolWait(pool);
+
+  size_t size = tiledHeaderSize + (tileCount + 1) * 8;
+  int failed = 0;
+  for (size_t tile = 0; tile < tileCount; tile++) {
+    failed |= jobs[tile].encoded == NULL;
+    size += jobs[tile].encodedSize;
+  }
+  uint8_t* bytes = failed ? NULL : malloc(size);
+  if (bytes != NULL) {
+    uint32_t values[2] = {__builtin_bswap32(width), __builtin_bswap32(height)};
+    memcpy(bytes, QOIT_MAGIC, 4);
+    memcpy(bytes + 4, values, 8);
+    bytes[12] = jobs[0].encoded[12]; // Channels and colorspace as written by encodeSource
+    bytes[13] = jobs[0].encoded[13];
+    values[0] = __builtin_bswap32(tileWidth);
+    values[1] = __builtin_bswap32(tileHeight);
+    memcpy(bytes + 14, values, 8);
+    uint64_t offset = tiledHeaderSize + (tileCount + 1) * 8;
+    for (size_t tile = 0; tile <= tileCount; tile++) {
+      uint64_t offsetBE = __builtin_bswap64(offset);
+      memcpy(bytes + tiledHeaderSize + tile * 8, &offsetBE, 8);
+      if (tile < tileCount) {
+        memcpy(bytes + offset, jobs[tile].encoded, jobs[tile].encodedSize);
+        offset += jobs[tile].encodedSize;
+      }
+    }
+    *outSize = size;
+  } else {
+    // Tiles fit in qoiMaxPixels when the image does, so only memory can be missing
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Encoding the tiles failed");
+  }
+  for (size_t tile = 0; tile < tileCount; tile++) {
+    free(jobs[tile].encoded);
+  }
+  free(jobs);
+  return bytes;
+}
+
+struct tile_decode_job {
+  const uint8_t* bytes;
+  const struct qoi_tiled_header* tiled;
+  size_t tile;
+  // Viewport in image coordinates and its RGBA output
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+  uint8_t* out;
+  int format;
+  int failed;
+};
+
+// Decodes the part of one tile that overlaps the viewport of the job into the job output.
+// Rows below the viewport are not decoded at all, rows above are decoded without storing.
+void decodeTileJob(void* argument) {
+  struct tile_decode_job* job = argument;
+  const struct qoi_tiled_header* tiled = job->tiled;
+  uint32_t tileX0 = (job->tile % tiled->tilesX) * tiled->tileWidth;
+  uint32_t tileY0 = (job->tile / tiled->tilesX) * tiled->tileHeight;
+  uint64_t start = tileOffset(tiled, job->tile);
+  uint64_t end = tileOffset(tiled, job->tile + 1);
+
+  struct qoi_header qoiHeader;
+  if (!readHeader(job->bytes + start, end - start, &qoiHeader, NULL) ||
+      qoiHeader.width != (tiled->width - tileX0 < tiled->tileWidth ? tiled->width - tileX0 : tiled->tileWidth) ||
+      qoiHeader.height != (tiled->height - tileY0 < tiled->tileHeight ? tiled->height - tileY0 : tiled->tileHeight)) {
+    job->failed = 1;
+    return;
+  }
+  const size_t pixelSize = formatSize(job->format);
+
+  // Overlap of tile and viewport in tile coordinates
+  uint32_t fromX = job->x > tileX0 ? job->x - tileX0 : 0;
+  uint32_t toX = job->x + job->width - tileX0 < qoiHeader.width ? job->x + job->width - tileX0 : qoiHeader.width;
+  uint32_t fromY = job->y > tileY0 ? job->y - tileY0 : 0;
+  uint32_t toY = job->y + job->height - tileY0 < qoiHeader.height ? job->y + job->height - tileY0 : qoiHeader.height;
+
+  struct qoi_decoder decoder;
+  initDecoder(&decoder);
+  uint8_t* out = job->out + ((size_t)(tileY0 + fromY - job->y) * job->width + (tileX0 + fromX - job->x)) * pixelSize;
+  if (!decodeOpsRect(&decoder, job->bytes + start + headerSize, end - start - headerSize, qoiHeader.width,
+                     fromX, toX, fromY, toY, out, (size_t)job->width * pixelSize, job->format)) {
+    job->failed = 1;
+  }
+}
+
+// Decodes a rectangle of a qoit file to a malloc'd buffer (width * height pixels in the given format),
+// touching only the tiles that overlap it. Tiles are decoded in parallel on the pool.
+// Returns NULL on failure.
+uint8_t* decodeTiledRect(const uint8_t* bytes, size_t size, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                         int format, struct thread_pool* pool, struct qoi_error* error) {
+  struct qoi_tiled_header tiled;
+  if (!readTiledHeader(bytes, size, &tiled, error)) {
+    return NULL;
+  }
+  if (width == 0 || height == 0 || x >= tiled.width || y >= tiled.height ||
+      width > tiled.width - x || height > tiled.height - y) {
+    qoiFail(error, QOI_ERROR_ARGUMENT, "Rectangle is outside of the image");
+    return NULL;
+  }
+  uint32_t firstTileX = x / tiled.tileWidth;
+  uint32_t lastTileX = (x + width - 1) / tiled.tileWidth;
+  uint32_t firstTileY = y / tiled.tileHeight;
+  uint32_t lastTileY = (y + height - 1) / tiled.tileHeight;
+  size_t jobCount = (size_t)(lastTileX - firstTileX + 1) * (lastTileY - firstTileY + 1);
+
+  uint8_t* out = malloc((size_t)width * height * formatSize(format));
+  struct tile_decode_job* jobs = calloc(jobCount, sizeof(struct tile_decode_job));
+  if (out == NULL || jobs == NULL) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the image");
+    free(out);
+    free(jobs);
+    return NULL;
+  }
+  size_t j = 0;
+  for (uint32_t tileY = firstTileY; tileY <= lastTileY; tileY++) {
+    for (uint32_t tileX = firstTileX; tileX <= lastTileX; tileX++, j++) {
+      jobs[j] = (struct tile_decode_job){bytes, &tiled, (size_t)tileY * tiled.tilesX + tileX, x, y, width, height, out, format, 0};
+      poolSubmit(pool, decodeTileJob, &jobs[j]);
+    }
+  }
+  poolWait(pool);
+
+  int failed = 0;
+  for (j = 0; j < jobCount; j++) {
+    failed |= jobs[j].failed;
+  }
+  free(jobs);
+  if (failed) {
+    qoiFail(error, QOI_ERROR_CORRUPT, "Tiled qoi has corrupt tiles");
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+// Decodes a single tile (numbered in row major order) to a malloc'd buffer in the given format.
+// The tile size is returned in width and height. Returns NULL on failure.
+uint8_t* decodeTile(const uint8_t* bytes, size_t size, size_t tile, uint32_t* width, uint32_t* height, int format,
+                    struct qoi_error* error) {
+  struct qoi_tiled_header tiled;
+  if (!readTiledHeader(bytes, size, &tiled, error)) {
+    return NULL;
+  }
+  if (tile >= (size_t)tiled.tilesX * tiled.tilesY) {
+    qoiFail(error, QOI_ERROR_ARGUMENT, "Tile %lu does not exist", tile);
+    return NULL;
+  }
+  uint32_t x = (tile % tiled.tilesX) * tiled.tileWidth;
+  uint32_t y = (tile / tiled.tilesX) * tiled.tileHeight;
+  *width = tiled.width - x < tiled.tileWidth ? tiled.width - x : tiled.tileWidth;
+  *height = tiled.height - y < tiled.tileHeight ? tiled.height - y : tiled.tileHeight;
+  uint8_t* out = malloc((size_t)*width * *height * formatSize(format));
+  if (out == NULL) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the tile");
+    return NULL;
+  }
+  struct tile_decode_job job = {bytes, &tiled, tile, x, y, *width, *height, out, format, 0};
+  decodeTileJob(&job);
+  if (job.failed) {
+    qoiFail(error, QOI_ERROR_CORRUPT, "Tiled qoi has corrupt tiles");
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+// qoiv container: a sequence of frames of the same size (screen recordings, animations). Every
+// frame is a qoi file with its own header and end chunk. Keyframes are plain qoi files. The other
+// frames hold the changes to the previous frame: pixels that did not change are written as a
+// sentinel colour that no changed pixel has, so still areas become long QOI_OP_RUNs (62 pixels a
+// byte) and moving areas keep their INDEX/DIFF/LUMA ops.
+//
+//   "qoiv", uint32 BE width, uint32 BE height, uint8 channels, uint8 colorspace,
+//   uint32 BE frame count, uint32 BE keyframe interval (0 = only the first frame),
+//   per frame: uint64 BE offset from the start of the file, uint32 BE sentinel RGBA
+//   (0 for keyframes, the alpha of a sentinel is always 255),
+//   uint64 BE file size,
+//   frame qoi files
+//
+// The first frame is always a keyframe. Seeking decodes from the last keyframe at or before the
+// frame, or continues from the frame decoded last when that is closer.
+
+// Magic of the sequence container, see struct qoi_sequence_encoder
+const char QOIV_MAGIC[4] = "qoiv";
+
+const uint8_t sequenceHeaderSize = 4+4+4+1+1+4+4;
+const uint8_t sequenceEntrySize = 8+4;
+
+// Frames are added one at a time and kept encoded in memory until sequenceFinish.
+struct qoi_sequence_encoder {
+  uint32_t width;
+  uint32_t height;
+  uint8_t channels; // 3 or 4, frames are packed RGB or RGBA in previous, current and delta
+  uint32_t keyframeInterval;
+  struct qoi_encode_options options;
+  uint8_t* previous;
+  uint8_t* current;
+  uint8_t* delta;
+  uint32_t* used; // Bitmap of the RGB colours of the changed pixels, all clear between frames
+  uint32_t sentinel; // RGB of the last sentinel, tried first
+  uint8_t* bytes; // The encoded frames
+  size_t size;
+  size_t capacity;
+  uint64_t* offsets; // Of each frame in bytes
+  uint32_t* sentinels;
+  uint32_t frameCount;
+  uint32_t frameCapacity;
+};
+
+void sequenceEncoderFree(struct qoi_sequence_encoder* encoder) {
+  free(encoder->previous);
+  free(encoder->current);
+  free(encoder->delta);
+  free(encoder->used);
+  free(encoder->bytes);
+  free(encoder->offsets);
+  free(encoder->sentinels);
+  memset(encoder, 0, sizeof(struct qoi_sequence_encoder));
+}
+
+// Starts a sequence of width x height frames with 3 or 4 channels. Only options->effort is used:
+// near-lossless encoding could turn changed pixels into the sentinel. Returns 1 on success.
+int sequenceEncoderInit(struct qoi_sequence_encoder* encoder, uint32_t width, uint32_t height, uint8_t channels,
+                        uint32_t keyframeInterval, const struct qoi_encode_options* options, struct qoi_error* error) {
+  memset(encoder, 0, sizeof(struct qoi_sequence_encoder));
+  if (!checkDimensions(width, height, error)) {
+    return 0;
+  }
+  encoder->width = width;
+  encoder->height = height;
+  encoder->channels = channels == 3 ? 3 : 4;
+  encoder->keyframeInterval = keyframeInterval;
+  encoder->options = defaultEncodeOptions;
+  encoder->options.effort = options != NULL ? options->effort : 0;
+  size_t frameSize = (size_t)width * height * encoder->channels + 1;
+  encoder->previous = malloc(frameSize);
+  encoder->current = malloc(frameSize);
+  encoder->delta = malloc(frameSize);
+  encoder->used = calloc((1 << 24) / 32, sizeof(uint32_t));
+  if (encoder->previous == NULL || encoder->current == NULL || encoder->delta == NULL || encoder->used == NULL) {
+    sequenceEncoderFree(encoder);
+    return qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the sequence");
+  }
+  return 1;
+}
+
+static inline uint32_t packedRgb(const uint8_t* pixel) {
+  return (uint32_t)pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+}
+
+// Fills delta with the changed pixels of current and the sentinel elsewhere. Returns 0 if every
+// RGB colour is taken by a changed pixel, which needs more than 16 million changed pixels.
+static inline __attribute__((always_inline)) int sequenceDeltaKernel(struct qoi_sequence_encoder* encoder,
+                                                                     const size_t pixelSize) {
+  const size_t pixelCount = (size_t)encoder->width * encoder->height;
+  uint32_t* used = encoder->used;
+  for (size_t i = 0; i < pixelCount; i++) {
+    const uint8_t* pixel = encoder->current + i * pixelSize;
+    if (memcmp(pixel, encoder->previous + i * pixelSize, pixelSize) != 0) {
+      uint32_t rgb = packedRgb(pixel);
+      used[rgb >> 5] |= 1u << (rgb & 31);
+    }
+  }
+  uint32_t sentinel = encoder->sentinel;
+  int found = !(used[sentinel >> 5] >> (sentinel & 31) & 1);
+  for (uint32_t word = 0; !found && word < (1 << 24) / 32; word++) {
+    if (used[word] != UINT32_MAX) {
+      sentinel = word * 32 + __builtin_ctz(~used[word]);
+      found = 1;
+    }
+  }
+  const uint8_t sentinelPixel[4] = {sentinel >> 16, sentinel >> 8, sentinel, 255};
+  for (size_t i = 0; i < pixelCount; i++) {
+    const uint8_t* pixel = encoder->current + i * pixelSize;
+    if (memcmp(pixel, encoder->previous + i * pixelSize, pixelSize) != 0) {
+      memcpy(encoder->delta + i * pixelSize, pixel, pixelSize);
+      // Back to all clear for the next frame
+      uint32_t rgb = packedRgb(pixel);
+      used[rgb >> 5] &= ~(1u << (rgb & 31));
+    } else {
+      memcpy(encoder->delta + i * pixelSize, sentinelPixel, pixelSize);
+    }
+  }
+  encoder->sentinel = sentinel;
+  return found;
+}
+
+int sequenceDelta(struct qoi_sequence_encoder* encoder) {
+  return encoder->channels == 4 ? sequenceDeltaKernel(encoder, 4) : sequenceDeltaKernel(encoder, 3);
+}
+
+// Encodes the next frame, which must have the size of the sequence (any source format).
+// Returns 1 on success.
+int sequenceAddFrame(struct qoi_sequence_encoder* encoder, const struct qoi_source* frame, struct qoi_error* error) {
+  if (frame->width != encoder->width || frame->height != encoder->height) {
+    return qoiFail(error, QOI_ERROR_ARGUMENT, "Frame of %ux%u pixels in a sequence of %ux%u", frame->width,
+                   frame->height, encoder->width, encoder->height);
+  }
+  if (encoder->frameCount == encoder->frameCapacity) {
+    uint32_t capacity = encoder->frameCapacity > 0 ? encoder->frameCapacity * 2 : 64;
+    uint64_t* offsets = realloc(encoder->offsets, capacity * sizeof(uint64_t));
+    if (offsets != NULL) {
+      encoder->offsets = offsets;
+    }
+    uint32_t* sentinels = realloc(encoder->sentinels, capacity * sizeof(uint32_t));
+    if (sentinels != NULL) {
+      encoder->sentinels = sentinels;
+    }
+    if (offsets == NULL || sentinels == NULL) {
+      return qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the frame table");
+    }
+    encoder->frameCapacity = capacity;
+  }
+
+  // The frame packed as RGB or RGBA, straight alpha
+  const size_t pixelSize = formatSize(frame->format);
+  const size_t stride = frame->stride > 0 ? frame->stride : (size_t)frame->width * pixelSize;
+  const int packedFormat = encoder->channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB;
+  for (uint32_t y = 0; y < frame->height; y++) {
+    const uint8_t* row = frame->pixels + y * stride;
+    uint8_t* out = encoder->current + (size_t)y * frame->width * encoder->channels;
+    if (frame->format == packedFormat) {
+      memcpy(out, row, (size_t)frame->width * encoder->channels);
+      continue;
+    }
+    for (uint32_t x = 0; x < frame->width; x++) {
+      struct rgba px = readPixel(row + x * pixelSize, frame->format);
+      memcpy(out + (size_t)x * encoder->channels, &px, encoder->channels);
+    }
+  }
+
+  const uint32_t index = encoder->frameCount;
+  int keyframe = index == 0 || (encoder->keyframeInterval > 0 && index % encoder->keyframeInterval == 0);
+  if (!keyframe) {
+    // Without a free colour for the sentinel the frame becomes a keyframe
+    keyframe = !sequenceDelta(encoder);
+  }
+  struct qoi_source packed = {keyframe ? encoder->current : encoder->delta, frame->width, frame->height, 0,
+                              packedFormat};
+  size_t size;
+  uint8_t* bytes = encodeSource(&packed, &encoder->options, &size, error);
+  if (bytes == NULL) {
+    return 0;
+  }
+  if (encoder->size + size > encoder->capacity) {
+    size_t capacity = encoder->capacity * 2 > encoder->size + size ? encoder->capacity * 2 : encoder->size + size;
+    uint8_t* grown = realloc(encoder->bytes, capacity);
+    if (grown == NULL) {
+      free(bytes);
+      return qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the sequence");
+    }
+    encoder->bytes = grown;
+    encoder->capacity = capacity;
+  }
+  memcpy(encoder->bytes + encoder->size, bytes, size);
+  free(bytes);
+  encoder->offsets[index] = encoder->size;
+  encoder->sentinels[index] = keyframe ? 0 : encoder->sentinel << 8 | 255;
+  encoder->size += size;
+  encoder->frameCount++;
+
+  uint8_t* previous = encoder->previous;
+  encoder->previous = encoder->current;
+  encoder->current = previous;
+  return 1;
+}
+
+// Returns the malloc'd qoiv file of the frames added so far, and frees the encoder.
+uint8_t* sequenceFinish(struct qoi_sequence_encoder* encoder, size_t* outSize, struct qoi_error* error) {
+  const size_t tableSize = (size_t)encoder->frameCount * sequenceEntrySize + 8;
+  const size_t size = sequenceHeaderSize + tableSize + encoder->size;
+  uint8_t* bytes = encoder->frameCount > 0 ? malloc(size) : NULL;
+  if (encoder->frameCount == 0) {
+    qoiFail(error, QOI_ERROR_ARGUMENT, "The sequence has no frames");
+  } else if (bytes == NULL) {
+    qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the sequence");
+  } else {
+    uint32_t values[2] = {__builtin_bswap32(encoder->width), __builtin_bswap32(encoder->height)};
+    memcpy(bytes, QOIV_MAGIC, 4);
+    memcpy(bytes + 4, values, 8);
+    bytes[12] = encoder->channels;
+    bytes[13] = encoder->bytes[13]; // Colorspace as written by encodeSource
+    values[0] = __builtin_bswap32(encoder->frameCount);
+    values[1] = __builtin_bswap32(encoder->keyframeInterval);
+    memcpy(bytes + 14, values, 8);
+    uint8_t* entry = bytes + sequenceHeaderSize;
+    for (uint32_t frame = 0; frame < encoder->frameCount; frame++) {
+      uint64_t offsetBE = __builtin_bswap64(sequenceHeaderSize + tableSize + encoder->offsets[frame]);
+      uint32_t sentinelBE = __builtin_bswap32(encoder->sentinels[frame]);
+      memcpy(entry, &offsetBE, 8);
+      memcpy(entry + 8, &sentinelBE, 4);
+      entry += sequenceEntrySize;
+    }
+    uint64_t sizeBE = __builtin_bswap64(size);
+    memcpy(entry, &sizeBE, 8);
+    memcpy(bytes + sequenceHeaderSize + tableSize, encoder->bytes, encoder->size);
+    *outSize = size;
+  }
+  sequenceEncoderFree(encoder);
+  return bytes;
+}
+
+// Decoder of a qoiv file in memory. The frame decoded last is kept in frame (RGBA), the next one
+// only applies its changes to it.
+struct qoi_sequence {
+  uint32_t width;
+  uint32_t height;
+  uint8_t channels;
+  uint8_t colorspace;
+  uint32_t frameCount;
+  uint32_t keyframeInterval;
+  const uint8_t* bytes;
+  size_t size;
+  const struct qoi_limits* limits;
+  uint8_t* frame;
+  int64_t current; // Index of the frame in frame, -1 before the first one
+};
+
+uint64_t sequenceOffset(const struct qoi_sequence* sequence, size_t frame) {
+  uint64_t offset;
+  memcpy(&offset, sequence->bytes + sequenceHeaderSize + frame * sequenceEntrySize, 8);
+  return __builtin_bswap64(offset);
+}
+
+uint32_t sequenceSentinel(const struct qoi_sequence* sequence, size_t frame) {
+  uint32_t sentinel;
+  memcpy(&sentinel, sequence->bytes + sequenceHeaderSize + frame * sequenceEntrySize + 8, 4);
+  return __builtin_bswap32(sentinel);
+}
+
+void closeSequence(struct qoi_sequence* sequence) {
+  free(sequence->frame);
+  sequence->frame = NULL;
+}
+
+// Reads and checks the header and frame table and allocates the RGBA frame. Every frame has to
+// hold enough ops for the pixels it claims, so the frame is only allocated for real data.
+// Returns 1 on success.
+int openSequence(struct qoi_sequence* sequence, const uint8_t* bytes, size_t size, const struct qoi_limits* limits,
+                 struct qoi_error* error) {
+  memset(sequence, 0, sizeof(struct qoi_sequence));
+  if (size < sequenceHeaderSize || memcmp(bytes, QOIV_MAGIC, 4) != 0) {
+    return qoiFail(error, QOI_ERROR_FORMAT, "File is not a qoi sequence");
+  }
+  uint32_t values[2];
+  memcpy(values, bytes + 4, 8);
+  sequence->width = __builtin_bswap32(values[0]);
+  sequence->height = __builtin_bswap32(values[1]);
+  sequence->channels = bytes[12];
+  sequence->colorspace = bytes[13];
+  memcpy(values, bytes + 14, 8);
+  sequence->frameCount = __builtin_bswap32(values[0]);
+  sequence->keyframeInterval = __builtin_bswap32(values[1]);
+  sequence->bytes = bytes;
+  sequence->size = size;
+  sequence->limits = limits;
+  sequence->current = -1;
+  if (!checkDimensions(sequence->width, sequence->height, error) ||
+      !checkLimits(sequence->width, sequence->height, QOI_FORMAT_RGBA, limits, error)) {
+    return 0;
+  }
+  if (size < sequenceHeaderSize + 8 || sequence->frameCount == 0 ||
+      (size - sequenceHeaderSize - 8) / sequenceEntrySize < sequence->frameCount) {
+    return qoiFail(error, QOI_ERROR_CORRUPT, "Qoi sequence frame table is truncated");
+  }
+  const size_t tableEnd = sequenceHeaderSize + (size_t)sequence->frameCount * sequenceEntrySize + 8;
+  uint64_t end;
+  memcpy(&end, bytes + tableEnd - 8, 8);
+  end = __builtin_bswap64(end);
+  if (end > size || sequenceSentinel(sequence, 0) != 0) {
+    return qoiFail(error, QOI_ERROR_CORRUPT, "Qoi sequence frame table is corrupt");
+  }
+  for (uint32_t frame = 0; frame < sequence->frameCount; frame++) {
+    uint64_t offset = sequenceOffset(sequence, frame);
+    uint64_t next = frame + 1 < sequence->frameCount ? sequenceOffset(sequence, frame + 1) : end;
+    uint32_t sentinel = sequenceSentinel(sequence, frame);
+    if (offset < tableEnd || next < offset || next > end || (sentinel != 0 && (sentinel & 255) != 255)) {
+      return qoiFail(error, QOI_ERROR_CORRUPT, "Qoi sequence frame table is corrupt");
+    }
+    if (next - offset < headerSize) {
+      return qoiFail(error, QOI_ERROR_CORRUPT, "Qoi sequence frame %u is truncated", frame);
+    }
+    if (!checkPlausibleSize(sequence->width, sequence->height, next - offset - headerSize, error)) {
+      return 0;
+    }
+  }
+  sequence->frame = malloc((size_t)sequence->width * sequence->height * 4 + 1);
+  if (sequence->frame == NULL) {
+    return qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for the frame");
+  }
+  return 1;
+}
+
+// Decodes one frame on top of sequence->frame: a keyframe replaces it, a delta frame overwrites
+// the pixels that are not the sentinel. Pixels after missing data are zero (keyframes) or kept.
+// Returns 0 on failure.
+int applyFrame(struct qoi_sequence* sequence, uint32_t index, struct qoi_error* error) {
+  const uint64_t offset = sequenceOffset(sequence, index);
+  const uint64_t next = index + 1 < sequence->frameCount ? sequenceOffset(sequence, index + 1) : sequence->size;
+  const uint8_t* bytes = sequence->bytes + offset;
+  const size_t size = next - offset;
+  struct qoi_header qoiHeader;
+  if (!readHeader(bytes, size, &qoiHeader, error)) {
+    return 0;
+  }
+  if (qoiHeader.width != sequence->width || qoiHeader.height != sequence->height) {
+    return qoiFail(error, QOI_ERROR_CORRUPT, "Qoi sequence frame %u has a different size", index);
+  }
+  const size_t pixelCount = (size_t)sequence->width * sequence->height;
+  const uint32_t sentinel = sequenceSentinel(sequence, index);
+  struct qoi_decoder decoder;
+  initDecoder(&decoder);
+  size_t p = headerSize;
+  size_t decoded = 0;
+  if (sentinel == 0) {
+    size_t consumed;
+    decoded = decodeOps(&decoder, bytes + p, size - p, &consumed, sequence->frame, pixelCount, QOI_FORMAT_RGBA);
+    memset(sequence->frame + decoded * 4, 0, (pixelCount - decoded) * 4);
+  } else {
+    // Decoded in chunks that are merged into the frame while still in cache
+    const size_t chunkPixels = 4096;
+    uint32_t chunk[4096];
+    uint8_t sentinelPixel[4] = {sentinel >> 24, sentinel >> 16, sentinel >> 8, sentinel};
+    uint32_t sentinelValue;
+    memcpy(&sentinelValue, sentinelPixel, 4);
+    uint32_t* frame = (uint32_t*)sequence->frame;
+    while (decoded < pixelCount) {
+      size_t count = pixelCount - decoded < chunkPixels ? pixelCount - decoded : chunkPixels;
+      size_t consumed;
+      size_t done = decodeOps(&decoder, bytes + p, size - p, &consumed, (uint8_t*)chunk, count, QOI_FORMAT_RGBA);
+      for (size_t i = 0; i < done; i++) {
+        frame[decoded + i] = chunk[i] != sentinelValue ? chunk[i] : frame[decoded + i];
+      }
+      p += consumed;
+      decoded += done;
+      if (done < count) {
+        break;
+      }
+    }
+  }
+  if (decoded != pixelCount) {
+    qoiFail(error, QOI_PARTIAL, "Qoi sequence frame %u is truncated", index);
+  }
+  return 1;
+}
+
+// Decodes frame index. Returns its RGBA pixels, owned by the sequence and valid until the next
+// call, or NULL on failure.
+const uint8_t* sequenceFrame(struct qoi_sequence* sequence, uint32_t index, struct qoi_error* error) {
+  if (index >= sequence->frameCount) {
+    qoiFail(error, QOI_ERROR_ARGUMENT, "Frame %u does not exist", index);
+    return NULL;
+  }
+  if (sequence->current == index) {
+    return sequence->frame;
+  }
+  uint32_t keyframe = index;
+  while (keyframe > 0 && sequenceSentinel(sequence, keyframe) != 0) {
+    keyframe--;
+  }
+  uint32_t start = sequence->current >= keyframe && sequence->current < index ? sequence->current + 1 : keyframe;
+  // The time budget is for one call, checked between frames
+  const double maxSeconds = sequence->limits->maxSeconds;
+  const double begin = maxSeconds > 0 ? secondsNow() : 0;
+  for (uint32_t frame = start; frame <= index; frame++) {
+    if (maxSeconds > 0 && secondsNow() - begin > maxSeconds) {
+      qoiFail(error, QOI_ERROR_TIMEOUT, "Decoding took longer than the limit of %g seconds", maxSeconds);
+      sequence->current = -1;
+      return NULL;
+    }
+    if (!applyFrame(sequence, frame, error)) {
+      sequence->current = -1;
+      return NULL;
+    }
+    sequence->current = frame;
+  }
+  return sequence->frame;
+}
+
+// Header probe: everything a catalog needs without decoding any pixels.
+struct qoi_info {
+  uint32_t width;
+  uint32_t height;
+  uint8_t channels;
+  uint8_t colorspace;
+  uint8_t tiled; // 1 for qoit files
+  uint64_t fileSize;
+  const char* error; // NULL when the file is a valid qoi/qoit file
+};
+
+// Reads only the header of a qoi or qoit file (two small preads, no pixel data) and checks the
+// magic, dimensions, channels and colorspace, and that the file is large enough to hold that
+// many pixels. checkEnd also reads the end of the file and checks QOI_END_CHUNK, in front of a
+// checksum chunk if there is one (plain qoi only).
+// qoiz files are not probed, their header is inside the compressed stream.
+// Does not print, returns 1 if the file is valid and the reason in info->error otherwise.
+int qoiInfo(const char* path, int checkEnd, struct qoi_info* info) {
+  memset(info, 0, sizeof(struct qoi_info));
+  int file = open(path, O_RDONLY);
+  if (file < 0) {
+    info->error = "file not found";
+    return 0;
+  }
+  struct stat fileStat;
+  uint8_t bytes[headerSize];
+  if (fstat(file, &fileStat) != 0 || pread(file, bytes, headerSize, 0) != headerSize) {
+    info->error = "could not read fileheader";
+    close(file);
+    return 0;
+  }
+  info->fileSize = fileStat.st_size;
+  uint32_t values[2];
+  memcpy(values, bytes + 4, 8);
+  info->width = __builtin_bswap32(values[0]);
+  info->height = __builtin_bswap32(values[1]);
+  info->channels = bytes[12];
+  info->colorspace = bytes[13];
+  info->tiled = memcmp(bytes, QOIT_MAGIC, 4) == 0;
+
+  // Smallest possible encoding is one run op per 62 pixels
+  uint64_t pixels = (uint64_t)info->width * info->height;
+  uint64_t minimumSize = info->tiled ? tiledHeaderSize + 16 : headerSize + (pixels + 61) / 62 + sizeof(QOI_END_CHUNK);
+  if (!info->tiled && memcmp(bytes, "qoif", 4) != 0) {
+    info->error = memcmp(bytes, QOIZ_MAGIC, 4) == 0 ? "qoiz files cannot be probed" : "not a qoi file";
+  } else if (info->width == 0 || info->height == 0) {
+    info->error = "zero width or height";
+  } else if (info->channels != 3 && info->channels != 4) {
+    info->error = "invalid channels";
+  } else if (info->colorspace > 1) {
+    info->error = "invalid colorspace";
+  } else if (info->fileSize < minimumSize) {
+    info->error = "file too small for its dimensions";
+  } else if (checkEnd && !info->tiled) {
+    // The end chunk is followed by the checksum chunk if there is one, which readChecksumChunk
+    // only accepts after an end chunk
+    uint8_t trailer[headerSize + sizeof(QOI_END_CHUNK) + checksumChunkSize];
+    size_t trailerSize = info->fileSize < sizeof(trailer) ? info->fileSize : sizeof(trailer);
+    struct qoi_checksums checksums;
+    uint64_t end;
+    if (pread(file, trailer, trailerSize, info->fileSize - trailerSize) != (ssize_t)trailerSize) {
+      info->error = "missing end chunk";
+    } else if (!readChecksumChunk(trailer, trailerSize, &checksums)) {
+      memcpy(&end, trailer + trailerSize - 8, 8);
+      if (__builtin_bswap64(end) != QOI_END_CHUNK) {
+        info->error = "missing end chunk";
+      }
+    }
+  }
+  close(file);
+  return info->error == NULL;
+}
+
+struct info_job {
+  const char* const* paths;
+  struct qoi_info* infos;
+  size_t start;
+  size_t end;
+  int checkEnd;
+};
+
+void infoJob(void* argument) {
+  struct info_job* job = argument;
+  for (size_t i = job->start; i < job->end; i++) {
+    qoiInfo(job->paths[i], job->checkEnd, &job->infos[i]);
+  }
+}
+
+// Probes count files on the pool, so the reads of many files are in flight at once. Files are
+// handed out in batches to keep the queue short. Returns the number of valid files.
+size_t qoiInfoBatch(const char* const* paths, size_t count, int checkEnd, struct qoi_info* infos, struct thread_pool* pool) {
+  const size_t batchSize = 64;
+  size_t jobCount = (count + batchSize - 1) / batchSize;
+  struct info_job* jobs = calloc(jobCount > 0 ? jobCount : 1, sizeof(struct info_job));
+  if (jobs == NULL) {
+    struct info_job all = {paths, infos, 0, count, checkEnd};
+    infoJob(&all);
+  } else {
+    for (size_t j = 0; j < jobCount; j++) {
+      size_t end = (j + 1) * batchSize < count ? (j + 1) * batchSize : count;
+      jobs[j] = (struct info_job){paths, infos, j * batchSize, end, checkEnd};
+      poolSubmit(pool, infoJob, &jobs[j]);
+    }
+    poolWait(pool);
+    free(jobs);
+  }
+  size_t valid = 0;
+  for (size_t i = 0; i < count; i++) {
+    valid += infos[i].error == NULL;
+  }
+  return valid;
+}
+
+struct qoi_decode_options {
+  // Threads for tiled files, 0 = one per CPU
+  int threads;
+  // Decode only this rectangle when width > 0 (plain and tiled files)
+  uint32_t rectX;
+  uint32_t rectY;
+  uint32_t rectWidth;
+  uint32_t rectHeight;
+  // Downscale to a thumbnail of this size when thumbnailWidth > 0 (plain qoi only).
+  // thumbnailHeight 0 keeps the aspect ratio.
+  uint32_t thumbnailWidth;
+  uint32_t thumbnailHeight;
+  // Output pixel format, see enum qoi_pixel_format. Thumbnails are always RGBA.
+  int format;
+  // Print the checksums of the file (plain qoi only). Checksum chunks are verified regardless.
+  int checksum;
+  // Limits for untrusted files. The size limits apply to the output (the rectangle, the whole
+  // tiled image), except the pixel limit of a thumbnail, which applies to the decoded source.
+  // The time budget applies to plain, qoiz and thumbnail decodes.
+  struct qoi_limits limits;
+};
+
+const struct qoi_decode_options defaultDecodeOptions = {0, 0, 0, 0, 0, 0, 0, QOI_FORMAT_RGBA, 0, {0, 0, 0}};
+
+// Returns 1 if path ends with extension (".raw", ".png", ...)
+int hasExtension(const char* path, const char* extension) {
+  size_t length = strlen(path);
+  size_t extensionLength = strlen(extension);
+  return length > extensionLength && strcmp(path + length - extensionLength, extension) == 0;
+}
+
+// Returns 1 if stb_image_write can write an image of this size as png. Its sizes are ints: the
+// filtered image, one byte per row more than the pixels, must fit.
+int pngFits(uint32_t width, uint32_t height, int channels, struct qoi_error* error) {
+  if (((uint64_t)width * channels + 1) * height > INT_MAX) {
+    return qoiFail(error, QOI_ERROR_TOO_LARGE, "Image of %ux%u pixels is too large for png output, write a .raw file instead",
+                   width, height);
+  }
+  return 1;
+}
+
+// Outcome of a file conversion (decodeWithOptions, encodeWithOptions, encodeRaw), for the
+// command line to print
+struct qoi_report {
+  struct qoi_error error;
+  int checksummed; // 1 if checksums holds the checksums of the file (--checksum)
+  int verified; // 1 if they matched the checksum chunk of the file (decode)
+  struct qoi_checksums checksums;
+};
+
+// Decodes a plain qoi file to raw pixels in format, reading and writing in blocks so that neither
+// the file nor the image has to fit in memory. The limits and the plausibility of the size are
+// checked before the output is created, the time budget once per band. Missing data is written
+// as zeroed pixels, so the output always holds the whole image. A checksum chunk is verified at
+// the end (the output is removed on a mismatch) and with checksums the checksums are reported as
+// decode --checksum does. Returns 0 on success, 1 on failure and -1 without any output if infile
+// is not a plain qoi file.
+int decodeStream(const char* infile, const char* outfile, int format, int checksums, const struct qoi_limits* limits,
+                 struct qoi_report* report) {
+  struct qoi_error* error = &report->error;
+  FILE* in = fopen(infile, "rb");
+  if (in == NULL) {
+    return !qoiFail(error, QOI_ERROR_IO, "File %s not found", infile);
+  }
+  uint8_t header[headerSize];
+  if (fread(header, 1, headerSize, in) != headerSize || memcmp(header, "qoif", 4) != 0) {
+    fclose(in);
+    return -1;
+  }
+  struct qoi_header qoiHeader;
+  off_t fileSize = fseeko(in, 0, SEEK_END) == 0 ? ftello(in) : -1;
+  if (!readHeader(header, headerSize, &qoiHeader, error) ||
+      !checkLimits(qoiHeader.width, qoiHeader.height, format, limits, error) ||
+      (fileSize >= headerSize && !checkPlausibleSize(qoiHeader.width, qoiHeader.height, fileSize - headerSize, error))) {
+    fclose(in);
+    return 1;
+  }
+  // The checksum chunk is at the very end, look for it first to know whether to hash
+  uint8_t trailer[headerSize + sizeof(QOI_END_CHUNK) + checksumChunkSize];
+  struct qoi_checksums expected;
+  int stored = fseeko(in, -(off_t)sizeof(trailer), SEEK_END) == 0 && fread(trailer, 1, sizeof(trailer), in) == sizeof(trailer) &&
+               readChecksumChunk(trailer, sizeof(trailer), &expected);
+  const int hashing = stored || checksums;
+  if (fseeko(in, headerSize, SEEK_SET) != 0) {
+    fclose(in);
+    return !qoiFail(error, QOI_ERROR_IO, "Could not read file %s", infile);
+  }
+
+  const size_t blockSize = 1 << 20;
+  const size_t chunkPixels = 1 << 16;
+  const size_t carryMax = 8; // Up to 4 bytes of an incomplete op are carried over to the next block
+  const size_t pixelSize = formatSize(format);
+  uint8_t* block = malloc(carryMax + blockSize);
+  uint8_t* rgba = malloc(chunkPixels * 4);
+  uint8_t* converted = format != QOI_FORMAT_RGBA ? malloc(chunkPixels * pixelSize) : rgba;
+  FILE* out = fopen(outfile, "wb");
+  if (block == NULL || rgba == NULL || converted == NULL || out == NULL) {
+    if (out == NULL) {
+      qoiFail(error, QOI_ERROR_IO, "Could not write %s", outfile);
+    } else {
+      qoiFail(error, QOI_ERROR_NO_MEMORY, "Not enough memory for decoding");
+    }
+    free(block);
+    free(rgba);
+    if (converted != rgba) {
+      free(converted);
+    }
+    if (out != NULL) {
+      fclose(out);
+    }
+    fclose(in);
+    return 1;
+  }
+
+  struct qoi_checksum_state state;
+  initChecksumState(&state);
+  xxh64Update(&state.stream, header, headerSize);
+  struct qoi_decoder decoder;
+  initDecoder(&decoder);
+  const size_t pixelCount = (size_t)qoiHeader.width * qoiHeader.height;
+  const double begin = limits->maxSeconds > 0 ? secondsNow() : 0;
+  size_t nextCheck = 0;
+  size_t decoded = 0;
+  size_t carry = 0;
+  uint8_t endChunk[8];
+  size_t endChunkSize = 0;
+  int failed = 0;
+  while (!failed) {
+    size_t got = fread(block + carry, 1, blockSize, in);
+    size_t available = carry + got;
+    size_t start = 0;
+    while (decoded < pixelCount) {
+      if (decoded >= nextCheck) {
+        nextCheck = decoded + QOI_OUTPUT_BAND;
+        if (limits->maxSeconds > 0 && secondsNow() - begin > limits->maxSeconds) {
+          failed = !qoiFail(error, QOI_ERROR_TIMEOUT, "Decoding took longer than the limit of %g seconds",
+                            limits->maxSeconds);
+          break;
+        }
+      }
+      size_t count = pixelCount - decoded < chunkPixels ? pixelCount - decoded : chunkPixels;
+      size_t consumed;
+      size_t done = decodeOps(&decoder, block + start, available - start, &consumed, rgba, count, QOI_FORMAT_RGBA);
+      if (hashing) {
+        xxh64Update(&state.pixels, rgba, done * 4);
+        xxh64Update(&state.stream, block + start, consumed);
+      }
+      if (converted != rgba) {
+        convertPixels(rgba, converted, done, format);
+      }
+      if (fwrite(converted, pixelSize, done, out) != done) {
+        failed = !qoiFail(error, QOI_ERROR_IO, "Could not write %s", outfile);
+        break;
+      }
+      start += consumed;
+      decoded += done;
+      if (done < count) {
+        break;
+      }
+    }
+    if (decoded == pixelCount) {
+      // Whatever follows the last op is the end chunk
+      for (; start < available && endChunkSize < 8; start++) {
+        endChunk[endChunkSize++] = block[start];
+      }
+      if (endChunkSize == 8 || got == 0) {
+        break;
+      }
+      carry = 0;
+    } else if (got == 0) {
+      break;
+    } else {
+      carry = available - start;
+      memmove(block, block + start, carry);
+    }
+  }
+  if (!failed && decoded != pixelCount) {
+    // Zeroed pixels for the missing data, as the in-memory decoders return
+    qoiFail(error, QOI_PARTIAL, "Missing data, partially decoded");
+    memset(converted, 0, chunkPixels * pixelSize);
+    for (size_t missing = pixelCount - decoded; missing > 0 && !failed;) {
+      size_t count = missing < chunkPixels ? missing : chunkPixels;
+      if (fwrite(converted, pixelSize, count, out) != count) {
+        failed = !qoiFail(error, QOI_ERROR_IO, "Could not write %s", outfile);
+      }
+      missing -= count;
+    }
+  }
+  free(block);
+  free(rgba);
+  if (converted != rgba) {
+    free(converted);
+  }
+  fclose(in);
+  if (fclose(out) != 0 && !failed) {
+    failed = !qoiFail(error, QOI_ERROR_IO, "Could not write %s", outfile);
+  }
+
+  if (!failed) {
+    checkEndChunk(endChunk, endChunkSize, error);
+  }
+  if (hashing) {
+    xxh64Update(&state.stream, endChunk, endChunkSize);
+    struct qoi_checksums result = {xxh64Digest(&state.pixels), xxh64Digest(&state.stream)};
+    int mismatch = stored && (result.pixels != expected.pixels || result.stream != expected.stream);
+    report->checksummed = checksums;
+    report->verified = stored && !mismatch;
+    report->checksums = result;
+    if (mismatch) {
+      failed = !qoiFail(error, QOI_ERROR_CHECKSUM, "Checksum mismatch");
+    }
+  }
+  if (failed) {
+    remove(outfile);
+  }
+  return failed;
+}
+
+// Decodes infile to a png (or raw pixels for a .raw outfile). Returns the status, the details are
+// in report.
+enum qoi_status decodeWithOptions(const char* infile, const char* outfile, const struct qoi_decode_options* options,
+                                  struct qoi_report* report) {
+  memset(report, 0, sizeof(struct qoi_report));
+  struct qoi_error* error = &report->error;
+  // Raw output of a plain qoi file is streamed, for images that do not fit in memory
+  const int rawOutput = hasExtension(outfile, ".raw");
+  if (rawOutput && options->rectWidth == 0 && options->thumbnailWidth == 0 &&
+      decodeStream(infile, outfile, options->format, options->checksum, &options->limits, report) >= 0) {
+    return error->status;
+  }
+  size_t size;
+  uint8_t* bytes = readFile(infile, &size, error);
+  if (bytes == NULL) {
+    return error->status;
+  }
+  // Checksums cover the whole image of a plain qoi file
+  if (options->checksum && (options->rectWidth > 0 || options->thumbnailWidth > 0 || size < 4 ||
+                            memcmp(bytes, "qoif", 4) != 0)) {
+    qoiFail(error, QOI_ERROR_ARGUMENT, "--checksum is only supported for whole plain qoi files");
+    free(bytes);
+    return error->status;
+  }
+
+  struct qoi_header qoiHeader;
+  uint8_t* imageData;
+  if (size >= 4 && memcmp(bytes, QOIT_MAGIC, 4) == 0) {
+    struct qoi_tiled_header tiled;
+    imageData = NULL;
+    if (readTiledHeader(bytes, size, &tiled, error)) {
+      qoiHeader.width = options->rectWidth > 0 ? options->rectWidth : tiled.width;
+      qoiHeader.height = options->rectWidth > 0 ? options->rectHeight : tiled.height;
+      struct thread_pool* pool = NULL;
+      if (checkLimits(qoiHeader.width, qoiHeader.height, options->format, &options->limits, error)) {
+        pool = poolCreate(options->threads);
+        if (pool == NULL) {
+          qoiFail(error, QOI_ERROR_NO_MEMORY, "Could not create the thread pool");
+        }
+      }
+      if (pool != NULL) {
+        imageData = decodeTiledRect(bytes, size, options->rectX, options->rectY, qoiHeader.width, qoiHeader.height,
+                                    options->format, pool, error);
+        poolDestroy(pool);
+      }
+    }
+  } else if (options->checksum) {
+    struct qoi_checksums expected;
+    int stored = readChecksumChunk(bytes, size, &expected);
+    imageData = decodeVerified(bytes, size, &qoiHeader, options->format, stored ? &expected : NULL, &report->checksums,
+                               &options->limits, error);
+    report->checksummed = imageData != NULL || error->status == QOI_ERROR_CHECKSUM;
+    report->verified = stored && imageData != NULL;
+  } else if (options->rectWidth > 0) {
+    imageData = !checkLimits(options->rectWidth, options->rectHeight, options->format, &options->limits, error) ? NULL :
+                decodeRect(bytes, size, options->rectX, options->rectY, options->rectWidth, options->rectHeight,
+                           options->format, &qoiHeader, error);
+    qoiHeader.width = options->rectWidth;
+    qoiHeader.height = options->rectHeight;
+  } else if (options->thumbnailWidth > 0) {
+    uint32_t thumbnailHeight = options->thumbnailHeight;
+    if (thumbnailHeight == 0 && readHeader(bytes, size, &qoiHeader, NULL)) {
+      thumbnailHeight = ((uint64_t)qoiHeader.height * options->thumbnailWidth + qoiHeader.width / 2) / qoiHeader.width;
+      thumbnailHeight = thumbnailHeight > 0 ? thumbnailHeight : 1;
+    }
+    imageData = decodeThumbnail(bytes, size, options->thumbnailWidth, thumbnailHeight, &qoiHeader, &options->limits, error);
+  } else if (size >= 4 && memcmp(bytes, QOIZ_MAGIC, 4) == 0) {
+    imageData = decodeQoiz(bytes, size, &qoiHeader, options->format, &options->limits, error);
+  } else {
+    imageData = decodeLimited(bytes, size, &qoiHeader, options->format, &options->limits, error);
+  }
+  free(bytes);
+  if (imageData == NULL) {
+    return error->status;
+  }
+
+  // The png gets as many channels as the format has, their order is not changed
+  int channels = options->thumbnailWidth > 0 ? 4 : formatSize(options->format);
+  if (rawOutput) {
+    size_t imageSize = (size_t)qoiHeader.width * qoiHeader.height * channels;
+    FILE* file = fopen(outfile, "wb");
+    if (file == NULL || fwrite(imageData, 1, imageSize, file) != imageSize) {
+      qoiFail(error, QOI_ERROR_IO, "Could not write %s", outfile);
+    }
+    if (file != NULL) {
+      fclose(file);
+    }
+  } else if (pngFits(qoiHeader.width, qoiHeader.height, channels, error) &&
+             !stbi_write_png(outfile, qoiHeader.width, qoiHeader.height, channels, imageData, qoiHeader.width * channels)) {
+    qoiFail(error, QOI_ERROR_IO, "Could not write %s", outfile);
+  }
+
+  free(imageData);
+  return error->status;
+}
+
+enum qoi_status decode(const char* infile, const char* outfile) {
+  struct qoi_report report;
+  return decodeWithOptions(infile, outfile, &defaultDecodeOptions, &report);
+}
+
+// Encodes the source with the options and writes the result to outfile.
+// Encodes to a malloc'd qoi, qoit or qoiz file depending on the options. Returns NULL on failure.
+uint8_t* encodeToMemory(const struct qoi_source* source, const struct qoi_encode_options* options, size_t* outSize,
+                        struct qoi_error* error) {
+  uint8_t* bytes;
+  if (options != NULL && options->tileSize > 0) {
+    struct thread_pool* pool = poolCreate(options->threads);
+    if (pool == NULL) {
+      qoiFail(error, QOI_ERROR_NO_MEMORY, "Could not create the thread pool");
+    }
+    bytes = pool != NULL ? encodeTiled(source, options->tileSize, options->tileSize, options, pool, outSize, error) : NULL;
+    poolDestroy(pool);
+  } else {
+    bytes = encodeSource(source, options, outSize, error);
+  }
+  if (bytes != NULL && options != NULL && options->compress) {
+    uint8_t* qoi = bytes;
+    bytes = compressQoiz(qoi, *outSize, outSize, error);
+    free(qoi);
+  }
+  return bytes;
+}
+
+void writeEncoded(const struct qoi_source* source, const char* outfile, const struct qoi_encode_options* options,
+                  struct qoi_report* report) {
+  size_t size;
+  uint8_t* bytes = encodeToMemory(source, options, &size, &report->error);
+  if (bytes == NULL) {
+    return;
+  }
+  if (options != NULL && options->checksum) {
+    report->checksummed = readChecksumChunk(bytes, size, &report->checksums);
+  }
+
+  FILE* file = fopen(outfile, "wb");
+  if (file == NULL || fwrite(bytes, 1, size, file) != size) {
+    qoiFail(&report->error, QOI_ERROR_IO, "Could not write %s", outfile);
+  }
+  if (file != NULL) {
+    fclose(file);
+  }
+
+  free(bytes);
+}
+
+// Encodes a png (or any other format stb_image reads) to outfile. Returns the status, the
+// details are in report.
+enum qoi_status encodeWithOptions(const char* infile, const char* outfile, const struct qoi_encode_options* options,
+                                  struct qoi_report* report) {
+  memset(report, 0, sizeof(struct qoi_report));
+  int width;
+  int height;
+  int channels;
+  if(!stbi_info(infile, &width, &height, &channels)) {
+    qoiFail(&report->error, QOI_ERROR_FORMAT, "Cannot read image info from infile %s (%s)", infile, stbi_failure_reason());
+    return report->error.status;
+  }
+
+  if(channels != 3) {
+    channels = 4;
+  }
+
+  uint8_t* pixels = (uint8_t *)stbi_load(infile, &width, &height, NULL, channels);
+
+  if (pixels == NULL) {
+    qoiFail(&report->error, QOI_ERROR_FORMAT, "Couldn't load image file (%s)", stbi_failure_reason());
+    return report->error.status;
+  }
+
+  struct qoi_source source = {pixels, width, height, 0, channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB};
+  writeEncoded(&source, outfile, options, report);
+  free(pixels);
+  return report->error.status;
+}
+
+#ifdef __linux__
+// Encodes a raw file to a plain qoi file through mappings of both files, so that neither has to
+// fit in memory: the kernel reads the input and writes the output back as the encoder advances.
+// The output is allocated on disk for the worst case first and truncated after encoding.
+// Returns 0 on success.
+int encodeMapped(const char* infile, const char* outfile, const struct qoi_source* layout,
+                 const struct qoi_encode_options* options, struct qoi_report* report) {
+  struct qoi_source source = *layout;
+  if (!checkDimensions(source.width, source.height, &report->error)) {
+    return 1;
+  }
+  int in = open(infile, O_RDONLY);
+  struct stat status;
+  if (in < 0 || fstat(in, &status) != 0) {
+    if (in >= 0) {
+      close(in);
+    }
+    return !qoiFail(&report->error, QOI_ERROR_IO, "File %s not found", infile);
+  }
+  size_t size = status.st_size;
+  size_t stride = source.stride > 0 ? source.stride : (size_t)source.width * formatSize(source.format);
+  size_t needed = source.height > 0 ? (size_t)(source.height - 1) * stride + (size_t)source.width * formatSize(source.format) : 0;
+  if (size < needed || size == 0) {
+    close(in);
+    return !qoiFail(&report->error, QOI_ERROR_ARGUMENT, "Raw file is %lu bytes, the layout needs %lu", size, needed);
+  }
+  uint8_t* input = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+  close(in);
+  if (input == MAP_FAILED) {
+    return !qoiFail(&report->error, QOI_ERROR_IO, "Could not map %s", infile);
+  }
+  madvise(input, size, MADV_SEQUENTIAL);
+  source.pixels = input;
+
+  size_t maxSize = encodedMaxSize(&source);
+  int out = open(outfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int error = out < 0 ? errno : posix_fallocate(out, 0, maxSize);
+  uint8_t* output = error == 0 ? mmap(NULL, maxSize, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0) : MAP_FAILED;
+  if (output == MAP_FAILED) {
+    qoiFail(&report->error, QOI_ERROR_IO, "Could not write %s (%s)", outfile, strerror(error != 0 ? error : errno));
+    munmap(input, size);
+    if (out >= 0) {
+      close(out);
+      remove(outfile);
+    }
+    return 1;
+  }
+  madvise(output, maxSize, MADV_SEQUENTIAL);
+
+  size_t outSize = encodeInto(&source, options, output, NULL, &report->error);
+  if (outSize > 0 && options != NULL && options->checksum) {
+    report->checksummed = readChecksumChunk(output, outSize, &report->checksums);
+  }
+  munmap(output, maxSize);
+  munmap(input, size);
+  int failed = outSize == 0 || ftruncate(out, outSize) != 0;
+  failed |= close(out) != 0;
+  if (failed) {
+    qoiFail(&report->error, QOI_ERROR_IO, "Could not write %s", outfile);
+    remove(outfile);
+  }
+  return failed;
+}
+#endif
+
+// Encodes a raw frame (e.g. a capture or render target dump) laid out as described by
+// layout, whose pixels pointer is ignored. Returns the status, the details are in report.
+enum qoi_status encodeRaw(const char* infile, const char* outfile, const struct qoi_source* layout,
+                          const struct qoi_encode_options* options, struct qoi_report* report) {
+  memset(report, 0, sizeof(struct qoi_report));
+#ifdef __linux__
+  // Plain qoi output is encoded through file mappings, for frames that do not fit in memory
+  if (options == NULL || (!options->compress && options->tileSize == 0)) {
+    encodeMapped(infile, outfile, layout, options, report);
+    return report->error.status;
+  }
+#endif
+  size_t size;
+  uint8_t* bytes = readFile(infile, &size, &report->error);
+  if (bytes == NULL) {
+    return report->error.status;
+  }
+  struct qoi_source source = *layout;
+  source.pixels = bytes;
+  size_t stride = source.stride > 0 ? source.stride : (size_t)source.width * formatSize(source.format);
+  size_t needed = source.height > 0 ? (size_t)(source.height - 1) * stride + (size_t)source.width * formatSize(source.format) : 0;
+  if (size < needed) {
+    qoiFail(&report->error, QOI_ERROR_ARGUMENT, "Raw file is %lu bytes, the layout needs %lu", size, needed);
+  } else {
+    writeEncoded(&source, outfile, options, report);
+  }
+  free(bytes);
+  return report->error.status;
+}
+
+enum qoi_status encode(const char* infile, const char* outfile) {
+  struct qoi_report report;
+  return encodeWithOptions(infile, outfile, &defaultEncodeOptions, &report);
+}
+
+// Prints the checksums and the outcome of a file conversion, the only place where the encode and
+// decode commands print. Returns the exit code for status.
+int printReport(enum qoi_status status, const struct qoi_report* report) {
+  if (report->checksummed) {
+    printf("Checksums: pixels %016llx stream %016llx%s\n", (unsigned long long)report->checksums.pixels,
+           (unsigned long long)report->checksums.stream,
+           report->verified ? " (verified)" : status == QOI_ERROR_CHECKSUM ? " (mismatch)" : "");
+  }
+  if (status != QOI_OK) {
+    printf("%s\n", report->error.detail);
+  }
+  return QOI_FAILED(status);
+}
+
+// Decodes a qoi or qoiz file in memory within the limits. Tiled files need a thread pool, see decodeTiledRect.
+uint8_t* decodeBytes(const uint8_t* bytes, size_t size, struct qoi_header* qoiHeader, int format,
+                     const struct qoi_limits* limits, struct qoi_error* error) {
+  if (size >= 4 && memcmp(bytes, QOIT_MAGIC, 4) == 0) {
+    qoiFail(error, QOI_ERROR_FORMAT, "Tiled qoi files are not supported here");
+    return NULL;
+  }
+  if (size >= 4 && memcmp(bytes, QOIZ_MAGIC, 4) == 0) {
+    return decodeQoiz(bytes, size, qoiHeader, format, limits, error);
+  }
+  return decodeLimited(bytes, size, qoiHeader, format, limits, error);
+}
+
+// Content-addressed conversion cache for the batch tool (--cache DIR). Entries are keyed by the
+// xxHash64 of the input bytes seeded with the conversion options, and stored as
+// DIR/<first 2 hex digits>/<16 hex digits>-<input size in hex>. The entry is the output file.
+// Recency is the entry's mtime, refreshed on every hit. cacheTrim evicts the least recently used
+// entries above the size limit.
+struct conversion_cache {
+  const char* dir;
+  uint64_t maxBytes; // 0 = no limit
+  uint64_t seed; // Hash of the options, part of the key
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t bytes; // Size of the cache after cacheTrim
+  uint32_t tempCounter;
+};
+
+// Bump when the encoder output changes, so old entries are not returned any more
+const uint32_t cacheVersion = 2;
+
+void cacheInit(struct conversion_cache* cache, const char* dir, uint64_t maxBytes, int mode,
+               const struct qoi_encode_options* options) {
+  memset(cache, 0, sizeof(struct conversion_cache));
+  cache->dir = dir;
+  cache->maxBytes = maxBytes;
+  int32_t key[6] = {cacheVersion, mode, options->effort, options->maxError, options->compress, options->tileSize};
+  cache->seed = xxHash64(key, sizeof(key), 0);
+  mkdir(dir, 0755);
+}
+
+void cacheEntryPath(const struct conversion_cache* cache, const uint8_t* input, size_t inputSize, char* path, size_t size) {
+  uint64_t hash = xxHash64(input, inputSize, cache->seed);
+  snprintf(path, size, "%s/%02x/%016llx-%llx", cache->dir, (unsigned)(hash >> 56), (unsigned long long)hash,
+           (unsigned long long)inputSize);
+}
+
+// Returns the cached output (malloc'd) and refreshes its recency, or NULL on a miss.
+uint8_t* cacheLookup(struct conversion_cache* cache, const char* path, size_t* outSize) {
+  int file = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat fileStat;
+  uint8_t* bytes = NULL;
+  if (file >= 0 && fstat(file, &fileStat) == 0) {
+    bytes = malloc(fileStat.st_size > 0 ? fileStat.st_size : 1);
+    if (bytes != NULL && read(file, bytes, fileStat.st_size) != fileStat.st_size) {
+      free(bytes);
+      bytes = NULL;
+    }
+    if (bytes != NULL) {
+      *outSize = fileStat.st_size;
+      futimens(file, NULL);
+    }
+  }
+  if (file >= 0) {
+    close(file);
+  }
+  __atomic_fetch_add(bytes != NULL ? &cache->hits : &cache->misses, 1, __ATOMIC_RELAXED);
+  return bytes;
+}
+
+// Adds an entry. Written to a temporary file and renamed, so concurrent batches never see a partial entry.
+void cacheStore(struct conversion_cache* cache, const char* path, const uint8_t* bytes, size_t size) {
+  char temp[PATH_MAX];
+  snprintf(temp, sizeof(temp), "%s.%d.%u.tmp", path, (int)getpid(), __atomic_fetch_add(&cache->tempCounter, 1, __ATOMIC_RELAXED));
+  // The directory of the entry, created on first use
+  char* slash = strrchr(temp, '/');
+  *slash = '\0';
+  mkdir(temp, 0755);
+  *slash = '/';
+  FILE* file = fopen(temp, "wb");
+  if (file == NULL) {
+    return;
+  }
+  int written = fwrite(bytes, 1, size, file) == size;
+  if (fclose(file) != 0 || !written || rename(temp, path) != 0) {
+    unlink(temp);
+  }
+}
+
+struct cache_entry {
+  struct timespec used;
+  uint64_t size;
+  char* path;
+};
+
+int compareCacheEntries(const void* a, const void* b) {
+  const struct cache_entry* x = a;
+  const struct cache_entry* y = b;
+  if (x->used.tv_sec != y->used.tv_sec) {
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+  }
+  return x->used.tv_nsec < y->used.tv_nsec ? -1 : x->used.tv_nsec > y->used.tv_nsec;
+}
+
+// Evicts least recently used entries until the cache fits in maxBytes and updates cache->bytes.
+void cacheTrim(struct conversion_cache* cache) {
+  struct cache_entry* entries = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  uint64_t total = 0;
+  char path[PATH_MAX];
+  for (int bucket = 0; bucket < 256; bucket++) {
+    snprintf(path, sizeof(path), "%s/%02x", cache->dir, bucket);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+      continue;
+    }
+    struct dirent* dirEntry;
+    while ((dirEntry = readdir(dir)) != NULL) {
+      struct stat fileStat;
+      snprintf(path, sizeof(path), "%s/%02x/%s", cache->dir, bucket, dirEntry->d_name);
+      if (dirEntry->d_name[0] == '.' || stat(path, &fileStat) != 0 || !S_ISREG(fileStat.st_mode)) {
+        continue;
+      }
+      total += fileStat.st_size;
+      if (cache->maxBytes == 0) {
+        continue;
+      }
+      if (count == capacity) {
+        capacity = capacity > 0 ? capacity * 2 : 1024;
+        struct cache_entry* grown = realloc(entries, capacity * sizeof(struct cache_entry));
+        if (grown == NULL) {
+          break;
+        }
+        entries = grown;
+      }
+      entries[count].used = fileStat.st_mtim;
+      entries[count].size = fileStat.st_size;
+      entries[count].path = strdup(path);
+      count += entries[count].path != NULL;
+    }
+    closedir(dir);
+  }
+  if (cache->maxBytes > 0 && total > cache->maxBytes) {
+    qsort(entries, count, sizeof(struct cache_entry), compareCacheEntries);
+    for (size_t i = 0; i < count && total > cache->maxBytes; i++) {
+      if (unlink(entries[i].path) == 0) {
+        total -= entries[i].size;
+        cache->evictions++;
+      }
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    free(entries[i].path);
+  }
+  free(entries);
+  cache->bytes = total;
+}
+
+// Batch conversion of many files (the batch command). The codec runs on the thread pool. With the
+// io_uring backend the main thread opens, reads, writes and closes files asynchronously, so the
+// inputs of upcoming files are read and finished outputs written while the workers are coding.
+// The blocking backend does plain readFile/fwrite calls inside each pool job.
+enum batch_mode { BATCH_ENCODE, BATCH_DECODE };
+
+enum batch_io { BATCH_IO_AUTO, BATCH_IO_URING, BATCH_IO_BLOCKING };
+
+struct batch;
+
+struct batch_item {
+  struct batch* batch;
+  const char* inPath;
+  char* outPath;
+  uint8_t* input; // A read slot or malloc'd for files larger than a slot
+  size_t inputSize;
+  size_t inputCapacity;
+  int slot; // Read slot owning input, -1 if input is malloc'd
+  uint8_t* output;
+  size_t outputSize;
+  size_t written;
+  int fd;
+  int failed;
+  int finished; // The io_uring loop is done with it
+  struct qoi_error error; // Why the item failed
+  struct batch_item* nextDone;
+};
+
+struct batch {
+  int mode;
+  struct qoi_encode_options options;
+  struct batch_item* items;
+  size_t count;
+  struct thread_pool* pool;
+  // Items whose codec job has finished, handed back to the io_uring loop
+  pthread_mutex_t mutex;
+  struct batch_item* done;
+  int eventFd; // Signalled after pushing to done, -1 for the blocking backend
+  struct conversion_cache* cache; // NULL without --cache
+};
+
+// Output path: outdir/<input name without extension><extension>. Returns NULL without memory.
+char* batchOutputPath(const char* outdir, const char* inPath, const char* extension) {
+  const char* name = strrchr(inPath, '/');
+  name = name != NULL ? name + 1 : inPath;
+  const char* dot = strrchr(name, '.');
+  size_t nameLength = dot != NULL && dot != name ? (size_t)(dot - name) : strlen(name);
+  size_t length = strlen(outdir) + 1 + nameLength + strlen(extension) + 1;
+  char* path = malloc(length);
+  if (path != NULL) {
+    snprintf(path, length, "%s/%.*s%s", outdir, (int)nameLength, name, extension);
+  }
+  return path;
+}
+
+// Converts item->input to item->output (png to qoi/qoiz/qoit, or qoi/qoiz to png).
+void batchConvert(struct batch_item* item) {
+  const struct batch* batch = item->batch;
+  char cachePath[PATH_MAX];
+  if (batch->cache != NULL) {
+    cacheEntryPath(batch->cache, item->input, item->inputSize, cachePath, sizeof(cachePath));
+    item->output = cacheLookup(batch->cache, cachePath, &item->outputSize);
+    if (item->output != NULL) {
+      return;
+    }
+  }
+  if (batch->mode == BATCH_ENCODE) {
+    int width;
+    int height;
+    int channels;
+    if (!stbi_info_from_memory(item->input, item->inputSize, &width, &height, &channels)) {
+      item->failed = !qoiFail(&item->error, QOI_ERROR_FORMAT, "Cannot read image info (%s)", stbi_failure_reason());
+      return;
+    }
+    channels = channels == 3 ? 3 : 4;
+    uint8_t* pixels = stbi_load_from_memory(item->input, item->inputSize, &width, &height, NULL, channels);
+    if (pixels == NULL) {
+      item->failed = !qoiFail(&item->error, QOI_ERROR_FORMAT, "Couldn't load image file (%s)", stbi_failure_reason());
+      return;
+    }
+    struct qoi_source source = {pixels, width, height, 0, channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB};
+    item->output = encodeToMemory(&source, &batch->options, &item->outputSize, &item->error);
+    free(pixels);
+  } else {
+    struct qoi_header qoiHeader;
+    uint8_t* pixels = decodeBytes(item->input, item->inputSize, &qoiHeader, QOI_FORMAT_RGBA, &noLimits, &item->error);
+    if (pixels != NULL && pngFits(qoiHeader.width, qoiHeader.height, 4, &item->error)) {
+      int length;
+      item->output = stbi_write_png_to_mem(pixels, qoiHeader.width * 4, qoiHeader.width, qoiHeader.height, 4, &length);
+      item->outputSize = length;
+      if (item->output == NULL) {
+        qoiFail(&item->error, QOI_ERROR_NO_MEMORY, "Not enough memory for the png");
+      }
+    }
+    free(pixels);
+  }
+  item->failed = item->output == NULL;
+  if (!item->failed && batch->cache != NULL) {
+    cacheStore(batch->cache, cachePath, item->output, item->outputSize);
+  }
+}
+
+// Pool job of the blocking backend: read, convert and write one file.
+void batchBlockingJob(void* argument) {
+  struct batch_item* item = argument;
+  item->input = readFile(item->inPath, &item->inputSize, &item->error);
+  if (item->input == NULL) {
+    item->failed = 1;
+    return;
+  }
+  batchConvert(item);
+  free(item->input);
+  item->input = NULL;
+  if (item->failed) {
+    return;
+  }
+  FILE* file = fopen(item->outPath, "wb");
+  if (file == NULL || fwrite(item->output, 1, item->outputSize, file) != item->outputSize) {
+    item->failed = !qoiFail(&item->error, QOI_ERROR_IO, "Could not write %s", item->outPath);
+  }
+  if (file != NULL) {
+    fclose(file);
+  }
+  free(item->output);
+  item->output = NULL;
+}
+
+// Items that already failed (no output path) are skipped.
+void batchBlocking(struct batch* batch) {
+  for (size_t i = 0; i < batch->count; i++) {
+    if (!batch->items[i].failed) {
+      poolSubmit(batch->pool, batchBlockingJob, &batch->items[i]);
+    }
+  }
+  poolWait(batch->pool);
+}
+
+#ifdef __linux__
+// Minimal io_uring on raw syscalls (no liburing). Only the main thread touches the ring.
+struct uring {
+  int fd;
+  unsigned entries;
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned* sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  unsigned localTail; // Tail including queued but not yet published entries
+  unsigned queued; // Entries not yet submitted to the kernel
+};
+
+void uringFree(struct uring* ring) {
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+  }
+  if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED) {
+    munmap(ring->cqRing, ring->cqRingSize);
+  }
+  if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+    munmap(ring->sqRing, ring->sqRingSize);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+}
+
+// Returns 1 on success, 0 if io_uring is not available.
+int uringInit(struct uring* ring, unsigned entries) {
+  memset(ring, 0, sizeof(struct uring));
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    return 0;
+  }
+  ring->entries = params.sq_entries;
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    uringFree(ring);
+    return 0;
+  }
+  uint8_t* sq = ring->sqRing;
+  uint8_t* cq = ring->cqRing;
+  ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+  ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  ring->localTail = *ring->sqTail;
+  return 1;
+}
+
+// Returns a zeroed submission entry, or NULL if the submission queue is full.
+struct io_uring_sqe* uringSqe(struct uring* ring) {
+  if (ring->localTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->entries) {
+    return NULL;
+  }
+  unsigned index = ring->localTail & ring->sqMask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sqArray[index] = index;
+  ring->localTail++;
+  ring->queued++;
+  return sqe;
+}
+
+// Submits the queued entries and waits until at least waitCount completions are available.
+int uringSubmit(struct uring* ring, unsigned waitCount) {
+  __atomic_store_n(ring->sqTail, ring->localTail, __ATOMIC_RELEASE);
+  long result;
+  do {
+    result = syscall(__NR_io_uring_enter, ring->fd, ring->queued, waitCount, waitCount > 0 ? IORING_ENTER_GETEVENTS : 0,
+                     NULL, 0);
+  } while (result < 0 && errno == EINTR);
+  if (result < 0) {
+    return 0;
+  }
+  ring->queued -= result;
+  return 1;
+}
+
+// Operations of an item, stored in the low bits of user_data
+enum batch_op { OP_OPEN_IN, OP_READ, OP_CLOSE_IN, OP_OPEN_OUT, OP_WRITE, OP_CLOSE_OUT, OP_EVENT };
+
+// Read slots: each file is first read into one of these, registered with the ring when
+// the memlock limit allows.
+const size_t batchSlotSize = 256 * 1024;
+
+struct batch_uring {
+  struct uring ring;
+  struct batch* batch;
+  uint8_t* slotMemory;
+  int* freeSlots;
+  int freeSlotCount;
+  int registered;
+  uint64_t eventValue;
+  size_t finished; // Items done, written or failed
+  size_t active; // Items between open and finished
+  int broken; // The ring failed, batchUringAbandon finishes the items
+};
+
+void batchQueue(struct batch_uring* io, size_t index, enum batch_op op) {
+  struct io_uring_sqe* sqe = uringSqe(&io->ring);
+  // The ring has two entries per active item plus one for the event, so it only fills up
+  // when a submit failed. Flush it once more, otherwise give up on the ring.
+  if (sqe == NULL && uringSubmit(&io->ring, 0)) {
+    sqe = uringSqe(&io->ring);
+  }
+  if (sqe == NULL) {
+    io->broken = 1;
+    return;
+  }
+  struct batch_item* item = index < io->batch->count ? &io->batch->items[index] : NULL;
+  sqe->user_data = (uint64_t)index << 3 | op;
+  switch (op) {
+    case OP_OPEN_IN:
+    case OP_OPEN_OUT:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)(op == OP_OPEN_IN ? item->inPath : item->outPath);
+      sqe->open_flags = op == OP_OPEN_IN ? O_RDONLY | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+      sqe->len = 0644;
+      break;
+    case OP_READ:
+      sqe->opcode = item->slot >= 0 && io->registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      sqe->buf_index = item->slot >= 0 && io->registered ? item->slot : 0;
+      sqe->fd = item->fd;
+      sqe->addr = (uintptr_t)(item->input + item->inputSize);
+      sqe->len = item->inputCapacity - item->inputSize;
+      sqe->off = item->inputSize;
+      break;
+    case OP_WRITE:
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->fd = item->fd;
+      sqe->addr = (uintptr_t)(item->output + item->written);
+      sqe->len = item->outputSize - item->written;
+      sqe->off = item->written;
+      break;
+    case OP_CLOSE_IN:
+    case OP_CLOSE_OUT:
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = item->fd;
+      break;
+    case OP_EVENT:
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = io->batch->eventFd;
+      sqe->addr = (uintptr_t)&io->eventValue;
+      sqe->len = sizeof(io->eventValue);
+      break;
+  }
+}
+
+void batchReleaseInput(struct batch_uring* io, struct batch_item* item) {
+  if (item->slot >= 0) {
+    io->freeSlots[io->freeSlotCount++] = item->slot;
+    item->slot = -1;
+  } else {
+    free(item->input);
+  }
+  item->input = NULL;
+}
+
+void batchFinish(struct batch_uring* io, struct batch_item* item) {
+  free(item->output);
+  item->output = NULL;
+  item->finished = 1;
+  io->finished++;
+  io->active--;
+}
+
+// Pool job of the io_uring backend: convert, then hand the item back to the I/O loop.
+void batchUringJob(void* argument) {
+  struct batch_item* item = argument;
+  struct batch* batch = item->batch;
+  batchConvert(item);
+  pthread_mutex_lock(&batch->mutex);
+  item->nextDone = batch->done;
+  batch->done = item;
+  pthread_mutex_unlock(&batch->mutex);
+  // Adding 1 to the eventfd counter cannot overflow it, only a signal can interrupt the write
+  uint64_t one = 1;
+  while (write(batch->eventFd, &one, sizeof(one)) < 0 && errno == EINTR) {
+  }
+}
+
+void batchComplete(struct batch_uring* io, uint64_t userData, int result) {
+  size_t index = userData >> 3;
+  enum batch_op op = userData & 7;
+  if (op == OP_EVENT) {
+    batchQueue(io, io->batch->count, OP_EVENT);
+    return;
+  }
+  struct batch_item* item = &io->batch->items[index];
+  switch (op) {
+    case OP_OPEN_IN:
+      if (result < 0) {
+        item->failed = !qoiFail(&item->error, QOI_ERROR_IO, "File %s not found", item->inPath);
+        batchReleaseInput(io, item);
+        batchFinish(io, item);
+      } else {
+        item->fd = result;
+        batchQueue(io, index, OP_READ);
+      }
+      break;
+    case OP_READ:
+      if (result < 0) {
+        item->failed = !qoiFail(&item->error, QOI_ERROR_IO, "Could not read file %s", item->inPath);
+        batchReleaseInput(io, item);
+        batchQueue(io, index, OP_CLOSE_IN);
+        batchFinish(io, item);
+        break;
+      }
+      item->inputSize += result;
+      if (result > 0 && item->inputSize == item->inputCapacity) {
+        // Larger than the buffer, move to a malloc'd buffer of the file size (+1 to see the end)
+        struct stat fileStat;
+        size_t capacity = item->inputCapacity * 2;
+        if (fstat(item->fd, &fileStat) == 0 && (size_t)fileStat.st_size + 1 > capacity) {
+          capacity = fileStat.st_size + 1;
+        }
+        uint8_t* input = malloc(capacity);
+        if (input == NULL) {
+          item->failed = !qoiFail(&item->error, QOI_ERROR_NO_MEMORY, "Not enough memory for the file");
+          batchReleaseInput(io, item);
+          batchQueue(io, index, OP_CLOSE_IN);
+          batchFinish(io, item);
+          break;
+        }
+        memcpy(input, item->input, item->inputSize);
+        batchReleaseInput(io, item);
+        item->input = input;
+        item->inputCapacity = capacity;
+        batchQueue(io, index, OP_READ);
+        break;
+      }
+      // A short read is the end of a regular file
+      batchQueue(io, index, OP_CLOSE_IN);
+      poolSubmit(io->batch->pool, batchUringJob, item);
+      break;
+    case OP_OPEN_OUT:
+      if (result < 0) {
+        item->failed = !qoiFail(&item->error, QOI_ERROR_IO, "Could not write %s", item->outPath);
+        batchFinish(io, item);
+      } else {
+        item->fd = result;
+        batchQueue(io, index, OP_WRITE);
+      }
+      break;
+    case OP_WRITE:
+      if (result <= 0) {
+        item->failed = !qoiFail(&item->error, QOI_ERROR_IO, "Could not write %s", item->outPath);
+        batchQueue(io, index, OP_CLOSE_OUT);
+        break;
+      }
+      item->written += result;
+      batchQueue(io, index, item->written < item->outputSize ? OP_WRITE : OP_CLOSE_OUT);
+      break;
+    case OP_CLOSE_OUT:
+      batchFinish(io, item);
+      break;
+    default:
+      break;
+  }
+}
+
+// Converted items from the pool: release the input and start writing the output.
+void batchCollect(struct batch_uring* io) {
+  struct batch* batch = io->batch;
+  pthread_mutex_lock(&batch->mutex);
+  struct batch_item* item = batch->done;
+  batch->done = NULL;
+  pthread_mutex_unlock(&batch->mutex);
+  while (item != NULL) {
+    struct batch_item* next = item->nextDone;
+    batchReleaseInput(io, item);
+    if (item->failed) {
+      batchFinish(io, item);
+    } else {
+      batchQueue(io, item - batch->items, OP_OPEN_OUT);
+    }
+    item = next;
+  }
+}
+
+// After the ring failed: items it had started fail, the ones it had not started are converted
+// by the blocking backend. Requests may still be in flight in the kernel, so the buffers of
+// started items are only freed if their conversion had finished (no I/O pending for them), and
+// removing their outputs is best effort (an open in flight can still create an empty file).
+void batchUringAbandon(struct batch_uring* io, size_t next) {
+  struct batch* batch = io->batch;
+  for (struct batch_item* item = batch->done; item != NULL; item = item->nextDone) {
+    if (item->slot < 0) {
+      free(item->input);
+    }
+    item->input = NULL;
+    free(item->output);
+    item->output = NULL;
+  }
+  batch->done = NULL;
+  for (size_t i = 0; i < next; i++) {
+    struct batch_item* item = &batch->items[i];
+    if (!item->finished && !item->failed) {
+      item->failed = !qoiFail(&item->error, QOI_ERROR_IO, "io_uring failed before %s was written", item->outPath);
+    }
+  }
+  for (size_t i = next; i < batch->count; i++) {
+    if (!batch->items[i].failed) {
+      poolSubmit(batch->pool, batchBlockingJob, &batch->items[i]);
+    }
+  }
+  poolWait(batch->pool);
+}
+
+// Returns 0 if io_uring is not available (nothing has been converted then).
+int batchUring(struct batch* batch) {
+  struct batch_uring io;
+  memset(&io, 0, sizeof(io));
+  io.batch = batch;
+  int slotCount = batch->pool->threadCount * 2;
+  slotCount = slotCount < 4 ? 4 : slotCount > 16 ? 16 : slotCount;
+  size_t maxActive = slotCount * 2;
+  unsigned entries = 1;
+  while (entries < maxActive * 2 + 1) {
+    entries *= 2;
+  }
+  batch->eventFd = eventfd(0, EFD_CLOEXEC);
+  if (batch->eventFd < 0 || !uringInit(&io.ring, entries)) {
+    if (batch->eventFd >= 0) {
+      close(batch->eventFd);
+    }
+    return 0;
+  }
+  io.slotMemory = malloc(slotCount * batchSlotSize);
+  io.freeSlots = malloc(slotCount * sizeof(int));
+  struct iovec* slots = malloc(slotCount * sizeof(struct iovec));
+  if (io.slotMemory == NULL || io.freeSlots == NULL || slots == NULL) {
+    free(io.slotMemory);
+    free(io.freeSlots);
+    free(slots);
+    uringFree(&io.ring);
+    close(batch->eventFd);
+    return 0;
+  }
+  for (int i = 0; i < slotCount; i++) {
+    io.freeSlots[io.freeSlotCount++] = slotCount - 1 - i;
+    slots[i].iov_base = io.slotMemory + i * batchSlotSize;
+    slots[i].iov_len = batchSlotSize;
+  }
+  // Registered buffers are pinned once instead of on every read. Plain reads if over the memlock limit.
+  io.registered = syscall(__NR_io_uring_register, io.ring.fd, IORING_REGISTER_BUFFERS, slots, slotCount) == 0;
+  free(slots);
+
+  batchQueue(&io, batch->count, OP_EVENT);
+  size_t next = 0;
+  while (io.finished < batch->count && !io.broken) {
+    // Start reading upcoming inputs while there are free slots
+    while (next < batch->count && io.active < maxActive && io.freeSlotCount > 0) {
+      struct batch_item* item = &batch->items[next];
+      if (item->failed) {
+        // No output path
+        io.finished++;
+        next++;
+        continue;
+      }
+      item->slot = io.freeSlots[--io.freeSlotCount];
+      item->input = io.slotMemory + item->slot * batchSlotSize;
+      item->inputCapacity = batchSlotSize;
+      io.active++;
+      batchQueue(&io, next++, OP_OPEN_IN);
+    }
+    batchCollect(&io);
+    if (io.finished == batch->count || io.broken || !uringSubmit(&io.ring, 1)) {
+      io.broken |= io.finished < batch->count;
+      break;
+    }
+    unsigned head = *io.ring.cqHead;
+    unsigned tail = __atomic_load_n(io.ring.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe* cqe = &io.ring.cqes[head & io.ring.cqMask];
+      batchComplete(&io, cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(io.ring.cqHead, head, __ATOMIC_RELEASE);
+  }
+
+  // The last job may still be signalling. Closing the ring cancels the pending eventfd read.
+  poolWait(batch->pool);
+  uringFree(&io.ring);
+  close(batch->eventFd);
+  if (io.broken) {
+    // Reads into the slots may still be in flight
+    batchUringAbandon(&io, next);
+  } else {
+    free(io.slotMemory);
+  }
+  free(io.freeSlots);
+  return 1;
+}
+#endif
+
+// Converts files to outdir with the requested backend, ioBackend is set to the one used. errors
+// (count entries, may be NULL) receives why each file failed. Returns the number of failed files.
+size_t batchConvertFiles(int mode, const char* const* paths, size_t count, const char* outdir,
+                         const struct qoi_encode_options* options, int* ioBackend, struct conversion_cache* cache,
+                         struct qoi_error* errors) {
+  const char* extension = mode == BATCH_DECODE ? ".png" : options->compress ? ".qoiz" : options->tileSize > 0 ? ".qoit" : ".qoi";
+  struct batch batch;
+  memset(&batch, 0, sizeof(batch));
+  batch.mode = mode;
+  batch.options = *options;
+  // Tiles of one file are coded on the file's worker, files are the unit of parallelism
+  batch.options.threads = 1;
+  batch.count = count;
+  batch.eventFd = -1;
+  batch.cache = cache;
+  batch.items = calloc(count > 0 ? count : 1, sizeof(struct batch_item));
+  batch.pool = poolCreate(options->threads);
+  if (batch.items == NULL || batch.pool == NULL) {
+    for (size_t i = 0; errors != NULL && i < count; i++) {
+      qoiFail(&errors[i], QOI_ERROR_NO_MEMORY, "Not enough memory for the file list");
+    }
+    free(batch.items);
+    poolDestroy(batch.pool);
+    return count;
+  }
+  pthread_mutex_init(&batch.mutex, NULL);
+  for (size_t i = 0; i < count; i++) {
+    batch.items[i] = (struct batch_item){&batch, paths[i], batchOutputPath(outdir, paths[i], extension)};
+    batch.items[i].slot = -1;
+    batch.items[i].fd = -1;
+    if (batch.items[i].outPath == NULL) {
+      batch.items[i].failed = !qoiFail(&batch.items[i].error, QOI_ERROR_NO_MEMORY, "Not enough memory for the path");
+    }
+  }
+
+  int done = 0;
+#ifdef __linux__
+  if (*ioBackend != BATCH_IO_BLOCKING) {
+    done = batchUring(&batch);
+  }
+#endif
+  if (!done) {
+    batchBlocking(&batch);
+  }
+  *ioBackend = done ? BATCH_IO_URING : BATCH_IO_BLOCKING;
+
+  size_t failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    failed += batch.items[i].failed;
+    if (errors != NULL) {
+      errors[i] = batch.items[i].error;
+    }
+    free(batch.items[i].outPath);
+  }
+  pthread_mutex_destroy(&batch.mutex);
+  poolDestroy(batch.pool);
+  free(batch.items);
+  return failed;
+}
+
+#ifdef __linux__
+// Local encode/decode service (the serve and client commands). Requests arrive on a Unix domain
+// socket and are served by a warm thread pool, one job per request: the accept loop waits on
+// all connections with epoll and hands a connection to the pool only when a request arrives, so
+// idle connections hold no worker. A connection can carry any number of requests. Each request is a struct qoi_service_request followed by its payload,
+// either inline or in a memfd attached with SCM_RIGHTS. In that case nothing follows the header,
+// and the response payload also comes back in a memfd. Fields are in host byte order.
+//   encode: payload is raw pixels (width, height, format, stride), response payload is the file
+//           (qoi, qoiz or qoit depending on the options)
+//   decode: payload is a qoi or qoiz file, response payload is width * height pixels in format
+#define SERVICE_MAGIC 0x716f6973 // "qois"
+
+// Largest inline payload the service accepts, larger ones have to be sent as a memfd
+const uint64_t serviceMaxInline = (uint64_t)1 << 30;
+
+// Seconds a request may stall in the middle of being received or answered before its
+// connection is closed, so a stuck client cannot hold a worker
+const int serviceStallSeconds = 10;
+
+enum service_command { SERVICE_ENCODE = 1, SERVICE_DECODE = 2, SERVICE_STOP = 3 };
+
+enum service_status { SERVICE_OK = 0, SERVICE_BAD_REQUEST = 1, SERVICE_FAILED = 2 };
+
+struct qoi_service_request {
+  uint32_t magic;
+  uint32_t command;
+  uint32_t width; // Encode only
+  uint32_t height; // Encode only
+  uint32_t format; // Encode: format of the pixels, decode: wanted output format
+  uint32_t stride; // Encode only, 0 = packed
+  int32_t effort;
+  int32_t maxError;
+  int32_t compress;
+  uint32_t tileSize;
+  uint64_t payloadSize; // Ignored when a memfd is attached
+};
+
+struct qoi_service_response {
+  uint32_t status; // See enum service_status
+  uint32_t width;
+  uint32_t height;
+  uint32_t channels; // Decode: channels of the file header. SERVICE_FAILED: the enum qoi_status
+  uint64_t payloadSize;
+};
+
+int sendAll(int socket, const void* data, size_t size) {
+  const uint8_t* bytes = data;
+  while (size > 0) {
+    ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return 0;
+    }
+    bytes += sent;
+    size -= sent;
+  }
+  return 1;
+}
+
+int recvAll(int socket, void* data, size_t size) {
+  uint8_t* bytes = data;
+  while (size > 0) {
+    ssize_t received = recv(socket, bytes, size, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return 0;
+    }
+    bytes += received;
+    size -= received;
+  }
+  return 1;
+}
+
+// Sends a request or response header, with fd attached when fd >= 0.
+int sendHeader(int socket, const void* header, size_t size, int fd) {
+  struct iovec iov = {(void*)header, size};
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(&control, 0, sizeof(control));
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  ssize_t sent;
+  do {
+    sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent <= 0) {
+    return 0;
+  }
+  return sendAll(socket, (const uint8_t*)header + sent, size - sent);
+}
+
+// Receives a header. *fd is the attached file descriptor or -1. Returns 0 on end of stream or error.
+int recvHeader(int socket, void* header, size_t size, int* fd) {
+  struct iovec iov = {header, size};
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+  *fd = -1;
+  ssize_t received;
+  do {
+    received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  if (received <= 0) {
+    return 0;
+  }
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  if (!recvAll(socket, (uint8_t*)header + received, size - received)) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+    return 0;
+  }
+  return 1;
+}
+
+// Seals a memfd needs before mapFd maps it: the content can no longer shrink or change, so
+// the other side of the socket cannot make the mapping fault (SIGBUS) while it is read
+#define QOI_MEMFD_SEALS (F_SEAL_SHRINK | F_SEAL_WRITE)
+
+// Creates a sealed memfd holding size bytes. Returns -1 on failure.
+int memfdFrom(const uint8_t* bytes, size_t size) {
+  int fd = syscall(SYS_memfd_create, "qoi", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return -1;
+  }
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      close(fd);
+      return -1;
+    }
+    bytes += written;
+    size -= written;
+  }
+  if (fcntl(fd, F_ADD_SEALS, QOI_MEMFD_SEALS | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Maps the whole content of a memfd sealed by memfdFrom read only. Returns NULL on failure or
+// if fd lacks the seals, an empty file maps to a dummy non-NULL pointer with size 0.
+uint8_t* mapFd(int fd, size_t* size) {
+  struct stat fileStat;
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0 || (seals & QOI_MEMFD_SEALS) != QOI_MEMFD_SEALS || fstat(fd, &fileStat) != 0) {
+    return NULL;
+  }
+  *size = fileStat.st_size;
+  if (*size == 0) {
+    return (uint8_t*)"";
+  }
+  uint8_t* bytes = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  return bytes != MAP_FAILED ? bytes : NULL;
+}
+
+void unmapFd(uint8_t* bytes, size_t size) {
+  if (size > 0) {
+    munmap(bytes, size);
+  }
+}
+
+struct service_connection;
+
+struct qoi_service {
+  int listenSocket;
+  volatile int stop;
+  struct qoi_limits limits; // Of decode requests
+  int epoll;
+  struct thread_pool* pool;
+  // Open connections, closed at shutdown if they are idle
+  pthread_mutex_t mutex;
+  struct service_connection* connections;
+};
+
+struct service_connection {
+  struct qoi_service* service;
+  int socket;
+  struct service_connection* prev;
+  struct service_connection* next;
+};
+
+void serviceCloseConnection(struct service_connection* connection) {
+  struct qoi_service* service = connection->service;
+  epoll_ctl(service->epoll, EPOLL_CTL_DEL, connection->socket, NULL);
+  pthread_mutex_lock(&service->mutex);
+  if (connection->prev != NULL) {
+    connection->prev->next = connection->next;
+  } else {
+    service->connections = connection->next;
+  }
+  if (connection->next != NULL) {
+    connection->next->prev = connection->prev;
+  }
+  pthread_mutex_unlock(&service->mutex);
+  close(connection->socket);
+  free(connection);
+}
+
+// Runs one request. Returns the malloc'd response payload, NULL with response->status set on failure.
+uint8_t* serviceHandle(const struct qoi_service_request* request, const uint8_t* payload, size_t payloadSize,
+                       const struct qoi_limits* limits, struct qoi_service_response* response) {
+  memset(response, 0, sizeof(struct qoi_service_response));
+  struct qoi_error error = {QOI_OK};
+  int validFormat = (request->format & ~QOI_FORMAT_PREMULTIPLIED) <= QOI_FORMAT_GRAY;
+  uint8_t* result = NULL;
+  size_t resultSize = 0;
+  if (request->command == SERVICE_ENCODE && validFormat) {
+    struct qoi_source source = {payload, request->width, request->height, request->stride, request->format};
+    size_t stride = source.stride > 0 ? source.stride : (size_t)source.width * formatSize(source.format);
+    size_t needed = source.height > 0 ? (size_t)(source.height - 1) * stride + (size_t)source.width * formatSize(source.format) : 0;
+    if (source.width == 0 || source.height == 0 || payloadSize < needed) {
+      response->status = SERVICE_BAD_REQUEST;
+      return NULL;
+    }
+    struct qoi_encode_options options = {request->effort, request->maxError, request->compress, request->tileSize, 1};
+    result = encodeToMemory(&source, &options, &resultSize, &error);
+    response->width = source.width;
+    response->height = source.height;
+  } else if (request->command == SERVICE_DECODE && validFormat) {
+    struct qoi_header qoiHeader;
+    result = decodeBytes(payload, payloadSize, &qoiHeader, request->format, limits, &error);
+    if (result != NULL) {
+      response->width = qoiHeader.width;
+      response->height = qoiHeader.height;
+      response->channels = qoiHeader.channels;
+      resultSize = (size_t)qoiHeader.width * qoiHeader.height * formatSize(request->format);
+    }
+  } else {
+    response->status = SERVICE_BAD_REQUEST;
+    return NULL;
+  }
+  response->status = result != NULL ? SERVICE_OK : SERVICE_FAILED;
+  if (result == NULL) {
+    response->channels = error.status;
+  }
+  response->payloadSize = resultSize;
+  return result;
+}
+
+// Serves one request of a connection. Returns 0 if the connection has to be closed.
+int serviceRequest(struct service_connection* connection) {
+  int socket = connection->socket;
+  struct qoi_service_request request;
+  int fd;
+  if (!recvHeader(socket, &request, sizeof(request), &fd)) {
+    return 0;
+  }
+  struct qoi_service_response response;
+  memset(&response, 0, sizeof(response));
+  if (request.magic != SERVICE_MAGIC) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 0;
+  }
+  if (request.command == SERVICE_STOP) {
+    connection->service->stop = 1;
+    // Wakes up the accept loop
+    shutdown(connection->service->listenSocket, SHUT_RDWR);
+    sendHeader(socket, &response, sizeof(response), -1);
+    return 0;
+  }
+
+  // The payload is either mapped from the client's memfd or read inline
+  uint8_t* payload;
+  size_t payloadSize = 0;
+  if (fd >= 0) {
+    payload = mapFd(fd, &payloadSize);
+  } else {
+    payloadSize = request.payloadSize;
+    payload = payloadSize <= serviceMaxInline ? malloc(payloadSize > 0 ? payloadSize : 1) : NULL;
+    if (payload == NULL || !recvAll(socket, payload, payloadSize)) {
+      // The rest of the stream cannot be parsed any more
+      free(payload);
+      return 0;
+    }
+  }
+  uint8_t* result = NULL;
+  if (payload == NULL) {
+    response.status = SERVICE_BAD_REQUEST;
+  } else {
+    result = serviceHandle(&request, payload, payloadSize, &connection->service->limits, &response);
+  }
+  if (fd >= 0) {
+    if (payload != NULL) {
+      unmapFd(payload, payloadSize);
+    }
+    close(fd);
+  } else {
+    free(payload);
+  }
+
+  int sent;
+  if (fd >= 0 && result != NULL) {
+    int resultFd = memfdFrom(result, response.payloadSize);
+    if (resultFd < 0) {
+      response.status = SERVICE_FAILED;
+      response.payloadSize = 0;
+    }
+    sent = sendHeader(socket, &response, sizeof(response), resultFd);
+    if (resultFd >= 0) {
+      close(resultFd);
+    }
+  } else {
+    sent = sendHeader(socket, &response, sizeof(response), -1) &&
+           (fd >= 0 || result == NULL || sendAll(socket, result, response.payloadSize));
+  }
+  free(result);
+  return sent;
+}
+
+// Pool job: serves the request waiting on a connection, then waits for the next one with epoll.
+void serviceRequestJob(void* argument) {
+  struct service_connection* connection = argument;
+  struct epoll_event event = {EPOLLIN | EPOLLONESHOT, {.ptr = connection}};
+  if (!serviceRequest(connection) || connection->service->stop ||
+      epoll_ctl(connection->service->epoll, EPOLL_CTL_MOD, connection->socket, &event) != 0) {
+    serviceCloseConnection(connection);
+  }
+}
+
+// Serves requests on the Unix domain socket path until a stop request. Decode requests are
+// held to the limits. Returns 0 on success.
+int serve(const char* path, int threads, const struct qoi_limits* limits) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Socket path is too long\n");
+    return 1;
+  }
+  strcpy(address.sun_path, path);
+  struct qoi_service service = {socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), 0, *limits, -1, NULL};
+  unlink(path);
+  if (service.listenSocket < 0 || bind(service.listenSocket, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(service.listenSocket, 64) != 0) {
+    printf("Could not listen on %s\n", path);
+    if (service.listenSocket >= 0) {
+      close(service.listenSocket);
+    }
+    return 1;
+  }
+  service.epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event listenEvent = {EPOLLIN, {.ptr = NULL}};
+  service.pool = service.epoll >= 0 ? poolCreate(threads) : NULL;
+  if (service.pool == NULL || epoll_ctl(service.epoll, EPOLL_CTL_ADD, service.listenSocket, &listenEvent) != 0) {
+    printf("Could not create the thread pool\n");
+    poolDestroy(service.pool);
+    if (service.epoll >= 0) {
+      close(service.epoll);
+    }
+    close(service.listenSocket);
+    return 1;
+  }
+  pthread_mutex_init(&service.mutex, NULL);
+  printf("Listening on %s with %d threads\n", path, service.pool->threadCount);
+  fflush(stdout);
+  const struct timeval stall = {serviceStallSeconds, 0};
+  struct epoll_event events[64];
+  while (!service.stop) {
+    int count = epoll_wait(service.epoll, events, 64, -1);
+    if (count < 0 && errno != EINTR) {
+      break;
+    }
+    for (int i = 0; i < count && !service.stop; i++) {
+      struct service_connection* connection = events[i].data.ptr;
+      if (connection != NULL) {
+        // A request (or the end of the connection) is waiting, the connection is disarmed until its job is done
+        poolSubmit(service.pool, serviceRequestJob, connection);
+        continue;
+      }
+      int socket = accept(service.listenSocket, NULL, NULL);
+      connection = socket >= 0 ? malloc(sizeof(struct service_connection)) : NULL;
+      if (connection == NULL) {
+        if (socket >= 0) {
+          close(socket);
+        }
+        continue;
+      }
+      setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+      setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+      *connection = (struct service_connection){&service, socket, NULL, NULL};
+      pthread_mutex_lock(&service.mutex);
+      connection->next = service.connections;
+      if (connection->next != NULL) {
+        connection->next->prev = connection;
+      }
+      service.connections = connection;
+      pthread_mutex_unlock(&service.mutex);
+      struct epoll_event event = {EPOLLIN | EPOLLONESHOT, {.ptr = connection}};
+      if (epoll_ctl(service.epoll, EPOLL_CTL_ADD, socket, &event) != 0) {
+        serviceCloseConnection(connection);
+      }
+    }
+  }
+  // Requests in progress are finished first, idle connections are closed
+  poolDestroy(service.pool);
+  while (service.connections != NULL) {
+    serviceCloseConnection(service.connections);
+  }
+  pthread_mutex_destroy(&service.mutex);
+  close(service.epoll);
+  close(service.listenSocket);
+  unlink(path);
+  return 0;
+}
+
+// Client side
+
+// Connects to the service. Returns the socket or -1.
+int serviceConnect(const char* path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  int client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (client >= 0 && connect(client, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    close(client);
+    return -1;
+  }
+  return client;
+}
+
+// Sends one request and waits for the response. With useMemfd the payload is passed in a memfd
+// and the response payload is mapped from the returned memfd, otherwise both go through the
+// socket. Returns the response payload (release with serviceFreePayload) or NULL if the request
+// failed, see response->status.
+uint8_t* serviceCall(int socket, struct qoi_service_request* request, const uint8_t* payload, size_t payloadSize,
+                     int useMemfd, struct qoi_service_response* response) {
+  memset(response, 0, sizeof(struct qoi_service_response));
+  response->status = SERVICE_FAILED;
+  request->magic = SERVICE_MAGIC;
+  request->payloadSize = payloadSize;
+  int fd = useMemfd ? memfdFrom(payload, payloadSize) : -1;
+  if (useMemfd && fd < 0) {
+    return NULL;
+  }
+  int sent = sendHeader(socket, request, sizeof(struct qoi_service_request), fd) &&
+             (useMemfd || sendAll(socket, payload, payloadSize));
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (!sent || !recvHeader(socket, response, sizeof(struct qoi_service_response), &fd)) {
+    response->status = SERVICE_FAILED;
+    return NULL;
+  }
+  if (response->status != SERVICE_OK) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  uint8_t* result;
+  if (fd >= 0) {
+    size_t size;
+    result = mapFd(fd, &size);
+    close(fd);
+    if (result != NULL && size != response->payloadSize) {
+      unmapFd(result, size);
+      result = NULL;
+    }
+  } else {
+    result = malloc(response->payloadSize > 0 ? response->payloadSize : 1);
+    if (result != NULL && !recvAll(socket, result, response->payloadSize)) {
+      free(result);
+      result = NULL;
+    }
+  }
+  if (result == NULL) {
+    response->status = SERVICE_FAILED;
+  }
+  return result;
+}
+
+void serviceFreePayload(uint8_t* payload, const struct qoi_service_response* response, int useMemfd) {
+  if (useMemfd) {
+    unmapFd(payload, response->payloadSize);
+  } else {
+    free(payload);
+  }
+}
+
+// Drop-in for encodeWithOptions through the service. Returns 0 on success.
+int clientEncode(const char* path, const char* infile, const char* outfile, const struct qoi_encode_options* options,
+                 int useMemfd) {
+  int width;
+  int height;
+  int channels;
+  if (!stbi_info(infile, &width, &height, &channels)) {
+    printf("Cannot read image info from infile %s.\n", infile);
+    return 1;
+  }
+  channels = channels == 3 ? 3 : 4;
+  uint8_t* pixels = stbi_load(infile, &width, &height, NULL, channels);
+  if (pixels == NULL) {
+    printf("Couldn't load image file.\n");
+    return 1;
+  }
+  int socket = serviceConnect(path);
+  if (socket < 0) {
+    printf("Could not connect to %s\n", path);
+    free(pixels);
+    return 1;
+  }
+  struct qoi_service_request request = {SERVICE_MAGIC, SERVICE_ENCODE, width, height,
+                                        channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB, 0,
+                                        options->effort, options->maxError, options->compress, options->tileSize, 0};
+  struct qoi_service_response response;
+  uint8_t* bytes = serviceCall(socket, &request, pixels, (size_t)width * height * channels, useMemfd, &response);
+  close(socket);
+  free(pixels);
+  if (bytes == NULL) {
+    printf("Service failed to encode %s (status %u, %s)\n", infile, response.status,
+           response.channels < QOI_STATUS_COUNT ? qoiStatusNames[response.channels] : "?");
+    return 1;
+  }
+  FILE* file = fopen(outfile, "wb");
+  int failed = file == NULL || fwrite(bytes, 1, response.payloadSize, file) != response.payloadSize;
+  if (file != NULL) {
+    fclose(file);
+  }
+  if (failed) {
+    printf("Could not write %s\n", outfile);
+  }
+  serviceFreePayload(bytes, &response, useMemfd);
+  return failed;
+}
+
+// Drop-in for decodeWithOptions (qoi and qoiz) through the service. Returns 0 on success.
+int clientDecode(const char* path, const char* infile, const char* outfile, int format, int useMemfd) {
+  size_t size;
+  struct qoi_error error = {QOI_OK};
+  uint8_t* bytes = readFile(infile, &size, &error);
+  if (bytes == NULL) {
+    printf("%s\n", error.detail);
+    return 1;
+  }
+  int socket = serviceConnect(path);
+  if (socket < 0) {
+    printf("Could not connect to %s\n", path);
+    free(bytes);
+    return 1;
+  }
+  struct qoi_service_request request = {SERVICE_MAGIC, SERVICE_DECODE, 0, 0, format};
+  struct qoi_service_response response;
+  uint8_t* pixels = serviceCall(socket, &request, bytes, size, useMemfd, &response);
+  close(socket);
+  free(bytes);
+  if (pixels == NULL) {
+    printf("Service failed to decode %s (status %u, %s)\n", infile, response.status,
+           response.channels < QOI_STATUS_COUNT ? qoiStatusNames[response.channels] : "?");
+    return 1;
+  }
+  int channels = formatSize(format);
+  int failed = !pngFits(response.width, response.height, channels, &error) ||
+               !stbi_write_png(outfile, response.width, response.height, channels, pixels, response.width * channels);
+  if (failed) {
+    printf("%s\n", error.status != QOI_OK ? error.detail : "Could not write the png");
+  }
+  serviceFreePayload(pixels, &response, useMemfd);
+  return failed;
+}
+
+// Asks the service to stop. Returns 0 on success.
+int clientStop(const char* path) {
+  int socket = serviceConnect(path);
+  if (socket < 0) {
+    printf("Could not connect to %s\n", path);
+    return 1;
+  }
+  struct qoi_service_request request = {SERVICE_MAGIC, SERVICE_STOP};
+  struct qoi_service_response response;
+  int fd;
+  int stopped = sendHeader(socket, &request, sizeof(request), -1) && recvHeader(socket, &response, sizeof(response), &fd);
+  close(socket);
+  return stopped ? 0 : 1;
+}
+#endif
+
+#ifdef QOI_STATS
+void printEncodeStats(FILE* out, const char* name) {
+  const struct qoi_encode_stats* s = &qoiEncodeStats;
+  fprintf(out, "{\"image\": \"%s\", \"pixels\": %lu, \"bytes\": %lu, "
+      "\"index\": %lu, \"diff\": %lu, \"luma\": %lu, \"rgb\": %lu, \"rgba\": %lu, "
+      "\"run\": %lu, \"run_max\": %lu, \"index_lookups\": %lu, \"index_collisions\": %lu, "
+      "\"collision_rate\": %.4f}\n",
+      name, s->pixels, s->bytes, s->opIndex, s->opDiff, s->opLuma, s->opRgb, s->opRgba,
+      s->opRun, s->runMax, s->indexLookups, s->indexCollisions,
+      s->indexLookups ? (double)s->indexCollisions / s->indexLookups : 0.0);
+}
+#endif
+
+// Images used by the encode/decode benchmark in main()
+const char* benchmarkImages[] = {
+  "dice", "edgecase", "kodim10", "kodim23", "qoi_logo", "testcard_rgba", "testcard", "wikipedia_008"
+};
+const int benchmarkImageCount = sizeof(benchmarkImages) / sizeof(benchmarkImages[0]);
+
+// Reference codec: a direct transcription of the QOI specification (the algorithm of the
+// reference qoi.h) without any of the optimizations above. verify uses it as the oracle.
+// Like encodeOpsKernel it stores the implicit start pixel in the index when the image starts
+// with a run, as every spec decoder does (qoi.h's encoder misses that one index hit).
+uint8_t* referenceEncode(const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t channels, size_t* outSize) {
+  size_t pixelCount = (size_t)width * height;
+  uint8_t* bytes = malloc(headerSize + pixelCount * (channels + 1) + sizeof(QOI_END_CHUNK));
+  if (bytes == NULL) {
+    return NULL;
+  }
+  uint32_t widthBE = __builtin_bswap32(width);
+  uint32_t heightBE = __builtin_bswap32(height);
+  memcpy(bytes, "qoif", 4);
+  memcpy(bytes + 4, &widthBE, 4);
+  memcpy(bytes + 8, &heightBE, 4);
+  bytes[12] = channels;
+  bytes[13] = 0;
+  size_t p = headerSize;
+
+  struct rgba index[64];
+  memset(index, 0, sizeof(index));
+  struct rgba prev = {0, 0, 0, 255};
+  int run = 0;
+  for (size_t i = 0; i < pixelCount; i++) {
+    struct rgba px;
+    memcpy(&px, rgba + i * 4, 4);
+    if (channels == 3) {
+      px.a = 255;
+    }
+    if (memcmp(&px, &prev, 4) == 0) {
+      if (i == 0) {
+        index[getIndex(px)] = px;
+      }
+      run++;
+      if (run == 62 || i == pixelCount - 1) {
+        bytes[p++] = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      bytes[p++] = QOI_OP_RUN | (run - 1);
+      run = 0;
+    }
+    uint8_t hash = getIndex(px);
+    if (memcmp(&index[hash], &px, 4) == 0) {
+      bytes[p++] = QOI_OP_INDEX | hash;
+    } else {
+      index[hash] = px;
+      if (px.a == prev.a) {
+        int8_t vr = px.r - prev.r;
+        int8_t vg = px.g - prev.g;
+        int8_t vb = px.b - prev.b;
+        int8_t vgr = vr - vg;
+        int8_t vgb = vb - vg;
+        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+          bytes[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+        } else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+          bytes[p++] = QOI_OP_LUMA | (vg + 32);
+          bytes[p++] = (vgr + 8) << 4 | (vgb + 8);
+        } else {
+          bytes[p++] = QOI_OP_RGB;
+          bytes[p++] = px.r;
+          bytes[p++] = px.g;
+          bytes[p++] = px.b;
+        }
+      } else {
+        bytes[p++] = QOI_OP_RGBA;
+        bytes[p++] = px.r;
+        bytes[p++] = px.g;
+        bytes[p++] = px.b;
+        bytes[p++] = px.a;
+      }
+    }
+    prev = px;
+  }
+  uint64_t endChunkBE = __builtin_bswap64(QOI_END_CHUNK);
+  memcpy(bytes + p, &endChunkBE, 8);
+  *outSize = p + 8;
+  return bytes;
+}
+
+// Decodes to RGBA. Returns NULL if the header is invalid.
+uint8_t* referenceDecode(const uint8_t* bytes, size_t size, uint32_t* width, uint32_t* height) {
+  if (size < headerSize + sizeof(QOI_END_CHUNK) || memcmp(bytes, "qoif", 4) != 0) {
+    return NULL;
+  }
+  uint32_t values[2];
+  memcpy(values, bytes + 4, 8);
+  *width = __builtin_bswap32(values[0]);
+  *height = __builtin_bswap32(values[1]);
+  size_t pixelCount = (size_t)*width * *height;
+  uint8_t* out = malloc(pixelCount > 0 ? pixelCount * 4 : 1);
+  if (out == NULL) {
+    return NULL;
+  }
+  struct rgba index[64];
+  memset(index, 0, sizeof(index));
+  struct rgba px = {0, 0, 0, 255};
+  size_t p = headerSize;
+  size_t chunksEnd = size - sizeof(QOI_END_CHUNK);
+  int run = 0;
+  for (size_t i = 0; i < pixelCount; i++) {
+    if (run > 0) {
+      run--;
+    } else if (p < chunksEnd) {
+      uint8_t b1 = bytes[p++];
+      if (b1 == QOI_OP_RGB) {
+        px.r = bytes[p++];
+        px.g = bytes[p++];
+        px.b = bytes[p++];
+      } else if (b1 == QOI_OP_RGBA) {
+        px.r = bytes[p++];
+        px.g = bytes[p++];
+        px.b = bytes[p++];
+        px.a = bytes[p++];
+      } else if ((b1 & 0xc0) == QOI_OP_INDEX) {
+        px = index[b1];
+      } else if ((b1 & 0xc0) == QOI_OP_DIFF) {
+        px.r += ((b1 >> 4) & 3) - 2;
+        px.g += ((b1 >> 2) & 3) - 2;
+        px.b += (b1 & 3) - 2;
+      } else if ((b1 & 0xc0) == QOI_OP_LUMA) {
+        uint8_t b2 = bytes[p++];
+        int vg = (b1 & 0x3f) - 32;
+        px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+        px.g += vg;
+        px.b += vg - 8 + (b2 & 0x0f);
+      } else {
+        run = b1 & 0x3f;
+      }
+      index[getIndex(px)] = px;
+    }
+    memcpy(out + i * 4, &px, 4);
+  }
+  return out;
+}
+
+// Synthetic test images, RGBA. Patterns aim at particular ops and their edge cases.
+enum synthetic_pattern {
+  SYNTHETIC_FLAT, // One colour, opaque black (the implicit start pixel)
+  SYNTHETIC_GRADIENT, // Smooth, DIFF and LUMA
+  SYNTHETIC_NOISE, // Incompressible RGB
+  SYNTHETIC_UI, // Flat panels, borders, text-like specks
+  SYNTHETIC_ALPHA_RAMP, // Alpha changes along every row
+  SYNTHETIC_RGBA_EVERY_PIXEL, // Random alpha, every pixel an RGBA op
+  SYNTHETIC_MAX_RUN, // Runs of 1, 61, 62, 63, 124 and 125 pixels
+  SYNTHETIC_DELTAS, // Differences right at the DIFF/LUMA/RGB boundaries
+  SYNTHETIC_PALETTE, // 80 colours, index hits and hash collisions
+  SYNTHETIC_PATTERN_COUNT
+};
+
+const char* syntheticNames[SYNTHETIC_PATTERN_COUNT] = {
+  "flat", "gradient", "noise", "ui", "alpha-ramp", "rgba-every-pixel", "max-run", "deltas", "palette"
+};
+
+static inline uint32_t xorshift32(uint32_t* state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// A synthetic image being generated row by row
+struct synthetic_generator {
+  int pattern;
+  uint32_t width;
+  uint32_t height;
+  uint32_t y; // Next row
+  uint32_t random;
+  struct rgba palette[80];
+  struct rgba px;
+  uint32_t runLeft;
+  size_t runIndex;
+};
+
+void initSynthetic(struct synthetic_generator* generator, int pattern, uint32_t width, uint32_t height, uint32_t seed) {
+  memset(generator, 0, sizeof(struct synthetic_generator));
+  generator->pattern = pattern;
+  generator->width = width;
+  generator->height = height;
+  generator->random = seed * 2654435761u + 1;
+  for (int i = 0; i < 80; i++) {
+    uint32_t r = xorshift32(&generator->random);
+    generator->palette[i] = (struct rgba){r, r >> 8, r >> 16, i % 5 == 0 ? (r >> 24) : 255};
+  }
+  generator->px = (struct rgba){0, 0, 0, 255};
+}
+
+// Generates the next rows of the image as RGBA into pixels, so that images larger than memory
+// can be generated in bands.
+void generateRows(struct synthetic_generator* generator, uint8_t* pixels, uint32_t rows) {
+  const int8_t boundaries[] = {-33, -32, -31, -9, -8, -3, -2, -1, 0, 1, 2, 7, 8, 31, 32};
+  const uint32_t runLengths[] = {1, 61, 62, 63, 124, 125};
+  const int pattern = generator->pattern;
+  const uint32_t width = generator->width;
+  const uint32_t height = generator->height;
+  const struct rgba* palette = generator->palette;
+  uint32_t random = generator->random;
+  struct rgba px = generator->px;
+  uint32_t runLeft = generator->runLeft;
+  size_t runIndex = generator->runIndex;
+  const uint32_t fromY = generator->y;
+  for (uint32_t y = fromY; y < fromY + rows; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t r = xorshift32(&random);
+      switch (pattern) {
+        case SYNTHETIC_FLAT:
+          px = (struct rgba){0, 0, 0, 255};
+          break;
+        case SYNTHETIC_GRADIENT:
+          px = (struct rgba){(uint64_t)x * 255 / (width > 1 ? width - 1 : 1), (uint64_t)y * 255 / (height > 1 ? height - 1 : 1),
+                             (x + y) & 255, 255};
+          break;
+        case SYNTHETIC_NOISE:
+          px = (struct rgba){r, r >> 8, r >> 16, 255};
+          break;
+        case SYNTHETIC_UI: {
+          // Title bar, side panel and content with 1 pixel borders, buttons and "text"
+          if (y < 24) {
+            px = (struct rgba){45, 45, 48, 255};
+          } else if (x < 160) {
+            px = x == 159 ? (struct rgba){80, 80, 80, 255} : (struct rgba){37, 37, 38, 255};
+          } else {
+            px = (struct rgba){250, 250, 250, 255};
+            if ((x - 160) % 120 < 100 && (y - 24) % 40 >= 10 && (y - 24) % 40 < 30) {
+              px = (x - 160) % 120 == 0 || (y - 24) % 40 == 10 ? (struct rgba){0, 120, 215, 255} : (struct rgba){229, 241, 251, 255};
+            }
+          }
+          if ((r & 63) == 0 && y % 16 > 4 && y % 16 < 12) {
+            px = (struct rgba){30 + (r >> 8) % 40, 30 + (r >> 8) % 40, 30 + (r >> 8) % 40, 255};
+          }
+          break;
+        }
+        case SYNTHETIC_ALPHA_RAMP:
+          px = (struct rgba){200, (uint64_t)y * 255 / (height > 1 ? height - 1 : 1), 60,
+                             (uint64_t)x * 255 / (width > 1 ? width - 1 : 1)};
+          break;
+        case SYNTHETIC_RGBA_EVERY_PIXEL:
+          px = (struct rgba){r, r >> 8, r >> 16, (r >> 24) == px.a ? (r >> 24) + 1 : r >> 24};
+          break;
+        case SYNTHETIC_MAX_RUN:
+          if (runLeft == 0) {
+            runLeft = runLengths[runIndex++ % 6];
+            px = (struct rgba){r, r >> 8, r >> 16, (runIndex & 7) == 0 ? r >> 24 : 255};
+          }
+          runLeft--;
+          break;
+        case SYNTHETIC_DELTAS:
+          px.r += boundaries[r % 15];
+          px.g += boundaries[(r >> 8) % 15];
+          px.b += boundaries[(r >> 16) % 15];
+          if ((r >> 28) == 0) {
+            px.a = r >> 20;
+          }
+          break;
+        default:
+          px = palette[r % 80];
+          break;
+      }
+      memcpy(pixels + ((size_t)(y - fromY) * width + x) * 4, &px, 4);
+    }
+  }
+  generator->y = fromY + rows;
+  generator->random = random;
+  generator->px = px;
+  generator->runLeft = runLeft;
+  generator->runIndex = runIndex;
+}
+
+// Returns a malloc'd RGBA image, NULL without memory.
+uint8_t* generateSynthetic(int pattern, uint32_t width, uint32_t height, uint32_t seed) {
+  size_t pixelCount = (size_t)width * height;
+  uint8_t* pixels = malloc(pixelCount > 0 ? pixelCount * 4 : 1);
+  if (pixels == NULL) {
+    return NULL;
+  }
+  struct synthetic_generator generator;
+  initSynthetic(&generator, pattern, width, height, seed);
+  generateRows(&generator, pixels, height);
+  return pixels;
+}
+
+// Frame of a synthetic screen recording, RGBA: base (the ui pattern) with static lines of
+// anti-aliased "text", a window dragged across it, a line being typed and a clock that changes
+// every frame. Only a few percent of the pixels change from one frame to the next.
+void generateScreenFrame(const uint8_t* base, uint32_t width, uint32_t height, uint32_t frame, uint8_t* out) {
+  memcpy(out, base, (size_t)width * height * 4);
+  const uint32_t textY = height > 24 ? height - 16 : 0;
+  const uint32_t typed = frame * 4 < width ? frame * 4 : width;
+  for (uint32_t y = 24; y < height; y++) {
+    for (uint32_t x = width > 160 ? 160 : 0; x < width; x++) {
+      // The document and the line being typed below it
+      uint32_t random = (x * 2654435761u) ^ (y * 40503u) ^ 0x9e3779b9;
+      int text = y >= textY ? y < textY + 10 && x < typed : (y - 24) % 12 < 8 && x % 400 < 360;
+      if (text && xorshift32(&random) % 3 == 0) {
+        memset(out + ((size_t)y * width + x) * 4, 40 + random % 160, 3);
+      }
+    }
+  }
+  const uint32_t windowWidth = width / 10 > 2 ? width / 10 : 2;
+  const uint32_t windowHeight = height / 10 > 2 ? height / 10 : 2;
+  const uint32_t windowX = frame * 5 % (width - windowWidth + 1);
+  const uint32_t windowY = frame * 3 % (height - windowHeight + 1);
+  for (uint32_t y = 0; y < windowHeight; y++) {
+    for (uint32_t x = 0; x < windowWidth; x++) {
+      int border = x == 0 || y == 0 || x == windowWidth - 1 || y == windowHeight - 1;
+      struct rgba px = border ? (struct rgba){0, 120, 215, 255} : y < 8 ? (struct rgba){45, 45, 48, 255} :
+                       (struct rgba){243, 243, 243, 255};
+      memcpy(out + ((size_t)(windowY + y) * width + windowX + x) * 4, &px, 4);
+    }
+  }
+  for (uint32_t y = 0; y < 10 && y < height; y++) {
+    for (uint32_t x = width > 32 ? width - 32 : 0; x < width; x++) {
+      struct rgba px = {frame * 37 + x, frame * 11 + y, 200, 255};
+      memcpy(out + ((size_t)y * width + x) * 4, &px, 4);
+    }
+  }
+}
+
+double secondsNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Conformance verifier (the verify command). For every image of the corpus (original_png with
+// its original_qoi counterpart) and of a synthetic corpus it checks every code path against the
+// reference codec above: byte-exact encoding for every source format and stride, the output of
+// the effort levels, near-lossless, tiled, qoiz and checksum variants decoded back, and decoding
+// for every output format, rectangles and thumbnails of size 1:1.
+struct verify_state {
+  const char* image;
+  int checks;
+  int failures;
+  struct thread_pool* pool;
+};
+
+void verifyCheck(struct verify_state* state, int ok, const char* variant, const char* detail) {
+  state->checks++;
+  if (!ok) {
+    state->failures++;
+    printf("FAIL %s %s%s%s\n", state->image, variant, detail != NULL ? ": " : "", detail != NULL ? detail : "");
+  }
+}
+
+// Checks pixels (pixelSize bytes each) and reports the first difference.
+void verifyPixels(struct verify_state* state, const char* variant, const uint8_t* actual, const uint8_t* expected,
+                  size_t pixelCount, size_t pixelSize) {
+  char detail[64];
+  if (actual == NULL) {
+    verifyCheck(state, 0, variant, "no output");
+    return;
+  }
+  for (size_t i = 0; i < pixelCount; i++) {
+    if (memcmp(actual + i * pixelSize, expected + i * pixelSize, pixelSize) != 0) {
+      snprintf(detail, sizeof(detail), "pixel %lu differs", i);
+      verifyCheck(state, 0, variant, detail);
+      return;
+    }
+  }
+  verifyCheck(state, 1, variant, NULL);
+}
+
+void verifyBytes(struct verify_state* state, const char* variant, const uint8_t* actual, size_t actualSize,
+                 const uint8_t* expected, size_t expectedSize) {
+  char detail[64];
+  if (actual == NULL) {
+    verifyCheck(state, 0, variant, "no output");
+    return;
+  }
+  size_t i = 0;
+  while (i < actualSize && i < expectedSize && actual[i] == expected[i]) {
+    i++;
+  }
+  snprintf(detail, sizeof(detail), "%lu bytes, expected %lu, first difference at %lu", actualSize, expectedSize, i);
+  verifyCheck(state, i == actualSize && i == expectedSize, variant, detail);
+}
+
+uint8_t* cropPixels(const uint8_t* pixels, uint32_t width, uint32_t x, uint32_t y, uint32_t cropWidth, uint32_t cropHeight,
+                    size_t pixelSize) {
+  uint8_t* out = malloc((size_t)cropWidth * cropHeight * pixelSize + 1);
+  for (uint32_t row = 0; out != NULL && row < cropHeight; row++) {
+    memcpy(out + (size_t)row * cropWidth * pixelSize, pixels + ((size_t)(y + row) * width + x) * pixelSize,
+           (size_t)cropWidth * pixelSize);
+  }
+  return out;
+}
+
+// Runs all checks for one RGBA image. reference is the expected file (from original_qoi or the
+// reference encoder). Returns encode and decode throughput of the default paths in *_mps.
+void verifyImage(struct verify_state* state, const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t channels,
+                 const uint8_t* reference, size_t referenceSize, double* encodeMps, double* decodeMps) {
+  const size_t pixelCount = (size_t)width * height;
+  struct qoi_header qoiHeader;
+  size_t size;
+  char variant[64];
+  // Pixels as stored: 3 channel images are opaque
+  uint8_t* expected = calloc(pixelCount * 4 + 1, 1);
+  if (expected == NULL) {
+    verifyCheck(state, 0, "setup", "no memory");
+    *encodeMps = 0;
+    *decodeMps = 0;
+    return;
+  }
+  for (size_t i = 0; i < pixelCount; i++) {
+    memcpy(expected + i * 4, rgba + i * 4, 4);
+    if (channels == 3) {
+      expected[i * 4 + 3] = 255;
+    }
+  }
+
+  // The oracle itself against the expected file
+  uint8_t* bytes = referenceEncode(expected, width, height, channels, &size);
+  verifyBytes(state, "reference-encode", bytes, size, reference, referenceSize);
+  free(bytes);
+
+  // Default encode, timed
+  uint8_t* packed = malloc(pixelCount * channels + 1);
+  for (size_t i = 0; packed != NULL && i < pixelCount; i++) {
+    memcpy(packed + i * channels, expected + i * 4, channels);
+  }
+  struct qoi_source source = {packed, width, height, 0, channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB};
+  int runs = 0;
+  double begin = secondsNow();
+  double elapsed;
+  do {
+    bytes = encodeSource(&source, NULL, &size, NULL);
+    runs++;
+    elapsed = secondsNow() - begin;
+    if (elapsed < 0.02 && bytes != NULL) {
+      free(bytes);
+    }
+  } while (elapsed < 0.02 && bytes != NULL);
+  *encodeMps = pixelCount * runs / elapsed / 1e6;
+  verifyBytes(state, "encode", bytes, size, reference, referenceSize);
+  free(bytes);
+
+  // Every source format with padded rows (the 3 channel layouts only for opaque images)
+  const int sourceFormats[] = {QOI_FORMAT_BGRA, QOI_FORMAT_ARGB, QOI_FORMAT_RGB, QOI_FORMAT_BGR};
+  for (int f = 0; f < 4; f++) {
+    int format = sourceFormats[f];
+    size_t pixelSize = formatSize(format);
+    if (pixelSize == 3 && channels == 4) {
+      continue;
+    }
+    size_t stride = width * pixelSize + 5;
+    uint8_t* layout = malloc(stride * height + 1);
+    if (layout == NULL) {
+      continue;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+      convertPixels(expected + (size_t)y * width * 4, layout + y * stride, width, format);
+    }
+    struct qoi_source strided = {layout, width, height, stride, format};
+    bytes = encodeSource(&strided, NULL, &size, NULL);
+    // The channels byte follows the source format
+    size_t formatReferenceSize;
+    uint8_t* formatReference = referenceEncode(expected, width, height, pixelSize == 4 ? 4 : 3, &formatReferenceSize);
+    snprintf(variant, sizeof(variant), "encode-%s", f == 0 ? "bgra" : f == 1 ? "argb" : f == 2 ? "rgb" : "bgr");
+    verifyBytes(state, variant, bytes, size, formatReference, formatReferenceSize);
+    free(bytes);
+    free(formatReference);
+    free(layout);
+  }
+
+  // Premultiplied sources without alpha are opaque, so they encode like the straight layout
+  const int opaqueFormats[] = {QOI_FORMAT_RGB, QOI_FORMAT_BGR, QOI_FORMAT_GRAY};
+  uint8_t* layout = malloc(pixelCount * 3 + 1);
+  for (int f = 0; layout != NULL && f < 3; f++) {
+    int format = opaqueFormats[f];
+    convertPixels(expected, layout, pixelCount, format);
+    struct qoi_source straight = {layout, width, height, 0, format};
+    struct qoi_source premultiplied = {layout, width, height, 0, format | QOI_FORMAT_PREMULTIPLIED};
+    size_t straightSize = 0;
+    uint8_t* straightBytes = encodeSource(&straight, NULL, &straightSize, NULL);
+    bytes = encodeSource(&premultiplied, NULL, &size, NULL);
+    snprintf(variant, sizeof(variant), "encode-premultiplied-%s", f == 0 ? "rgb" : f == 1 ? "bgr" : "gray");
+    verifyBytes(state, variant, bytes, size, straightBytes, straightSize);
+    free(bytes);
+    free(straightBytes);
+  }
+  free(layout);
+
+  // Effort levels pick other ops of the same size, near-lossless stays within its bound
+  for (int effort = 1; effort <= 2; effort++) {
+    struct qoi_encode_options options = defaultEncodeOptions;
+    options.effort = effort;
+    bytes = encodeSource(&source, &options, &size, NULL);
+    uint32_t decodedWidth;
+    uint32_t decodedHeight;
+    uint8_t* decoded = bytes != NULL ? referenceDecode(bytes, size, &decodedWidth, &decodedHeight) : NULL;
+    snprintf(variant, sizeof(variant), "effort-%d", effort);
+    verifyPixels(state, variant, decoded, expected, pixelCount, 4);
+    snprintf(variant, sizeof(variant), "effort-%d-size", effort);
+    verifyCheck(state, bytes != NULL && size == referenceSize, variant, NULL);
+    free(decoded);
+    free(bytes);
+  }
+  {
+    struct qoi_encode_options options = defaultEncodeOptions;
+    options.maxError = 2;
+    bytes = encodeSource(&source, &options, &size, NULL);
+    uint32_t decodedWidth;
+    uint32_t decodedHeight;
+    uint8_t* decoded = bytes != NULL ? referenceDecode(bytes, size, &decodedWidth, &decodedHeight) : NULL;
+    int ok = decoded != NULL;
+    for (size_t i = 0; ok && i < pixelCount * 4; i++) {
+      int difference = abs((int)decoded[i] - expected[i]);
+      ok = (i & 3) == 3 ? difference == 0 : difference <= 2;
+    }
+    verifyCheck(state, ok, "near-lossless", NULL);
+    free(decoded);
+    free(bytes);
+  }
+
+  // Checksum chunk: same stream plus the chunk, verified on decode
+  {
+    struct qoi_encode_options options = defaultEncodeOptions;
+    options.checksum = 1;
+    bytes = encodeSource(&source, &options, &size, NULL);
+    verifyBytes(state, "checksum-encode", bytes, bytes != NULL ? size - checksumChunkSize : 0, reference, referenceSize);
+    uint8_t* decoded = bytes != NULL ? decodeMemory(bytes, size, &qoiHeader, QOI_FORMAT_RGBA, NULL) : NULL;
+    verifyPixels(state, "checksum-decode", decoded, expected, pixelCount, 4);
+    free(decoded);
+    free(bytes);
+  }
+
+  // Default decode, timed
+  uint8_t* decoded;
+  runs = 0;
+  begin = secondsNow();
+  do {
+    decoded = decodeMemory(reference, referenceSize, &qoiHeader, QOI_FORMAT_RGBA, NULL);
+    runs++;
+    elapsed = secondsNow() - begin;
+    if (elapsed < 0.02 && decoded != NULL) {
+      free(decoded);
+    }
+  } while (elapsed < 0.02 && decoded != NULL);
+  *decodeMps = pixelCount * runs / elapsed / 1e6;
+  verifyPixels(state, "decode", decoded, expected, pixelCount, 4);
+  free(decoded);
+
+  // Every output format against converting the expected pixels
+  uint8_t* converted = malloc(pixelCount * 4 + 1);
+  for (int format = 0; converted != NULL && format <= (QOI_FORMAT_GRAY | QOI_FORMAT_PREMULTIPLIED); format++) {
+    if ((format & ~QOI_FORMAT_PREMULTIPLIED) > QOI_FORMAT_GRAY || format == QOI_FORMAT_RGBA) {
+      continue;
+    }
+    convertPixels(expected, converted, pixelCount, format);
+    decoded = decodeMemory(reference, referenceSize, &qoiHeader, format, NULL);
+    snprintf(variant, sizeof(variant), "decode-format-%d", format);
+    verifyPixels(state, variant, decoded, converted, pixelCount, formatSize(format));
+    free(decoded);
+  }
+  free(converted);
+
+  // Chunked decode with checksums
+  struct qoi_checksums checksums;
+  decoded = decodeVerified(reference, referenceSize, &qoiHeader, QOI_FORMAT_RGBA, NULL, &checksums, &noLimits, NULL);
+  verifyPixels(state, "decode-checksum", decoded, expected, pixelCount, 4);
+  free(decoded);
+
+  // Rectangles: the whole image, one pixel in the last row, and one in the middle
+  uint32_t rects[3][4] = {
+    {0, 0, width, height},
+    {width - 1, height - 1, 1, 1},
+    {width / 3, height / 3, width - width / 3 - width / 4, height - height / 3 - height / 4}
+  };
+  for (int r = 0; r < 3; r++) {
+    uint32_t* rect = rects[r];
+    if (rect[2] == 0 || rect[3] == 0) {
+      continue;
+    }
+    uint8_t* crop = cropPixels(expected, width, rect[0], rect[1], rect[2], rect[3], 4);
+    decoded = decodeRect(reference, referenceSize, rect[0], rect[1], rect[2], rect[3], QOI_FORMAT_RGBA, &qoiHeader, NULL);
+    snprintf(variant, sizeof(variant), "rect-%d", r);
+    verifyPixels(state, variant, decoded, crop, (size_t)rect[2] * rect[3], 4);
+    free(decoded);
+    free(crop);
+  }
+
+  // A thumbnail of the same size is the image itself, except that the downscaler zeroes the
+  // colour of fully transparent pixels
+  uint8_t* thumbnail = malloc(pixelCount * 4 + 1);
+  for (size_t i = 0; thumbnail != NULL && i < pixelCount; i++) {
+    memcpy(thumbnail + i * 4, expected + i * 4, 4);
+    if (thumbnail[i * 4 + 3] == 0) {
+      memset(thumbnail + i * 4, 0, 3);
+    }
+  }
+  decoded = thumbnail != NULL ? decodeThumbnail(reference, referenceSize, width, height, &qoiHeader, &noLimits, NULL) : NULL;
+  verifyPixels(state, "thumbnail-1:1", decoded, thumbnail, pixelCount, 4);
+  free(decoded);
+  free(thumbnail);
+
+  // Tiled, in parallel, with tiles that do not divide the image
+  {
+    uint32_t tileSize = width > 64 ? 61 : (width > 2 ? width / 2 : 1);
+    bytes = encodeTiled(&source, tileSize, tileSize, NULL, state->pool, &size, NULL);
+    decoded = bytes != NULL ? decodeTiledRect(bytes, size, 0, 0, width, height, QOI_FORMAT_RGBA, state->pool, NULL) : NULL;
+    verifyPixels(state, "tiled", decoded, expected, pixelCount, 4);
+    free(decoded);
+    uint32_t* rect = rects[2];
+    if (bytes != NULL && rect[2] > 0 && rect[3] > 0) {
+      uint8_t* crop = cropPixels(expected, width, rect[0], rect[1], rect[2], rect[3], 4);
+      decoded = decodeTiledRect(bytes, size, rect[0], rect[1], rect[2], rect[3], QOI_FORMAT_RGBA, state->pool, NULL);
+      verifyPixels(state, "tiled-rect", decoded, crop, (size_t)rect[2] * rect[3], 4);
+      free(decoded);
+      free(crop);
+    }
+    free(bytes);
+  }
+
+  // qoiz round trip
+  {
+    bytes = compressQoiz(reference, referenceSize, &size, NULL);
+    decoded = bytes != NULL ? decodeQoiz(bytes, size, &qoiHeader, QOI_FORMAT_RGBA, &noLimits, NULL) : NULL;
+    verifyPixels(state, "qoiz", decoded, expected, pixelCount, 4);
+    free(decoded);
+    free(bytes);
+  }
+
+  free(packed);
+  free(expected);
+}
+
+// Verifies the corpus and the synthetic images. Returns the number of failures.
+int verify(int threads) {
+  struct verify_state state = {NULL, 0, 0, poolCreate(threads)};
+  if (state.pool == NULL) {
+    printf("Could not create the thread pool\n");
+    return 1;
+  }
+  char path[256];
+  char name[64];
+  double encodeMps;
+  double decodeMps;
+  printf("%-28s %10s %10s %8s\n", "image", "enc MP/s", "dec MP/s", "result");
+  for (int i = 0; i < benchmarkImageCount; i++) {
+    snprintf(path, sizeof(path), "./original_qoi/%s.qoi", benchmarkImages[i]);
+    size_t referenceSize;
+    uint8_t* reference = readFile(path, &referenceSize, NULL);
+    struct qoi_header qoiHeader;
+    if (reference == NULL || !readHeader(reference, referenceSize, &qoiHeader, NULL)) {
+      free(reference);
+      state.image = benchmarkImages[i];
+      verifyCheck(&state, 0, "load", path);
+      continue;
+    }
+    // Loaded with as many channels as the reference file has
+    snprintf(path, sizeof(path), "./original_png/%s.png", benchmarkImages[i]);
+    int width;
+    int height;
+    uint8_t* rgba = stbi_load(path, &width, &height, NULL, 4);
+    state.image = benchmarkImages[i];
+    if (rgba == NULL || (uint32_t)width != qoiHeader.width || (uint32_t)height != qoiHeader.height) {
+      verifyCheck(&state, 0, "load", path);
+    } else {
+      int failures = state.failures;
+      verifyImage(&state, rgba, width, height, qoiHeader.channels, reference, referenceSize, &encodeMps, &decodeMps);
+      printf("%-28s %10.1f %10.1f %8s\n", benchmarkImages[i], encodeMps, decodeMps, failures == state.failures ? "PASS" : "FAIL");
+    }
+    free(rgba);
+    free(reference);
+  }
+
+  // Synthetic corpus: the expected files come from the reference encoder
+  const uint32_t sizes[][2] = {{1, 1}, {63, 5}, {320, 240}};
+  for (int pattern = 0; pattern < SYNTHETIC_PATTERN_COUNT; pattern++) {
+    for (int s = 0; s < 3; s++) {
+      uint32_t width = sizes[s][0];
+      uint32_t height = sizes[s][1];
+      snprintf(name, sizeof(name), "%s-%ux%u", syntheticNames[pattern], width, height);
+      state.image = name;
+      uint8_t* rgba = generateSynthetic(pattern, width, height, pattern * 3 + s);
+      int opaque = 1;
+      for (size_t i = 0; rgba != NULL && i < (size_t)width * height; i++) {
+        opaque &= rgba[i * 4 + 3] == 255;
+      }
+      size_t referenceSize;
+      uint8_t* reference = rgba != NULL ? referenceEncode(rgba, width, height, opaque ? 3 : 4, &referenceSize) : NULL;
+      if (reference == NULL) {
+        verifyCheck(&state, 0, "generate", "no memory");
+      } else {
+        int failures = state.failures;
+        verifyImage(&state, rgba, width, height, opaque ? 3 : 4, reference, referenceSize, &encodeMps, &decodeMps);
+        printf("%-28s %10.1f %10.1f %8s\n", name, encodeMps, decodeMps, failures == state.failures ? "PASS" : "FAIL");
+      }
+      free(reference);
+      free(rgba);
+    }
+  }
+
+  // Sequences: a screen recording with a keyframe every 5 frames, as RGBA and as RGB. Frames
+  // decode in order and when seeking back and forth, and the sequence is less than half the size
+  // of the frames as independent qoi files
+  state.image = "sequence";
+  {
+    const uint32_t width = 256;
+    const uint32_t height = 160;
+    const uint32_t frameCount = 12;
+    const size_t frameSize = (size_t)width * height * 4;
+    char variant[64];
+    uint8_t* base = generateSynthetic(SYNTHETIC_UI, width, height, 1);
+    uint8_t* frames = base != NULL ? malloc(frameSize * frameCount) : NULL;
+    for (uint32_t frame = 0; frames != NULL && frame < frameCount; frame++) {
+      generateScreenFrame(base, width, height, frame, frames + frame * frameSize);
+    }
+    for (uint8_t channels = 3; channels <= 4; channels++) {
+      struct qoi_sequence_encoder encoder;
+      int ok = frames != NULL && sequenceEncoderInit(&encoder, width, height, channels, 5, NULL, NULL);
+      size_t independent = 0;
+      for (uint32_t frame = 0; ok && frame < frameCount; frame++) {
+        struct qoi_source source = {frames + frame * frameSize, width, height, 0, QOI_FORMAT_RGBA};
+        size_t frameBytes = 0;
+        uint8_t* bytes = encodeSource(&source, NULL, &frameBytes, NULL);
+        independent += frameBytes;
+        free(bytes);
+        ok = sequenceAddFrame(&encoder, &source, NULL);
+      }
+      size_t size = 0;
+      uint8_t* bytes = ok ? sequenceFinish(&encoder, &size, NULL) : NULL;
+      if (!ok && frames != NULL) {
+        sequenceEncoderFree(&encoder);
+      }
+      snprintf(variant, sizeof(variant), "sequence-%s", channels == 4 ? "rgba" : "rgb");
+      verifyCheck(&state, bytes != NULL, variant, "encode");
+
+      struct qoi_sequence sequence;
+      ok = bytes != NULL && openSequence(&sequence, bytes, size, &noLimits, NULL);
+      for (uint32_t frame = 0; ok && frame < frameCount; frame++) {
+        const uint8_t* decoded = sequenceFrame(&sequence, frame, NULL);
+        ok = decoded != NULL && memcmp(decoded, frames + frame * frameSize, frameSize) == 0;
+      }
+      snprintf(variant, sizeof(variant), "sequence-%s-decode", channels == 4 ? "rgba" : "rgb");
+      verifyCheck(&state, ok, variant, NULL);
+      const uint32_t seeks[] = {11, 3, 7, 6, 0, 9, 10};
+      for (int i = 0; ok && i < 7; i++) {
+        const uint8_t* decoded = sequenceFrame(&sequence, seeks[i], NULL);
+        ok = decoded != NULL && memcmp(decoded, frames + seeks[i] * frameSize, frameSize) == 0;
+      }
+      snprintf(variant, sizeof(variant), "sequence-%s-seek", channels == 4 ? "rgba" : "rgb");
+      verifyCheck(&state, ok, variant, NULL);
+      if (bytes != NULL) {
+        closeSequence(&sequence);
+      }
+      snprintf(variant, sizeof(variant), "sequence-%s-size", channels == 4 ? "rgba" : "rgb");
+      verifyCheck(&state, bytes != NULL && size * 2 < independent, variant, NULL);
+
+      if (channels == 4) {
+        struct qoi_error error = {QOI_OK};
+        ok = bytes != NULL && !openSequence(&sequence, bytes, size / 2, &noLimits, &error);
+        verifyCheck(&state, ok && error.status == QOI_ERROR_CORRUPT, "sequence-truncated", error.detail);
+      }
+      free(bytes);
+    }
+    free(frames);
+    free(base);
+  }
+
+  // Hostile files: a header claiming 65535x65535 pixels with only the end chunk behind it is
+  // refused before anything is allocated (also with a checksum chunk and as qoiz), the limits
+  // hold, and each failure reports its status
+  state.image = "hostile";
+  {
+    uint8_t bomb[14 + 8 + 20] = {'q', 'o', 'i', 'f', 0, 0, 0xff, 0xff, 0, 0, 0xff, 0xff, 4, 0,
+                                 0, 0, 0, 0, 0, 0, 0, 1, 'q', 'o', 'i', 'h'};
+    struct qoi_header qoiHeader;
+    size_t size;
+    struct qoi_error error = {QOI_OK};
+    uint8_t* decoded = decodeMemory(bomb, 14 + 8, &qoiHeader, QOI_FORMAT_RGBA, &error);
+    verifyCheck(&state, decoded == NULL && error.status == QOI_ERROR_CORRUPT, "implausible-size", error.detail);
+    free(decoded);
+    error = (struct qoi_error){QOI_OK};
+    decoded = decodeMemory(bomb, sizeof(bomb), &qoiHeader, QOI_FORMAT_RGBA, &error);
+    verifyCheck(&state, decoded == NULL && error.status == QOI_ERROR_CORRUPT, "implausible-size-checksum", error.detail);
+    free(decoded);
+    error = (struct qoi_error){QOI_OK};
+    uint8_t* bytes = compressQoiz(bomb, 14 + 8, &size, NULL);
+    decoded = bytes != NULL ? decodeQoiz(bytes, size, &qoiHeader, QOI_FORMAT_RGBA, &noLimits, &error) : NULL;
+    verifyCheck(&state, bytes != NULL && decoded == NULL && error.status == QOI_ERROR_CORRUPT, "implausible-size-qoiz",
+                error.detail);
+    free(decoded);
+    free(bytes);
+
+    // A qoit header whose tile count wrapped to 0 for a width near 2^32 before
+    uint8_t qoit[tiledHeaderSize + 8];
+    memset(qoit, 0, sizeof(qoit));
+    memcpy(qoit, QOIT_MAGIC, 4);
+    const uint8_t tiledValues[] = {0xff, 0xff, 0xff, 0xff, 0, 0, 0, 1, 4, 0, 0, 0, 0, 16, 0, 0, 0, 16};
+    memcpy(qoit + 4, tiledValues, sizeof(tiledValues));
+    struct qoi_tiled_header tiled;
+    error = (struct qoi_error){QOI_OK};
+    verifyCheck(&state, !readTiledHeader(qoit, sizeof(qoit), &tiled, &error) && error.status == QOI_ERROR_CORRUPT,
+                "qoit-tile-count", error.detail);
+
+    // A qoiz header asking for huge block buffers, and a stored block claiming more raw bytes than it holds
+    uint8_t qoiz[8 + 8 + 28] = {'q', 'o', 'i', 'z', 0xff, 0xff, 0xff, 0xff};
+    error = (struct qoi_error){QOI_OK};
+    decoded = decodeQoiz(qoiz, 16, &qoiHeader, QOI_FORMAT_RGBA, &noLimits, &error);
+    verifyCheck(&state, decoded == NULL && error.status == QOI_ERROR_CORRUPT, "qoiz-block-size", error.detail);
+    free(decoded);
+    const uint8_t stored[] = {0, 0x10, 0, 0, 0x80, 0, 0, 28, 0, 0, 0x10, 0};
+    memcpy(qoiz + 4, stored, sizeof(stored));
+    memcpy(qoiz + 16, bomb, 14);
+    error = (struct qoi_error){QOI_OK};
+    decoded = decodeQoiz(qoiz, sizeof(qoiz), &qoiHeader, QOI_FORMAT_RGBA, &noLimits, &error);
+    verifyCheck(&state, decoded == NULL && error.status == QOI_ERROR_CORRUPT, "qoiz-stored-block", error.detail);
+    free(decoded);
+
+    uint8_t* rgba = generateSynthetic(SYNTHETIC_NOISE, 64, 64, 1);
+    bytes = rgba != NULL ? referenceEncode(rgba, 64, 64, 4, &size) : NULL;
+    const struct qoi_limits limits[] = {{64 * 64, 0, 0}, {64 * 64 - 1, 0, 0}, {0, 64 * 64 * 3 - 1, 0}, {0, 0, 1e-9}};
+    const enum qoi_status statuses[] = {QOI_OK, QOI_ERROR_TOO_LARGE, QOI_ERROR_TOO_LARGE, QOI_ERROR_TIMEOUT};
+    const char* names[] = {"limit-pixels", "limit-pixels-over", "limit-bytes-over", "limit-seconds-over"};
+    for (int i = 0; i < 4; i++) {
+      error = (struct qoi_error){QOI_OK};
+      decoded = bytes != NULL ? decodeBytes(bytes, size, &qoiHeader, QOI_FORMAT_RGB, &limits[i], &error) : NULL;
+      verifyCheck(&state, bytes != NULL && (decoded != NULL) == (i == 0) && error.status == statuses[i], names[i],
+                  error.detail);
+      free(decoded);
+    }
+
+    // A truncated file still decodes, with the missing pixels zero and a warning
+    error = (struct qoi_error){QOI_OK};
+    decoded = bytes != NULL ? decodeMemory(bytes, size / 2, &qoiHeader, QOI_FORMAT_RGBA, &error) : NULL;
+    verifyCheck(&state, decoded != NULL && error.status == QOI_PARTIAL, "truncated", error.detail);
+    free(decoded);
+    error = (struct qoi_error){QOI_OK};
+    decoded = bytes != NULL ? decodeRect(bytes, size / 2, 0, 48, 64, 16, QOI_FORMAT_RGBA, &qoiHeader, &error) : NULL;
+    int zero = decoded != NULL;
+    for (size_t i = 0; zero && i < 64 * 16 * 4; i++) {
+      zero = decoded[i] == 0;
+    }
+    verifyCheck(&state, zero && error.status == QOI_PARTIAL, "truncated-rect", error.detail);
+    free(decoded);
+
+    // A qoiz whose second block is corrupt fails even though the first one started the image
+    size_t half = size / 2;
+    uint8_t* corrupt = bytes != NULL ? malloc(8 + 8 + half + 8 + (size - half)) : NULL;
+    if (corrupt != NULL) {
+      const uint32_t fields[] = {QOIZ_BLOCK_SIZE, half | QOIZ_STORED, half, (size - half) | QOIZ_STORED, size - half + 1};
+      uint32_t be[5];
+      for (int i = 0; i < 5; i++) {
+        be[i] = __builtin_bswap32(fields[i]);
+      }
+      memcpy(corrupt, QOIZ_MAGIC, 4);
+      memcpy(corrupt + 4, be, 12);
+      memcpy(corrupt + 16, bytes, half);
+      memcpy(corrupt + 16 + half, be + 3, 8);
+      memcpy(corrupt + 24 + half, bytes + half, size - half);
+    }
+    error = (struct qoi_error){QOI_OK};
+    decoded = corrupt != NULL ? decodeQoiz(corrupt, 24 + size, &qoiHeader, QOI_FORMAT_RGBA, &noLimits, &error) : NULL;
+    verifyCheck(&state, corrupt != NULL && decoded == NULL && error.status == QOI_ERROR_CORRUPT, "qoiz-corrupt-block",
+                error.detail);
+    free(decoded);
+    free(corrupt);
+    free(bytes);
+    free(rgba);
+  }
+  poolDestroy(state.pool);
+  printf("%d checks, %d failures\n", state.checks, state.failures);
+  return state.failures;
+}
+
+// Returns the synthetic pattern with this name, -1 for unknown names.
+int parsePattern(const char* name) {
+  for (int pattern = 0; pattern < SYNTHETIC_PATTERN_COUNT; pattern++) {
+    if (strcmp(name, syntheticNames[pattern]) == 0) {
+      return pattern;
+    }
+  }
+  return -1;
+}
+
+// Writes a synthetic image as raw RGBA (.raw), png (.png) or qoi (anything else). Returns 0 on success.
+int generate(int pattern, uint32_t width, uint32_t height, uint32_t seed, const char* outfile) {
+  uint8_t* pixels = generateSynthetic(pattern, width, height, seed);
+  if (pixels == NULL) {
+    printf("Not enough memory for the image!\n");
+    return 1;
+  }
+  size_t length = strlen(outfile);
+  int failed;
+  if (length > 4 && strcmp(outfile + length - 4, ".png") == 0) {
+    failed = !stbi_write_png(outfile, width, height, 4, pixels, width * 4);
+  } else {
+    size_t size = (size_t)width * height * 4;
+    uint8_t* bytes = pixels;
+    if (length <= 4 || strcmp(outfile + length - 4, ".raw") != 0) {
+      struct qoi_source source = {pixels, width, height, 0, QOI_FORMAT_RGBA};
+      bytes = encodeSource(&source, NULL, &size, NULL);
+    }
+    FILE* file = bytes != NULL ? fopen(outfile, "wb") : NULL;
+    failed = file == NULL || fwrite(bytes, 1, size, file) != size;
+    if (file != NULL) {
+      fclose(file);
+    }
+    if (bytes != pixels) {
+      free(bytes);
+    }
+  }
+  if (failed) {
+    printf("Could not write %s\n", outfile);
+  }
+  free(pixels);
+  return failed;
+}
+
+// Times encodeSource and decodeMemory of an RGBA image, each repeated for at least 0.2 seconds.
+// Returns the encoded image or NULL, sets the seconds per run and ok when the decoded image matches.
+uint8_t* timeCodec(const uint8_t* pixels, uint32_t width, uint32_t height, size_t* size, double* encodeSeconds,
+                   double* decodeSeconds, int* ok) {
+  struct qoi_source source = {pixels, width, height, 0, QOI_FORMAT_RGBA};
+  uint8_t* bytes = NULL;
+  int runs = 0;
+  double begin = secondsNow();
+  double elapsed;
+  do {
+    free(bytes);
+    bytes = encodeSource(&source, NULL, size, NULL);
+    runs++;
+    elapsed = secondsNow() - begin;
+  } while (elapsed < 0.2 && bytes != NULL);
+  *ok = 0;
+  if (bytes == NULL) {
+    return NULL;
+  }
+  *encodeSeconds = elapsed / runs;
+
+  struct qoi_header qoiHeader;
+  uint8_t* decoded = NULL;
+  runs = 0;
+  begin = secondsNow();
+  do {
+    free(decoded);
+    decoded = decodeMemory(bytes, *size, &qoiHeader, QOI_FORMAT_RGBA, NULL);
+    runs++;
+    elapsed = secondsNow() - begin;
+  } while (elapsed < 0.2 && decoded != NULL);
+  *decodeSeconds = elapsed / runs;
+  *ok = decoded != NULL && memcmp(decoded, pixels, (size_t)width * height * 4) == 0;
+  free(decoded);
+  return bytes;
+}
+
+struct sweep_result {
+  double encodeMps;
+  double decodeMps;
+  double bitsPerPixel;
+  int ok; // Decoded image matches
+};
+
+// Encodes and decodes one synthetic image, see timeCodec.
+void sweepMeasure(int pattern, uint32_t width, uint32_t height, struct sweep_result* result) {
+  memset(result, 0, sizeof(struct sweep_result));
+  const size_t pixelCount = (size_t)width * height;
+  uint8_t* pixels = generateSynthetic(pattern, width, height, 1);
+  if (pixels == NULL) {
+    return;
+  }
+  size_t size;
+  double encodeSeconds;
+  double decodeSeconds;
+  uint8_t* bytes = timeCodec(pixels, width, height, &size, &encodeSeconds, &decodeSeconds, &result->ok);
+  if (bytes != NULL) {
+    result->encodeMps = pixelCount / encodeSeconds / 1e6;
+    result->decodeMps = pixelCount / decodeSeconds / 1e6;
+    result->bitsPerPixel = size * 8.0 / pixelCount;
+  }
+  free(bytes);
+  free(pixels);
+}
+
+// Size sweep benchmark (the sweep command). Square images from 128x128 up to maxMegapixels,
+// four times the area each step, for every pattern. Each size runs in a forked child so that its
+// peak RSS (source, encoded and decoded image) can be reported on its own. Prints CSV.
+int sweep(const int* patterns, int patternCount, double maxMegapixels) {
+  printf("pattern,width,height,megapixels,encode_mps,decode_mps,bits_per_pixel,peak_rss_mb\n");
+  int failures = 0;
+  for (int i = 0; i < patternCount; i++) {
+    for (uint64_t side = 128; (double)side * side / 1e6 <= maxMegapixels; side *= 2) {
+      int pipeFds[2];
+      if (pipe(pipeFds) != 0) {
+        printf("Could not create a pipe\n");
+        return 1;
+      }
+      fflush(stdout);
+      pid_t child = fork();
+      if (child == 0) {
+        struct sweep_result result;
+        close(pipeFds[0]);
+        sweepMeasure(patterns[i], side, side, &result);
+        int written = write(pipeFds[1], &result, sizeof(result)) == sizeof(result);
+        _exit(written ? 0 : 1);
+      }
+      close(pipeFds[1]);
+      struct sweep_result result;
+      memset(&result, 0, sizeof(result));
+      int received = child > 0 && read(pipeFds[0], &result, sizeof(result)) == sizeof(result);
+      close(pipeFds[0]);
+      struct rusage usage;
+      memset(&usage, 0, sizeof(usage));
+      int status = 0;
+      if (child > 0) {
+        wait4(child, &status, 0, &usage);
+      }
+      if (!received || !result.ok) {
+        printf("# %s %lux%lu failed\n", syntheticNames[patterns[i]], side, side);
+        failures++;
+        continue;
+      }
+      // ru_maxrss is in kilobytes on Linux
+      printf("%s,%lu,%lu,%.3f,%.1f,%.1f,%.3f,%.1f\n", syntheticNames[patterns[i]], side, side, side * side / 1e6,
+             result.encodeMps, result.decodeMps, result.bitsPerPixel, usage.ru_maxrss / 1024.0);
+    }
+  }
+  return failures;
+}
+
+// Runs stage(argument) in a forked child and returns its exit status (1 if it could not run), with
+// its wall time and peak RSS in kilobytes.
+int runStage(int (*stage)(void*), void* argument, double* seconds, long* peakRss) {
+  fflush(stdout);
+  double begin = secondsNow();
+  pid_t child = fork();
+  if (child == 0) {
+    _exit(stage(argument));
+  }
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  int status = 0;
+  if (child < 0 || wait4(child, &status, 0, &usage) != child) {
+    return 1;
+  }
+  *seconds = secondsNow() - begin;
+  *peakRss = usage.ru_maxrss;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+// Files and image of the big command
+struct big_benchmark {
+  int pattern;
+  uint32_t width;
+  uint32_t height;
+  char rawPath[PATH_MAX];
+  char qoiPath[PATH_MAX];
+  char decodedPath[PATH_MAX];
+};
+
+// Rows per band so that a band of RGBA pixels is about 64 MiB
+uint32_t bigBandRows(const struct big_benchmark* big) {
+  uint64_t rows = (64ull << 20) / ((uint64_t)big->width * 4);
+  return rows == 0 ? 1 : rows > big->height ? big->height : rows;
+}
+
+int bigGenerate(void* argument) {
+  const struct big_benchmark* big = argument;
+  const uint32_t bandRows = bigBandRows(big);
+  uint8_t* band = malloc((size_t)big->width * bandRows * 4);
+  FILE* file = fopen(big->rawPath, "wb");
+  if (band == NULL || file == NULL) {
+    printf("Could not write %s\n", big->rawPath);
+    return 1;
+  }
+  struct synthetic_generator generator;
+  initSynthetic(&generator, big->pattern, big->width, big->height, 1);
+  int failed = 0;
+  for (uint32_t y = 0; y < big->height && !failed; y += bandRows) {
+    uint32_t rows = big->height - y < bandRows ? big->height - y : bandRows;
+    generateRows(&generator, band, rows);
+    failed = fwrite(band, (size_t)big->width * 4, rows, file) != rows;
+  }
+  failed |= fclose(file) != 0;
+  free(band);
+  return failed;
+}
+
+int bigEncode(void* argument) {
+  const struct big_benchmark* big = argument;
+  struct qoi_source layout = {NULL, big->width, big->height, 0, QOI_FORMAT_RGBA};
+  struct qoi_report report;
+  return printReport(encodeRaw(big->rawPath, big->qoiPath, &layout, NULL, &report), &report);
+}
+
+int bigDecode(void* argument) {
+  const struct big_benchmark* big = argument;
+  struct qoi_report report;
+  memset(&report, 0, sizeof(report));
+  int failed = decodeStream(big->qoiPath, big->decodedPath, QOI_FORMAT_RGBA, 0, &noLimits, &report) != 0;
+  return printReport(report.error.status, &report) || failed;
+}
+
+// Compares the generated and the decoded raw files in blocks
+int bigCompare(void* argument) {
+  const struct big_benchmark* big = argument;
+  FILE* files[2] = {fopen(big->rawPath, "rb"), fopen(big->decodedPath, "rb")};
+  const size_t blockSize = 1 << 20;
+  uint8_t* blocks[2] = {malloc(blockSize), malloc(blockSize)};
+  int differ = files[0] == NULL || files[1] == NULL || blocks[0] == NULL || blocks[1] == NULL;
+  while (!differ) {
+    size_t got = fread(blocks[0], 1, blockSize, files[0]);
+    differ = fread(blocks[1], 1, blockSize, files[1]) != got || memcmp(blocks[0], blocks[1], got) != 0;
+    if (got < blockSize) {
+      break;
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    if (files[i] != NULL) {
+      fclose(files[i]);
+    }
+    free(blocks[i]);
+  }
+  return differ;
+}
+
+// Big image benchmark (the big command): generates a synthetic image of any size as a raw file
+// in bands, encodes it through file mappings, decodes it back with the streaming decoder and
+// compares the result, each stage in its own process. Prints the time, MP/s and peak RSS of each
+// stage. Images of several gigapixels need neither the raw nor the decoded image in memory; the
+// encode stage's RSS includes the mapped file pages, which the kernel can drop or write back.
+int bigBenchmark(int pattern, uint32_t width, uint32_t height, const char* dir, int keep) {
+  if (!checkDimensions(width, height, NULL)) {
+    return 1;
+  }
+  struct big_benchmark big = {pattern, width, height};
+  snprintf(big.rawPath, sizeof(big.rawPath), "%s/big-%s-%ux%u.raw", dir, syntheticNames[pattern], width, height);
+  snprintf(big.qoiPath, sizeof(big.qoiPath), "%s/big-%s-%ux%u.qoi", dir, syntheticNames[pattern], width, height);
+  snprintf(big.decodedPath, sizeof(big.decodedPath), "%s/big-%s-%ux%u.decoded.raw", dir, syntheticNames[pattern], width, height);
+  const double megapixels = (double)width * height / 1e6;
+  printf("%s %ux%u, %.1f megapixels, %.2f GiB raw\n", syntheticNames[pattern], width, height, megapixels,
+         megapixels * 1e6 * 4 / (1 << 30));
+
+  const char* names[] = {"generate", "encode", "decode", "compare"};
+  int (*stages[])(void*) = {bigGenerate, bigEncode, bigDecode, bigCompare};
+  int failed = 0;
+  printf("%-10s %10s %10s %12s\n", "stage", "seconds", "MP/s", "peak RSS MB");
+  for (int i = 0; i < 4 && !failed; i++) {
+    double seconds = 0;
+    long peakRss = 0;
+    failed = runStage(stages[i], &big, &seconds, &peakRss);
+    if (failed) {
+      printf("%-10s failed%s\n", names[i], i == 3 ? ", the decoded image differs" : "");
+    } else {
+      printf("%-10s %10.2f %10.1f %12.1f\n", names[i], seconds, megapixels / seconds, peakRss / 1024.0);
+    }
+  }
+  struct stat status;
+  if (!failed && stat(big.qoiPath, &status) == 0) {
+    printf("qoi file %.2f GiB, %.3f bits per pixel\n", status.st_size / (double)(1 << 30),
+           status.st_size * 8.0 / ((double)width * height));
+  }
+  if (!keep) {
+    remove(big.rawPath);
+    remove(big.qoiPath);
+    remove(big.decodedPath);
+  }
+  return failed;
+}
+
+// Keyframe interval of the sequence command, 2 seconds at 30 frames per second
+const uint32_t defaultKeyframeInterval = 60;
+
+// Encodes image files (anything stb_image reads, all of the same size) as the frames of a qoiv
+// sequence. Returns 0 on success.
+int sequenceEncodeFiles(const char* outfile, const char* const* paths, int count, uint32_t keyframeInterval,
+                        const struct qoi_encode_options* options) {
+  struct qoi_sequence_encoder encoder;
+  struct qoi_error error = {QOI_OK};
+  int width;
+  int height;
+  int channels = 0;
+  int keyframes = 0;
+  for (int i = 0; i < count; i++) {
+    if (i == 0) {
+      if (!stbi_info(paths[0], &width, &height, &channels)) {
+        printf("Cannot read image info from infile %s (%s)\n", paths[0], stbi_failure_reason());
+        return 1;
+      }
+      // Every frame gets the channels of the first one
+      channels = channels == 3 ? 3 : 4;
+      if (!sequenceEncoderInit(&encoder, width, height, channels, keyframeInterval, options, &error)) {
+        printf("%s\n", error.detail);
+        return 1;
+      }
+    }
+    int frameWidth;
+    int frameHeight;
+    uint8_t* pixels = stbi_load(paths[i], &frameWidth, &frameHeight, NULL, channels);
+    if (pixels == NULL) {
+      printf("Couldn't load image file %s (%s)\n", paths[i], stbi_failure_reason());
+      sequenceEncoderFree(&encoder);
+      return 1;
+    }
+    struct qoi_source source = {pixels, frameWidth, frameHeight, 0, channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB};
+    int added = sequenceAddFrame(&encoder, &source, &error);
+    free(pixels);
+    if (!added) {
+      printf("%s: %s\n", paths[i], error.detail);
+      sequenceEncoderFree(&encoder);
+      return 1;
+    }
+    keyframes += encoder.sentinels[i] == 0;
+  }
+  size_t size;
+  uint8_t* bytes = count > 0 ? sequenceFinish(&encoder, &size, &error) : NULL;
+  if (bytes == NULL) {
+    printf("%s\n", count > 0 ? error.detail : "No frames");
+    return 1;
+  }
+  FILE* file = fopen(outfile, "wb");
+  int failed = file == NULL || fwrite(bytes, 1, size, file) != size;
+  if (file != NULL) {
+    failed |= fclose(file) != 0;
+  }
+  if (failed) {
+    printf("Could not write %s\n", outfile);
+  } else {
+    printf("%d frames (%d keyframes), %lu bytes\n", count, keyframes, size);
+  }
+  free(bytes);
+  return failed;
+}
+
+// Decodes the frames of a qoiv sequence (all, or only frame when it is >= 0) to
+// outdir/frame-NNNNNN.png. Returns 0 on success.
+int sequenceDecodeFiles(const char* infile, const char* outdir, int64_t frame, const struct qoi_limits* limits) {
+  struct qoi_error error = {QOI_OK};
+  size_t size;
+  uint8_t* bytes = readFile(infile, &size, &error);
+  struct qoi_sequence sequence;
+  if (bytes == NULL || !openSequence(&sequence, bytes, size, limits, &error)) {
+    printf("%s\n", error.detail);
+    free(bytes);
+    return 1;
+  }
+  const int channels = sequence.channels == 3 ? 3 : 4;
+  const size_t pixelCount = (size_t)sequence.width * sequence.height;
+  uint8_t* rgb = channels == 3 ? malloc(pixelCount * 3 + 1) : NULL;
+  int failed = channels == 3 && rgb == NULL;
+  if (failed) {
+    printf("Not enough memory for the frame!\n");
+  } else if (!pngFits(sequence.width, sequence.height, channels, &error)) {
+    printf("%s\n", error.detail);
+    failed = 1;
+  }
+  uint32_t first = frame >= 0 ? frame : 0;
+  uint32_t last = frame >= 0 ? frame : sequence.frameCount - 1;
+  for (uint32_t index = first; !failed && index <= last; index++) {
+    const uint8_t* pixels = sequenceFrame(&sequence, index, &error);
+    if (pixels == NULL) {
+      failed = 1;
+      break;
+    }
+    if (rgb != NULL) {
+      convertPixels(pixels, rgb, pixelCount, QOI_FORMAT_RGB);
+      pixels = rgb;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/frame-%06u.png", outdir, index);
+    if (!stbi_write_png(path, sequence.width, sequence.height, channels, pixels, sequence.width * channels)) {
+      printf("Could not write %s\n", path);
+      failed = 1;
+    }
+  }
+  if (error.status != QOI_OK) {
+    printf("%s\n", error.detail);
+  }
+  failed |= QOI_FAILED(error.status);
+  free(rgb);
+  closeSequence(&sequence);
+  free(bytes);
+  return failed;
+}
+
+// Sequence benchmark (the sequence bench command): a synthetic screen recording encoded as
+// independent qoi files and as a qoiv sequence. Prints the size and the encode and decode speed
+// of both.
+int sequenceBenchmark(uint32_t width, uint32_t height, uint32_t frameCount, uint32_t keyframeInterval) {
+  if (!checkDimensions(width, height, NULL)) {
+    return 1;
+  }
+  const size_t frameSize = (size_t)width * height * 4;
+  uint8_t* base = generateSynthetic(SYNTHETIC_UI, width, height, 1);
+  uint8_t* frame = malloc(frameSize);
+  uint8_t** files = calloc(frameCount, sizeof(uint8_t*));
+  size_t* fileSizes = calloc(frameCount, sizeof(size_t));
+  struct qoi_sequence_encoder encoder;
+  if (base == NULL || frame == NULL || files == NULL || fileSizes == NULL ||
+      !sequenceEncoderInit(&encoder, width, height, 4, keyframeInterval, NULL, NULL)) {
+    printf("Not enough memory for the frames!\n");
+    free(base);
+    free(frame);
+    free(files);
+    free(fileSizes);
+    return 1;
+  }
+
+  double seconds[2][2] = {{0, 0}, {0, 0}}; // Frames and sequence, encode and decode
+  size_t sizes[2] = {0, 0};
+  int failed = 0;
+  for (uint32_t i = 0; i < frameCount && !failed; i++) {
+    generateScreenFrame(base, width, height, i, frame);
+    struct qoi_source source = {frame, width, height, 0, QOI_FORMAT_RGBA};
+    double begin = secondsNow();
+    files[i] = encodeSource(&source, NULL, &fileSizes[i], NULL);
+    double middle = secondsNow();
+    failed = files[i] == NULL || !sequenceAddFrame(&encoder, &source, NULL);
+    seconds[0][0] += middle - begin;
+    seconds[1][0] += secondsNow() - middle;
+    sizes[0] += fileSizes[i];
+  }
+  double begin = secondsNow();
+  uint8_t* bytes = failed ? NULL : sequenceFinish(&encoder, &sizes[1], NULL);
+  seconds[1][0] += secondsNow() - begin;
+  if (failed) {
+    sequenceEncoderFree(&encoder);
+  }
+
+  struct qoi_sequence sequence;
+  int opened = bytes != NULL && openSequence(&sequence, bytes, sizes[1], &noLimits, NULL);
+  failed |= !opened;
+  for (uint32_t i = 0; i < frameCount && !failed; i++) {
+    struct qoi_header qoiHeader;
+    begin = secondsNow();
+    uint8_t* decoded = decodeMemory(files[i], fileSizes[i], &qoiHeader, QOI_FORMAT_RGBA, NULL);
+    double middle = secondsNow();
+    const uint8_t* sequenceDecoded = sequenceFrame(&sequence, i, NULL);
+    seconds[0][1] += middle - begin;
+    seconds[1][1] += secondsNow() - middle;
+    generateScreenFrame(base, width, height, i, frame);
+    failed = decoded == NULL || sequenceDecoded == NULL || memcmp(decoded, frame, frameSize) != 0 ||
+             memcmp(sequenceDecoded, frame, frameSize) != 0;
+    free(decoded);
+  }
+  if (opened) {
+    closeSequence(&sequence);
+  }
+
+  const double megapixels = (double)width * height * frameCount / 1e6;
+  printf("%u frames of %ux%u, keyframe every %u frames\n", frameCount, width, height, keyframeInterval);
+  printf("%-10s %12s %10s %10s\n", "", "bytes", "enc MP/s", "dec MP/s");
+  const char* names[] = {"frames", "sequence"};
+  for (int i = 0; i < 2 && !failed; i++) {
+    printf("%-10s %12lu %10.1f %10.1f\n", names[i], sizes[i], megapixels / seconds[i][0], megapixels / seconds[i][1]);
+  }
+  if (failed) {
+    printf("Encoding or decoding failed, or the decoded frames differ\n");
+  }
+  for (uint32_t i = 0; i < frameCount; i++) {
+    free(files[i]);
+  }
+  free(files);
+  free(fileSizes);
+  free(bytes);
+  free(frame);
+  free(base);
+  return failed;
+}
+
+// Op kinds of the ops microbenchmark, in the order of countOps' pixelsPerOp
+enum op_kind {
+  OP_KIND_RUN,
+  OP_KIND_INDEX,
+  OP_KIND_DIFF,
+  OP_KIND_LUMA,
+  OP_KIND_RGB,
+  OP_KIND_RGBA,
+  OP_KIND_COUNT
+};
+
+const char* opKindNames[OP_KIND_COUNT] = {"run", "index", "diff", "luma", "rgb", "rgba"};
+
+// Number of ops in a qoi stream, QOI_OP_RUN counted once per op. With pixelsPerOp, also the
+// pixels each op kind produced (see enum op_kind).
+uint64_t countOps(const uint8_t* bytes, size_t size, uint64_t pixelCount, uint64_t* pixelsPerOp) {
+  // Op kind by tag, for the 8-bit tags and the 2-bit tags
+  const uint8_t kinds[4] = {OP_KIND_INDEX, OP_KIND_DIFF, OP_KIND_LUMA, OP_KIND_RUN};
+  uint64_t ops = 0;
+  uint64_t pixels = 0;
+  if (pixelsPerOp != NULL) {
+    memset(pixelsPerOp, 0, OP_KIND_COUNT * sizeof(uint64_t));
+  }
+  size_t i = headerSize;
+  while (pixels < pixelCount && i < size) {
+    uint8_t tag = bytes[i];
+    int kind = tag == QOI_OP_RGB ? OP_KIND_RGB : tag == QOI_OP_RGBA ? OP_KIND_RGBA : kinds[tag >> 6];
+    const uint8_t lengths[OP_KIND_COUNT] = {1, 1, 1, 2, 4, 5};
+    uint64_t run = kind == OP_KIND_RUN ? (tag & 0x3f) + 1 : 1;
+    i += lengths[kind];
+    pixels += run;
+    if (pixelsPerOp != NULL) {
+      pixelsPerOp[kind] += run;
+    }
+    ops++;
+  }
+  return ops;
+}
+
+// Generates RGBA pixels whose encoding is made of ops drawn with the given weights. Each pixel is
+// built from the previous one to hit its op: the same pixel, a color in the encoder's index (or a
+// palette color that fills an empty slot), a small or medium delta, a new color or a new alpha. The
+// encoder may still pick another op now and then (a delta can land on an indexed color), so the
+// caller should measure the actual mix with countOps.
+uint8_t* generateOpStream(const uint32_t weights[OP_KIND_COUNT], uint32_t width, uint32_t height, uint32_t seed) {
+  const size_t pixelCount = (size_t)width * height;
+  struct rgba* pixels = malloc(pixelCount * sizeof(struct rgba));
+  if (pixels == NULL) {
+    return NULL;
+  }
+  uint32_t random = seed * 2654435761u + 1;
+  uint32_t totalWeight = 0;
+  for (int kind = 0; kind < OP_KIND_COUNT; kind++) {
+    totalWeight += weights[kind];
+  }
+  // Opaque palette with one color per index slot, and the index as the encoder sees it
+  struct rgba palette[64];
+  struct rgba seen[64];
+  uint64_t seenSlots = 0;
+  uint64_t filled = 0;
+  while (filled != UINT64_MAX) {
+    uint32_t r = xorshift32(&random);
+    struct rgba color = {r, r >> 8, r >> 16, 255};
+    uint8_t slot = getIndex(color);
+    if (!(filled >> slot & 1)) {
+      palette[slot] = color;
+      filled |= 1ull << slot;
+    }
+  }
+  struct rgba prev = {0, 0, 0, 255};
+  for (size_t i = 0; i < pixelCount; i++) {
+    uint32_t r = xorshift32(&random);
+    uint32_t pick = totalWeight > 0 ? r % totalWeight : 0;
+    int kind = 0;
+    while (kind < OP_KIND_COUNT - 1 && pick >= weights[kind]) {
+      pick -= weights[kind++];
+    }
+    r = xorshift32(&random);
+    struct rgba curr = prev;
+    switch (kind) {
+      case OP_KIND_RUN:
+        break;
+      case OP_KIND_INDEX:
+        curr = seenSlots >> (r & 63) & 1 ? seen[r & 63] : palette[r & 63];
+        if (curr.r == prev.r && curr.g == prev.g && curr.b == prev.b && curr.a == prev.a) {
+          curr = palette[(r + 1) & 63];
+        }
+        break;
+      case OP_KIND_DIFF:
+        // Green always moves up so that colors do not repeat soon and become index hits
+        curr.r += (int)(r & 3) - 2;
+        curr.g += 1;
+        curr.b += (int)(r >> 2 & 3) - 2;
+        break;
+      case OP_KIND_LUMA: {
+        int dg = 3 + (int)(r % 29); // 3..31, outside of the DIFF range
+        dg = r & 0x100 ? -dg : dg;
+        curr.g += dg;
+        curr.r += dg + (int)(r >> 9 & 15) - 8;
+        curr.b += dg + (int)(r >> 13 & 15) - 8;
+        break;
+      }
+      case OP_KIND_RGB:
+        curr.r = r;
+        curr.g = r >> 8;
+        curr.b = r >> 16;
+        break;
+      case OP_KIND_RGBA:
+        curr.r = r;
+        curr.g = r >> 8;
+        curr.b = r >> 16;
+        curr.a = prev.a + 1 + (r >> 24) % 255; // Never the previous alpha
+        break;
+    }
+    pixels[i] = curr;
+    prev = curr;
+    seen[getIndex(curr)] = curr;
+    seenSlots |= 1ull << getIndex(curr);
+  }
+  return (uint8_t*)pixels;
+}
+
+// Per-op microbenchmark (the ops command): ns/pixel of the encode and decode kernels for streams of
+// mostly one op, an even mixture and a photo-like mixture, or only the given weights. The actual
+// share of pixels per op is printed next to the timings.
+int opsBenchmark(uint32_t width, uint32_t height, const uint32_t* mix) {
+  const uint32_t mixes[][OP_KIND_COUNT] = {
+    {1, 0, 0, 0, 0, 0}, {0, 1, 0, 0, 0, 0}, {0, 0, 1, 0, 0, 0}, {0, 0, 0, 1, 0, 0}, {0, 0, 0, 0, 1, 0},
+    {0, 0, 0, 0, 0, 1}, {1, 1, 1, 1, 1, 1}, {5, 15, 25, 40, 14, 1}};
+  const char* mixNames[] = {"run", "index", "diff", "luma", "rgb", "rgba", "even", "photo", "custom"};
+  const int first = mix != NULL ? 8 : 0;
+  const int last = mix != NULL ? 8 : 7;
+  const uint64_t pixelCount = (uint64_t)width * height;
+  int failures = 0;
+  printf("%-8s %8s %8s %8s", "stream", "enc ns", "dec ns", "bits/px");
+  for (int kind = 0; kind < OP_KIND_COUNT; kind++) {
+    printf(" %6s", opKindNames[kind]);
+  }
+  printf("\n");
+  for (int m = first; m <= last; m++) {
+    uint8_t* pixels = generateOpStream(m == 8 ? mix : mixes[m], width, height, 1);
+    size_t size;
+    double encodeSeconds;
+    double decodeSeconds;
+    int ok;
+    uint8_t* bytes = pixels != NULL ? timeCodec(pixels, width, height, &size, &encodeSeconds, &decodeSeconds, &ok) : NULL;
+    if (bytes == NULL || !ok) {
+      printf("%-8s failed\n", mixNames[m]);
+      failures++;
+    } else {
+      uint64_t pixelsPerOp[OP_KIND_COUNT];
+      countOps(bytes, size, pixelCount, pixelsPerOp);
+      printf("%-8s %8.2f %8.2f %8.2f", mixNames[m], encodeSeconds * 1e9 / pixelCount,
+             decodeSeconds * 1e9 / pixelCount, size * 8.0 / pixelCount);
+      for (int kind = 0; kind < OP_KIND_COUNT; kind++) {
+        printf(" %5.1f%%", 100.0 * pixelsPerOp[kind] / pixelCount);
+      }
+      printf("\n");
+    }
+    free(bytes);
+    free(pixels);
+  }
+  return failures;
+}
+
+// Codecs of the compare command
+enum compare_codec {
+  COMPARE_THIS,
+  COMPARE_REFERENCE_QOI,
+  COMPARE_STB_PNG,
+  COMPARE_CODEC_COUNT
+};
+
+const char* compareCodecNames[COMPARE_CODEC_COUNT] = {"this", "qoi.h", "stb png"};
+
+// Encodes (pixels != NULL) or decodes (bytes != NULL) once with one of the compared codecs. Images
+// keep their channel count, as each codec is used the way an application would use it.
+uint8_t* compareCodec(int codec, const uint8_t* pixels, const uint8_t* bytes, size_t size, int width, int height,
+                      int channels, size_t* outSize) {
+  switch (codec) {
+    case COMPARE_THIS:
+      if (pixels != NULL) {
+        struct qoi_source source = {pixels, width, height, 0, channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB};
+        return encodeSource(&source, NULL, outSize, NULL);
+      } else {
+        struct qoi_header qoiHeader;
+        return decodeMemory(bytes, size, &qoiHeader, channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB, NULL);
+      }
+    case COMPARE_REFERENCE_QOI: {
+      qoi_desc desc = {width, height, channels, QOI_SRGB};
+      int length = 0;
+      uint8_t* result = pixels != NULL ? qoi_encode(pixels, &desc, &length) : qoi_decode(bytes, size, &desc, channels);
+      *outSize = length;
+      return result;
+    }
+    case COMPARE_STB_PNG: {
+      int length = 0;
+      int ignored;
+      uint8_t* result = pixels != NULL
+                          ? stbi_write_png_to_mem(pixels, width * channels, width, height, channels, &length)
+                          : stbi_load_from_memory(bytes, size, &ignored, &ignored, &ignored, channels);
+      *outSize = length;
+      return result;
+    }
+  }
+  return NULL;
+}
+
+// Comparative benchmark (the compare command): this codec, the reference qoi.h and stb png on the
+// in-memory corpus images, each encode and decode repeated for at least 0.2 seconds. Prints MP/s
+// and size per image and totals per codec, and checks every codec decodes its own output losslessly.
+int compareBenchmark(void) {
+  double totalSeconds[COMPARE_CODEC_COUNT][2] = {{0}};
+  uint64_t totalBytes[COMPARE_CODEC_COUNT] = {0};
+  uint64_t totalPixels = 0;
+  uint64_t rawBytes = 0;
+  int failures = 0;
+  char path[256];
+  printf("%-24s %-8s %10s %10s %10s %7s\n", "image", "codec", "enc MP/s", "dec MP/s", "size KB", "ratio");
+  for (int i = 0; i < benchmarkImageCount; i++) {
+    snprintf(path, sizeof(path), "./original_png/%s.png", benchmarkImages[i]);
+    int width;
+    int height;
+    int channels;
+    uint8_t* pixels = stbi_load(path, &width, &height, &channels, 0);
+    if (pixels == NULL || channels < 3) {
+      printf("Could not load %s as rgb or rgba\n", path);
+      stbi_image_free(pixels);
+      failures++;
+      continue;
+    }
+    const uint64_t pixelCount = (uint64_t)width * height;
+    totalPixels += pixelCount;
+    rawBytes += pixelCount * channels;
+    for (int codec = 0; codec < COMPARE_CODEC_COUNT; codec++) {
+      double seconds[2];
+      uint8_t* bytes = NULL;
+      uint8_t* decoded = NULL;
+      size_t size = 0;
+      size_t ignored;
+      for (int direction = 0; direction < 2; direction++) {
+        int runs = 0;
+        double begin = secondsNow();
+        do {
+          if (direction == 0) {
+            free(bytes);
+            bytes = compareCodec(codec, pixels, NULL, 0, width, height, channels, &size);
+          } else {
+            free(decoded);
+            decoded = compareCodec(codec, NULL, bytes, size, width, height, channels, &ignored);
+          }
+          runs++;
+          seconds[direction] = secondsNow() - begin;
+        } while (seconds[direction] < 0.2 && (direction == 0 ? bytes : decoded) != NULL);
+        seconds[direction] /= runs;
+        if (bytes == NULL) {
+          break;
+        }
+      }
+      if (decoded == NULL || memcmp(decoded, pixels, pixelCount * channels) != 0) {
+        printf("%-24s %-8s failed\n", benchmarkImages[i], compareCodecNames[codec]);
+        failures++;
+      } else {
+        printf("%-24s %-8s %10.1f %10.1f %10.1f %6.1f%%\n", benchmarkImages[i], compareCodecNames[codec],
+               pixelCount / seconds[0] / 1e6, pixelCount / seconds[1] / 1e6, size / 1024.0,
+               100.0 * size / (pixelCount * channels));
+        totalSeconds[codec][0] += seconds[0];
+        totalSeconds[codec][1] += seconds[1];
+        totalBytes[codec] += size;
+      }
+      free(decoded);
+      free(bytes);
+    }
+    stbi_image_free(pixels);
+  }
+  for (int codec = 0; codec < COMPARE_CODEC_COUNT; codec++) {
+    printf("%-24s %-8s %10.1f %10.1f %10.1f %6.1f%%\n", "total", compareCodecNames[codec],
+           totalPixels / totalSeconds[codec][0] / 1e6, totalPixels / totalSeconds[codec][1] / 1e6,
+           totalBytes[codec] / 1024.0, 100.0 * totalBytes[codec] / rawBytes);
+  }
+  return failures;
+}
+
+// Regression tracker (the track command). Every corpus image is encoded and decoded `samples`
+// times, each sample being the ns/pixel of enough repetitions to last 10 ms. The samples are
+// stored in a JSON baseline per machine and new runs are compared to it with a bootstrap
+// confidence interval on the ratio of the medians.
+const int baselineVersion = 1;
+#define TRACK_MAX_SAMPLES 100
+#define TRACK_BENCHMARK_COUNT (2 * 64)
+
+struct track_benchmark {
+  char name[64]; // image/encode or image/decode
+  int sampleCount;
+  double samples[TRACK_MAX_SAMPLES]; // ns per pixel
+};
+
+int compareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+double median(const double* values, int count) {
+  double sorted[TRACK_MAX_SAMPLES];
+  memcpy(sorted, values, count * sizeof(double));
+  qsort(sorted, count, sizeof(double), compareDoubles);
+  return count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+// 95% bootstrap confidence interval of median(current) / median(baseline)
+void bootstrapRatio(const struct track_benchmark* baseline, const struct track_benchmark* current, double* low,
+                    double* high) {
+  enum { resamples = 2000 };
+  static double ratios[resamples];
+  double resampled[2][TRACK_MAX_SAMPLES];
+  uint32_t random = 12345;
+  for (int i = 0; i < resamples; i++) {
+    for (int j = 0; j < baseline->sampleCount; j++) {
+      resampled[0][j] = baseline->samples[xorshift32(&random) % baseline->sampleCount];
+    }
+    for (int j = 0; j < current->sampleCount; j++) {
+      resampled[1][j] = current->samples[xorshift32(&random) % current->sampleCount];
+    }
+    ratios[i] = median(resampled[1], current->sampleCount) / median(resampled[0], baseline->sampleCount);
+  }
+  qsort(ratios, resamples, sizeof(double), compareDoubles);
+  *low = ratios[resamples * 25 / 1000];
+  *high = ratios[resamples * 975 / 1000 - 1];
+}
+
+// Measures the corpus. Returns the number of benchmarks.
+int trackMeasure(struct track_benchmark* benchmarks, int samples) {
+  int count = 0;
+  char path[256];
+  for (int i = 0; i < benchmarkImageCount && count + 2 <= TRACK_BENCHMARK_COUNT; i++) {
+    snprintf(path, sizeof(path), "./original_png/%s.png", benchmarkImages[i]);
+    int width;
+    int height;
+    int channels;
+    uint8_t* pixels = stbi_load(path, &width, &height, &channels, 0);
+    if (pixels == NULL || channels < 3) {
+      printf("Could not load %s as rgb or rgba\n", path);
+      stbi_image_free(pixels);
+      continue;
+    }
+    const uint64_t pixelCount = (uint64_t)width * height;
+    size_t size;
+    uint8_t* bytes = compareCodec(COMPARE_THIS, pixels, NULL, 0, width, height, channels, &size);
+    for (int direction = 0; direction < 2 && bytes != NULL; direction++) {
+      struct track_benchmark* benchmark = &benchmarks[count++];
+      snprintf(benchmark->name, sizeof(benchmark->name), "%s/%s", benchmarkImages[i], direction == 0 ? "encode" : "decode");
+      benchmark->sampleCount = samples;
+      for (int sample = 0; sample < samples; sample++) {
+        int runs = 0;
+        double begin = secondsNow();
+        double elapsed;
+        do {
+          size_t ignored;
+          free(direction == 0 ? compareCodec(COMPARE_THIS, pixels, NULL, 0, width, height, channels, &ignored)
+                              : compareCodec(COMPARE_THIS, NULL, bytes, size, width, height, channels, &ignored));
+          runs++;
+          elapsed = secondsNow() - begin;
+        } while (elapsed < 0.01);
+        benchmark->samples[sample] = elapsed * 1e9 / runs / pixelCount;
+      }
+    }
+    free(bytes);
+    stbi_image_free(pixels);
+  }
+  return count;
+}
+
+// Returns 0 on success
+int writeBaseline(const char* path, const char* machine, const struct track_benchmark* benchmarks, int count) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    printf("Could not write %s\n", path);
+    return 1;
+  }
+  fprintf(file, "{\n  \"version\": %d,\n  \"machine\": \"%s\",\n  \"benchmarks\": [\n", baselineVersion, machine);
+  for (int i = 0; i < count; i++) {
+    fprintf(file, "    {\"name\": \"%s\", \"samples\": [", benchmarks[i].name);
+    for (int j = 0; j < benchmarks[i].sampleCount; j++) {
+      fprintf(file, "%s%.4f", j > 0 ? ", " : "", benchmarks[i].samples[j]);
+    }
+    fprintf(file, "]}%s\n", i + 1 < count ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  int failed = ferror(file);
+  fclose(file);
+  if (failed) {
+    printf("Could not write %s\n", path);
+  }
+  return failed;
+}
+
+// Reads a baseline written by writeBaseline. Returns the number of benchmarks, -1 if the file is
+// missing and -2 if it cannot be read or is not a baseline of this version.
+int readBaseline(const char* path, struct track_benchmark* benchmarks) {
+  if (access(path, F_OK) != 0) {
+    return -1;
+  }
+  size_t size;
+  char* text = (char*)readFile(path, &size, NULL);
+  if (text == NULL) {
+    return -2;
+  }
+  char* terminated = realloc(text, size + 1);
+  if (terminated == NULL) {
+    free(text);
+    return -2;
+  }
+  text = terminated;
+  text[size] = '\0';
+  const char* version = strstr(text, "\"version\":");
+  if (version == NULL || atoi(version + 10) != baselineVersion) {
+    free(text);
+    return -2;
+  }
+  int count = 0;
+  const char* cursor = text;
+  while (count < TRACK_BENCHMARK_COUNT && (cursor = strstr(cursor, "{\"name\": \"")) != NULL) {
+    struct track_benchmark* benchmark = &benchmarks[count];
+    cursor += 10;
+    const char* end = strchr(cursor, '"');
+    const char* samples = strstr(cursor, "\"samples\": [");
+    if (end == NULL || samples == NULL || end - cursor >= (long)sizeof(benchmark->name)) {
+      break;
+    }
+    memcpy(benchmark->name, cursor, end - cursor);
+    benchmark->name[end - cursor] = '\0';
+    cursor = samples + 12;
+    benchmark->sampleCount = 0;
+    while (*cursor != ']' && benchmark->sampleCount < TRACK_MAX_SAMPLES) {
+      char* next;
+      benchmark->samples[benchmark->sampleCount++] = strtod(cursor, &next);
+      if (next == cursor) {
+        break;
+      }
+      cursor = next;
+      while (*cursor == ',' || *cursor == ' ') {
+        cursor++;
+      }
+    }
+    if (benchmark->sampleCount > 0) {
+      count++;
+    }
+  }
+  free(text);
+  return count;
+}
+
+// Compares a new run to the baseline at path, writing the baseline if there is none or update is
+// set. Returns the number of benchmarks that got slower by more than threshold percent with 95%
+// confidence, or -1 on errors.
+int track(const char* path, int samples, double threshold, int update) {
+  char machine[64] = "unknown";
+  gethostname(machine, sizeof(machine) - 1);
+  char defaultPath[128];
+  if (path == NULL) {
+    mkdir("baselines", 0755);
+    snprintf(defaultPath, sizeof(defaultPath), "baselines/%s.json", machine);
+    path = defaultPath;
+  }
+  static struct track_benchmark baseline[TRACK_BENCHMARK_COUNT];
+  static struct track_benchmark current[TRACK_BENCHMARK_COUNT];
+  int baselineCount = readBaseline(path, baseline);
+  if (baselineCount == -2) {
+    printf("Could not read %s as a version %d baseline\n", path, baselineVersion);
+    return -1;
+  }
+  int count = trackMeasure(current, samples);
+  if (baselineCount < 0) {
+    printf("No baseline yet, writing %s\n", path);
+    return writeBaseline(path, machine, current, count) == 0 ? 0 : -1;
+  }
+
+  int regressions = 0;
+  printf("%-28s %10s %10s %8s %18s %s\n", "benchmark", "base ns/px", "new ns/px", "change", "95% interval", "");
+  for (int i = 0; i < count; i++) {
+    const struct track_benchmark* base = NULL;
+    for (int j = 0; j < baselineCount && base == NULL; j++) {
+      base = strcmp(baseline[j].name, current[i].name) == 0 ? &baseline[j] : NULL;
+    }
+    double now = median(current[i].samples, current[i].sampleCount);
+    if (base == NULL) {
+      printf("%-28s %10s %10.3f %8s %18s new\n", current[i].name, "-", now, "-", "-");
+      continue;
+    }
+    double before = median(base->samples, base->sampleCount);
+    double low;
+    double high;
+    bootstrapRatio(base, &current[i], &low, &high);
+    const char* verdict = "";
+    if (low > 1 + threshold / 100) {
+      verdict = "REGRESSION";
+      regressions++;
+    } else if (high < 1 - threshold / 100) {
+      verdict = "faster";
+    }
+    printf("%-28s %10.3f %10.3f %+7.1f%% [%+6.1f%%, %+6.1f%%] %s\n", current[i].name, before, now,
+           100 * (now / before - 1), 100 * (low - 1), 100 * (high - 1), verdict);
+  }
+  printf("%d regression%s above %.1f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+  if (update && writeBaseline(path, machine, current, count) != 0) {
+    return -1;
+  }
+  return regressions;
+}
+
+#ifdef __linux__
+// Hardware counters of the perf command, opened with perf_event_open as one group so that all
+// of them count over the same instructions. User space only, which works with perf_event_paranoid 2.
+enum perf_counter {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_COUNTER_COUNT
+};
+
+struct perf_counters {
+  int fds[PERF_COUNTER_COUNT]; // -1 for counters the machine does not have
+  uint64_t values[PERF_COUNTER_COUNT]; // Since the last perfStart, scaled if multiplexed
+};
+
+// Opens the counters. Returns 0 if not even the cycle counter is available.
+int perfOpen(struct perf_counters* counters) {
+  const uint32_t types[PERF_COUNTER_COUNT] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                              PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+  const uint64_t configs[PERF_COUNTER_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_MISSES};
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    counters->fds[i] = -1;
+  }
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = types[i];
+    attr.config = configs[i];
+    attr.disabled = i == 0; // The group is enabled through its leader
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int leader = i == 0 ? -1 : counters->fds[0];
+    counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (counters->fds[0] < 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void perfClose(struct perf_counters* counters) {
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (counters->fds[i] >= 0) {
+      close(counters->fds[i]);
+    }
+  }
+}
+
+void perfStart(struct perf_counters* counters) {
+  ioctl(counters->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(counters->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void perfStop(struct perf_counters* counters) {
+  ioctl(counters->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    uint64_t data[3]; // value, time enabled, time running
+    counters->values[i] = 0;
+    if (counters->fds[i] >= 0 && read(counters->fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0) {
+      counters->values[i] = data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+    }
+  }
+}
+
+// Prints one row of the perf command
+void printPerfRow(const char* image, const char* kernel, const struct perf_counters* counters, int runs,
+                  uint64_t pixels, uint64_t ops, double seconds) {
+  const uint64_t* values = counters->values;
+  char cells[PERF_COUNTER_COUNT][16];
+  const double perPixel = 1.0 / ((double)pixels * runs);
+  const double perOp = 1.0 / ((double)ops * runs);
+  const double scales[PERF_COUNTER_COUNT] = {perPixel, 0, perOp, perPixel, perPixel};
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (counters->fds[i] < 0 || (i == PERF_INSTRUCTIONS && values[PERF_CYCLES] == 0)) {
+      snprintf(cells[i], sizeof(cells[i]), "-");
+    } else if (i == PERF_INSTRUCTIONS) {
+      snprintf(cells[i], sizeof(cells[i]), "%.2f", (double)values[i] / values[PERF_CYCLES]);
+    } else {
+      snprintf(cells[i], sizeof(cells[i]), "%.3f", values[i] * scales[i]);
+    }
+  }
+  printf("%-24s %-7s %9.1f %9s %6s %11s %10s %10s\n", image, kernel, pixels * runs / seconds / 1e6, cells[PERF_CYCLES],
+         cells[PERF_INSTRUCTIONS], cells[PERF_BRANCH_MISSES], cells[PERF_L1D_MISSES], cells[PERF_LLC_MISSES]);
+}
+
+// Hardware counters around the encode and decode kernels (the perf command) for every image of the
+// corpus, in memory so that png loading and file I/O are not counted. Each kernel runs `runs` times.
+int perfBenchmark(int runs) {
+  struct perf_counters counters;
+  if (!perfOpen(&counters)) {
+    printf("perf_event_open is not available (%s), only timing the kernels\n", strerror(errno));
+  }
+  printf("%-24s %-7s %9s %9s %6s %11s %10s %10s\n", "image", "kernel", "MP/s", "cycles/px", "IPC",
+         "brmiss/op", "L1D/px", "LLC/px");
+  char path[256];
+  for (int i = 0; i < benchmarkImageCount; i++) {
+    snprintf(path, sizeof(path), "./original_png/%s.png", benchmarkImages[i]);
+    int width;
+    int height;
+    int channels;
+    uint8_t* pixels = stbi_load(path, &width, &height, &channels, 0);
+    if (pixels == NULL) {
+      printf("Could not load %s\n", path);
+      continue;
+    }
+    const uint64_t pixelCount = (uint64_t)width * height;
+    struct qoi_source source = {pixels, width, height, 0, channels == 4 ? QOI_FORMAT_RGBA : QOI_FORMAT_RGB};
+    uint8_t* bytes = NULL;
+    size_t size = 0;
+    double begin = secondsNow();
+    if (counters.fds[0] >= 0) {
+      perfStart(&counters);
+    }
+    for (int run = 0; run < runs; run++) {
+      free(bytes);
+      bytes = encodeSource(&source, NULL, &size, NULL);
+    }
+    if (counters.fds[0] >= 0) {
+      perfStop(&counters);
+    }
+    double seconds = secondsNow() - begin;
+    free(pixels);
+    if (bytes == NULL) {
+      printf("Could not encode %s\n", path);
+      continue;
+    }
+    const uint64_t ops = countOps(bytes, size, pixelCount, NULL);
+    printPerfRow(benchmarkImages[i], "encode", &counters, runs, pixelCount, ops, seconds);
+
+    struct qoi_header qoiHeader;
+    uint8_t* decoded = NULL;
+    begin = secondsNow();
+    if (counters.fds[0] >= 0) {
+      perfStart(&counters);
+    }
+    for (int run = 0; run < runs; run++) {
+      free(decoded);
+      decoded = decodeMemory(bytes, size, &qoiHeader, QOI_FORMAT_RGBA, NULL);
+    }
+    if (counters.fds[0] >= 0) {
+      perfStop(&counters);
+    }
+    seconds = secondsNow() - begin;
+    printPerfRow(benchmarkImages[i], "decode", &counters, runs, pixelCount, ops, seconds);
+    free(decoded);
+    free(bytes);
+  }
+  perfClose(&counters);
+  return 0;
+}
+#endif
+
+// Parses a --format name. Returns -1 for unknown names.
+int parseFormat(const char* name) {
+  const char* names[] = {"rgba", "bgra", "argb", "rgb", "bgr", "gray"};
+  const char* suffix = "-premultiplied";
+  size_t length = strlen(name);
+  int format = 0;
+  if (length > strlen(suffix) && strcmp(name + length - strlen(suffix), suffix) == 0) {
+    length -= strlen(suffix);
+    format = QOI_FORMAT_PREMULTIPLIED;
+  }
+  for (int i = 0; i < 6; i++) {
+    if (strlen(names[i]) == length && strncmp(name, names[i], length) == 0) {
+      return format | i;
+    }
+  }
+  return -1;
+}
+
+// Parses the --max-pixels, --max-bytes or --max-seconds option at argv[*i] into limits.
+// Returns 1 if it was one of them.
+int parseLimit(int argc, char** argv, int* i, struct qoi_limits* limits) {
+  if (*i + 1 >= argc) {
+    return 0;
+  }
+  if (strcmp(argv[*i], "--max-pixels") == 0) {
+    limits->maxPixels = strtoull(argv[++*i], NULL, 10);
+  } else if (strcmp(argv[*i], "--max-bytes") == 0) {
+    limits->maxBytes = strtoull(argv[++*i], NULL, 10);
+  } else if (strcmp(argv[*i], "--max-seconds") == 0) {
+    limits->maxSeconds = atof(argv[++*i]);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+void printUsage(const char* program) {
+  printf("Usage:\n");
+  printf("  %s                                  run the encode/decode benchmark\n", program);
+  printf("  %s encode <in.png> <out.qoi> [options]\n", program);
+  printf("      --effort N     0 (default, fastest) to 2\n");
+  printf("      --max-error N  near-lossless, allowed error per colour channel (default 0 = lossless)\n");
+  printf("      --lz           write a compressed qoiz container\n");
+  printf("      --tile N       write a qoit container of NxN tiles\n");
+  printf("      --threads N    threads for tiles (default one per CPU)\n");
+  printf("      --raw W H F    read in as a raw frame of WxH pixels in format F (see --format below)\n");
+  printf("      --stride N     bytes per row of the raw frame (default packed)\n");
+  printf("      --checksum     append a checksum chunk after the end chunk (plain qoi only)\n");
+  printf("  %s batch <encode|decode> <outdir> <file>... [options]  convert many files\n", program);
+  printf("      --io B         uring or blocking (default uring when available)\n");
+  printf("      --threads N    codec threads (default one per CPU)\n");
+  printf("      --effort N, --max-error N, --lz, --tile N  as for encode\n");
+  printf("      --cache DIR    reuse outputs of unchanged inputs from a cache directory\n");
+  printf("      --cache-size MB  evict least recently used cache entries above this size (default no limit)\n");
+  printf("  %s serve <socket> [--threads N] [limits]  run the encode/decode service on a Unix socket\n", program);
+  printf("      limits         --max-pixels N, --max-bytes N, --max-seconds S for decode requests, see decode\n");
+  printf("  %s client <socket> encode <in.png> <out> [encode options] [--memfd]\n", program);
+  printf("  %s client <socket> decode <in.qoi|in.qoiz> <out.png> [--format F] [--memfd]\n", program);
+  printf("  %s client <socket> stop\n", program);
+  printf("      --memfd        pass payloads as memfds instead of through the socket\n");
+  printf("  %s sequence encode <out.qoiv> <frame.png>... [options]  encode frames against the previous frame\n", program);
+  printf("      --keyframe N   a keyframe every N frames for seeking (default 60, 0 = only the first)\n");
+  printf("      --effort N     as for encode\n");
+  printf("  %s sequence decode <in.qoiv> <outdir> [--frame N] [limits]  write the frames as outdir/frame-NNNNNN.png\n", program);
+  printf("  %s sequence bench [--size W H] [--frames N] [--keyframe N]  synthetic screen recording as frames and as a sequence\n", program);
+  printf("  %s verify [--threads N]             check all code paths against the reference files and codec\n", program);
+  printf("  %s generate <pattern> <W> <H> <out.qoi|out.raw|out.png> [--seed N]  write a synthetic image\n", program);
+  printf("  %s sweep [--patterns P,P,...] [--max-mp N]  encode/decode speed and peak RSS over image sizes (CSV)\n", program);
+  printf("      patterns: flat, gradient, noise, ui, alpha-ramp, rgba-every-pixel, max-run, deltas, palette\n");
+  printf("      --max-mp N     largest image in megapixels (default 16)\n");
+  printf("  %s big <W> <H> [--pattern P] [--dir D] [--keep]  generate, encode, stream decode and compare a huge image on disk\n", program);
+  printf("  %s ops [--size W H] [--mix R,I,D,L,G,A]  ns/pixel of the kernels for streams of mostly one op\n", program);
+  printf("      --mix          weights of run, index, diff, luma, rgb and rgba ops instead of the default streams\n");
+  printf("  %s compare                          speed and size of this codec, the reference qoi.h and stb png\n", program);
+  printf("  %s track [--baseline FILE] [--samples N] [--threshold PCT] [--update]  compare against a stored baseline\n", program);
+  printf("      --baseline FILE  JSON baseline (default baselines/<hostname>.json, written on the first run)\n");
+  printf("      --samples N    samples per benchmark (default 15)\n");
+  printf("      --threshold PCT  slowdown that counts as a regression (default 5)\n");
+  printf("      --update       store this run as the new baseline\n");
+  printf("  %s perf [--runs N]                 hardware counters around the encode and decode kernels (Linux)\n", program);
+  printf("  %s info <file>... [options]          print the header of qoi and qoit files without decoding\n", program);
+  printf("      --check-end    also check the end chunk\n");
+  printf("      --threads N    threads for probing (default one per CPU)\n");
+  printf("  %s decode <in.qoi|in.qoiz|in.qoit> <out.png> [options]\n", program);
+  printf("      --rect X Y W H decode only this rectangle (qoi and qoit)\n");
+  printf("      --thumbnail W H  downscale while decoding, H 0 keeps the aspect ratio (qoi only)\n");
+  printf("      --threads N    threads for tiles (default one per CPU)\n");
+  printf("      --checksum     print the checksums, verified against the checksum chunk if present\n");
+  printf("      --format F     rgba (default), bgra, argb, rgb, bgr or gray, with suffix -premultiplied\n");
+  printf("                     for premultiplied alpha (e.g. bgra-premultiplied)\n");
+  printf("      --max-pixels N refuse images with more pixels (default no limit)\n");
+  printf("      --max-bytes N  refuse images larger than this in the output format\n");
+  printf("      --max-seconds S  give up when decoding takes longer\n");
+}
 
 int main(int argc, char** argv) {
+  if (argc > 1) {
+    if (strcmp(argv[1], "encode") == 0 && argc >= 4) {
+      struct qoi_encode_options options = defaultEncodeOptions;
+      struct qoi_source raw = {NULL, 0, 0, 0, -1};
+      for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--effort") == 0 && i + 1 < argc) {
+          options.effort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-error") == 0 && i + 1 < argc) {
+          options.maxError = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lz") == 0) {
+          options.compress = 1;
+        } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+          options.tileSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+          options.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--raw") == 0 && i + 3 < argc) {
+          raw.width = atoi(argv[++i]);
+          raw.height = atoi(argv[++i]);
+          raw.format = parseFormat(argv[++i]);
+          if (raw.format < 0) {
+            printUsage(argv[0]);
+            return 1;
+          }
+        } else if (strcmp(argv[i], "--stride") == 0 && i + 1 < argc) {
+          raw.stride = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--checksum") == 0) {
+          options.checksum = 1;
+        } else {
+          printUsage(argv[0]);
+          return 1;
+        }
+      }
+      if (options.compress && options.tileSize > 0) {
+        printf("--lz and --tile cannot be combined\n");
+        return 1;
+      }
+      if (options.checksum && (options.compress || options.tileSize > 0)) {
+        printf("--checksum is only supported for plain qoi files\n");
+        return 1;
+      }
+      struct qoi_report report;
+      enum qoi_status status = raw.format >= 0 ? encodeRaw(argv[2], argv[3], &raw, &options, &report) :
+                               encodeWithOptions(argv[2], argv[3], &options, &report);
+      return printReport(status, &report);
+    }
+    if (strcmp(argv[1], "decode") == 0 && argc >= 4) {
+      struct qoi_decode_options options = defaultDecodeOptions;
+      for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--rect") == 0 && i + 4 < argc) {
+          options.rectX = atoi(argv[++i]);
+          options.rectY = atoi(argv[++i]);
+          options.rectWidth = atoi(argv[++i]);
+          options.rectHeight = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+          options.format = parseFormat(argv[++i]);
+          if (options.format < 0) {
+            printUsage(argv[0]);
+            return 1;
+          }
+        } else if (strcmp(argv[i], "--thumbnail") == 0 && i + 2 < argc) {
+          options.thumbnailWidth = atoi(argv[++i]);
+          options.thumbnailHeight = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+          options.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--checksum") == 0) {
+          options.checksum = 1;
+        } else if (!parseLimit(argc, argv, &i, &options.limits)) {
+          printUsage(argv[0]);
+          return 1;
+        }
+      }
+      if (options.checksum && (options.rectWidth > 0 || options.thumbnailWidth > 0)) {
+        printf("--checksum cannot be combined with --rect or --thumbnail\n");
+        return 1;
+      }
+      struct qoi_report report;
+      return printReport(decodeWithOptions(argv[2], argv[3], &options, &report), &report);
+    }
+    if (strcmp(argv[1], "batch") == 0 && argc >= 4 &&
+        (strcmp(argv[2], "encode") == 0 || strcmp(argv[2], "decode") == 0)) {
+      int mode = strcmp(argv[2], "encode") == 0 ? BATCH_ENCODE : BATCH_DECODE;
+      struct qoi_encode_options options = defaultEncodeOptions;
+      int ioBackend = BATCH_IO_AUTO;
+      const char* cacheDir = NULL;
+      uint64_t cacheSize = 0;
+      // Options are removed from argv, the rest are paths
+      int pathCount = 0;
+      for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+          i++;
+          if (strcmp(argv[i], "uring") == 0) {
+            ioBackend = BATCH_IO_URING;
+          } else if (strcmp(argv[i], "blocking") == 0) {
+            ioBackend = BATCH_IO_BLOCKING;
+          } else {
+            printUsage(argv[0]);
+            return 1;
+          }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+          options.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--effort") == 0 && i + 1 < argc) {
+          options.effort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-error") == 0 && i + 1 < argc) {
+          options.maxError = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lz") == 0) {
+          options.compress = 1;
+        } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+          options.tileSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+          cacheDir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+          cacheSize = strtoull(argv[++i], NULL, 10) << 20;
+        } else {
+          argv[4 + pathCount++] = argv[i];
+        }
+      }
+      if (options.compress && options.tileSize > 0) {
+        printf("--lz and --tile cannot be combined\n");
+        return 1;
+      }
+      struct timespec begin;
+      struct timespec end;
+      clock_gettime(CLOCK_MONOTONIC, &begin);
+      struct conversion_cache cache;
+      if (cacheDir != NULL) {
+        cacheInit(&cache, cacheDir, cacheSize, mode, &options);
+      }
+      int requested = ioBackend;
+      struct qoi_error* errors = calloc(pathCount > 0 ? pathCount : 1, sizeof(struct qoi_error));
+      if (errors == NULL) {
+        printf("Not enough memory for the file list!\n");
+        return 1;
+      }
+      size_t failed = batchConvertFiles(mode, (const char* const*)argv + 4, pathCount, argv[3], &options, &ioBackend,
+                                        cacheDir != NULL ? &cache : NULL, errors);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      if (requested == BATCH_IO_URING && ioBackend != BATCH_IO_URING) {
+        printf("io_uring is not available, used blocking I/O\n");
+      }
+      for (int i = 0; i < pathCount; i++) {
+        if (errors[i].status != QOI_OK) {
+          printf("%s: %s (%s)\n", argv[4 + i], errors[i].detail, qoiStatusNames[errors[i].status]);
+        }
+      }
+      free(errors);
+      printf("Converted %lu of %d files in %f sec.\n", pathCount - failed, pathCount,
+             (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9);
+      if (cacheDir != NULL) {
+        cacheTrim(&cache);
+        printf("Cache: %llu hits, %llu misses, %llu evicted, %.1f MB in %s\n", (unsigned long long)cache.hits,
+               (unsigned long long)cache.misses, (unsigned long long)cache.evictions, cache.bytes / 1048576.0, cacheDir);
+      }
+      return failed == 0 ? 0 : 1;
+    }
+#ifdef __linux__
+    if (strcmp(argv[1], "serve") == 0 && argc >= 3) {
+      int threads = 0;
+      struct qoi_limits limits = noLimits;
+      for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+          threads = atoi(argv[++i]);
+        } else if (!parseLimit(argc, argv, &i, &limits)) {
+          printUsage(argv[0]);
+          return 1;
+        }
+      }
+      return serve(argv[2], threads, &limits);
+    }
+    if (strcmp(argv[1], "perf") == 0 && (argc == 2 || (argc == 4 && strcmp(argv[2], "--runs") == 0))) {
+      int runs = argc == 4 ? atoi(argv[3]) : 5;
+      if (runs <= 0) {
+        printUsage(argv[0]);
+        return 1;
+      }
+      return perfBenchmark(runs);
+    }
+    if (strcmp(argv[1], "client") == 0 && argc == 4 && strcmp(argv[3], "stop") == 0) {
+      return clientStop(argv[2]);
+    }
+    if (strcmp(argv[1], "client") == 0 && argc >= 6 &&
+        (strcmp(argv[3], "encode") == 0 || strcmp(argv[3], "decode") == 0)) {
+      struct qoi_encode_options options = defaultEncodeOptions;
+      int format = QOI_FORMAT_RGBA;
+      int useMemfd = 0;
+      for (int i = 6; i < argc; i++) {
+        if (strcmp(argv[i], "--memfd") == 0) {
+          useMemfd = 1;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+          format = parseFormat(argv[++i]);
+          if (format < 0) {
+            printUsage(argv[0]);
+            return 1;
+          }
+        } else if (strcmp(argv[i], "--effort") == 0 && i + 1 < argc) {
+          options.effort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-error") == 0 && i + 1 < argc) {
+          options.maxError = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lz") == 0) {
+          options.compress = 1;
+        } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+          options.tileSize = atoi(argv[++i]);
+        } else {
+          printUsage(argv[0]);
+          return 1;
+        }
+      }
+      if (strcmp(argv[3], "encode") == 0) {
+        return clientEncode(argv[2], argv[4], argv[5], &options, useMemfd);
+      }
+      return clientDecode(argv[2], argv[4], argv[5], format, useMemfd);
+    }
+#endif
+    if (strcmp(argv[1], "generate") == 0 && (argc == 6 || (argc == 8 && strcmp(argv[6], "--seed") == 0))) {
+      int pattern = parsePattern(argv[2]);
+      if (pattern < 0 || atoi(argv[3]) <= 0 || atoi(argv[4]) <= 0) {
+        printUsage(argv[0]);
+        return 1;
+      }
+      return generate(pattern, atoi(argv[3]), atoi(argv[4]), argc == 8 ? atoi(argv[7]) : 1, argv[5]);
+    }
+    if (strcmp(argv[1], "big") == 0 && argc >= 4) {
+      int pattern = SYNTHETIC_GRADIENT;
+      const char* dir = ".";
+      int keep = 0;
+      for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc) {
+          pattern = parsePattern(argv[++i]);
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+          dir = argv[++i];
+        } else if (strcmp(argv[i], "--keep") == 0) {
+          keep = 1;
+        } else {
+          pattern = -1;
+        }
+      }
+      uint32_t width = strtoul(argv[2], NULL, 10);
+      uint32_t height = strtoul(argv[3], NULL, 10);
+      if (pattern < 0 || width == 0 || height == 0) {
+        printUsage(argv[0]);
+        return 1;
+      }
+      return bigBenchmark(pattern, width, height, dir, keep);
+    }
+    if (strcmp(argv[1], "sequence") == 0 && argc >= 4 && strcmp(argv[2], "encode") == 0) {
+      uint32_t keyframeInterval = defaultKeyframeInterval;
+      struct qoi_encode_options options = defaultEncodeOptions;
+      // Options are removed from argv, the rest are frames
+      int frameCount = 0;
+      for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--keyframe") == 0 && i + 1 < argc) {
+          keyframeInterval = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--effort") == 0 && i + 1 < argc) {
+          options.effort = atoi(argv[++i]);
+        } else {
+          argv[4 + frameCount++] = argv[i];
+        }
+      }
+      if (frameCount == 0) {
+        printUsage(argv[0]);
+        return 1;
+      }
+      return sequenceEncodeFiles(argv[3], (const char* const*)argv + 4, frameCount, keyframeInterval, &options);
+    }
+    if (strcmp(argv[1], "sequence") == 0 && argc >= 5 && strcmp(argv[2], "decode") == 0) {
+      int64_t frame = -1;
+      struct qoi_limits limits = noLimits;
+      for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--frame") == 0 && i + 1 < argc) {
+          frame = strtoul(argv[++i], NULL, 10);
+        } else if (!parseLimit(argc, argv, &i, &limits)) {
+          printUsage(argv[0]);
+          return 1;
+        }
+      }
+      return sequenceDecodeFiles(argv[3], argv[4], frame, &limits);
+    }
+    if (strcmp(argv[1], "sequence") == 0 && argc >= 3 && strcmp(argv[2], "bench") == 0) {
+      uint32_t width = 1280;
+      uint32_t height = 720;
+      uint32_t frameCount = 120;
+      uint32_t keyframeInterval = defaultKeyframeInterval;
+      for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--size") == 0 && i + 2 < argc) {
+          width = strtoul(argv[++i], NULL, 10);
+          height = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+          frameCount = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--keyframe") == 0 && i + 1 < argc) {
+          keyframeInterval = strtoul(argv[++i], NULL, 10);
+        } else {
+          width = 0;
+        }
+      }
+      if (width == 0 || height == 0 || frameCount == 0) {
+        printUsage(argv[0]);
+        return 1;
+      }
+      return sequenceBenchmark(width, height, frameCount, keyframeInterval);
+    }
+    if (strcmp(argv[1], "sweep") == 0) {
+      int patterns[SYNTHETIC_PATTERN_COUNT];
+      int patternCount = 0;
+      double maxMegapixels = 16;
+      for (int pattern = 0; pattern < SYNTHETIC_PATTERN_COUNT; pattern++) {
+        patterns[patternCount++] = pattern;
+      }
+      for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--max-mp") == 0 && i + 1 < argc) {
+          maxMegapixels = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--patterns") == 0 && i + 1 < argc) {
+          patternCount = 0;
+          for (char* name = strtok(argv[++i], ","); name != NULL; name = strtok(NULL, ",")) {
+            int pattern = parsePattern(name);
+            if (pattern < 0 || patternCount == SYNTHETIC_PATTERN_COUNT) {
+              printUsage(argv[0]);
+              return 1;
+            }
+            patterns[patternCount++] = pattern;
+          }
+        } else {
+          printUsage(argv[0]);
+          return 1;
+        }
+      }
+      return sweep(patterns, patternCount, maxMegapixels) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "track") == 0) {
+      const char* baselinePath = NULL;
+      int samples = 15;
+      double threshold = 5;
+      int update = 0;
+      for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+          baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+          samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+          threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--update") == 0) {
+          update = 1;
+        } else {
+          printUsage(argv[0]);
+          return 1;
+        }
+      }
+      if (samples < 3 || samples > TRACK_MAX_SAMPLES) {
+        printf("--samples must be between 3 and %d\n", TRACK_MAX_SAMPLES);
+        return 1;
+      }
+      return track(baselinePath, samples, threshold, update) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "compare") == 0 && argc == 2) {
+      return compareBenchmark() == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "ops") == 0) {
+      uint32_t width = 1024;
+      uint32_t height = 1024;
+      uint32_t mix[OP_KIND_COUNT];
+      int hasMix = 0;
+      for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--size") == 0 && i + 2 < argc) {
+          width = atoi(argv[++i]);
+          height = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc &&
+                   sscanf(argv[++i], "%u,%u,%u,%u,%u,%u", &mix[0], &mix[1], &mix[2], &mix[3], &mix[4], &mix[5]) == 6) {
+          hasMix = 1;
+        } else {
+          printUsage(argv[0]);
+          return 1;
+        }
+      }
+      if (width == 0 || height == 0) {
+        printUsage(argv[0]);
+        return 1;
+      }
+      return opsBenchmark(width, height, hasMix ? mix : NULL) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "verify") == 0) {
+      int threads = 0;
+      if (argc == 4 && strcmp(argv[2], "--threads") == 0) {
+        threads = atoi(argv[3]);
+      } else if (argc != 2) {
+        printUsage(argv[0]);
+        return 1;
+      }
+      return verify(threads) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "info") == 0 && argc >= 3) {
+      int checkEnd = 0;
+      int threads = 0;
+      // Options are removed from argv, the rest are paths
+      int pathCount = 0;
+      for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--check-end") == 0) {
+          checkEnd = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+          threads = atoi(argv[++i]);
+        } else {
+          argv[2 + pathCount++] = argv[i];
+        }
+      }
+      struct qoi_info* infos = calloc(pathCount > 0 ? pathCount : 1, sizeof(struct qoi_info));
+      struct thread_pool* pool = poolCreate(threads);
+      if (infos == NULL || pool == NULL) {
+        printf("Not enough memory for the file list!\n");
+        free(infos);
+        poolDestroy(pool);
+        return 1;
+      }
+      size_t valid = qoiInfoBatch((const char* const*)argv + 2, pathCount, checkEnd, infos, pool);
+      poolDestroy(pool);
+      for (int i = 0; i < pathCount; i++) {
+        if (infos[i].error != NULL) {
+          printf("%s: %s\n", argv[2 + i], infos[i].error);
+        } else {
+          printf("%s: %s %ux%u channels %u colorspace %u, %llu bytes\n", argv[2 + i], infos[i].tiled ? "qoit" : "qoi",
+                 infos[i].width, infos[i].height, infos[i].channels, infos[i].colorspace,
+                 (unsigned long long)infos[i].fileSize);
+        }
+      }
+      free(infos);
+      return valid == (size_t)pathCount ? 0 : 1;
+    }
+    printUsage(argv[0]);
+    return 1;
+  }
+
   printf("\n");
   // decode("./original_qoi/dice.qoi", "file.png");
   // decode("./original_qoi/edgecase.qoi", "file.png");
@@ -348,27 +7729,29 @@ int main(int argc, char** argv) {
   // decode("./file.qoi", "file.png");
 
   // Test encoding and decoding all the images
+  char inPath[256];
+  char outPath[256];
+  struct qoi_report report;
+  int failed = 0;
   clock_t begin = clock();
 
-  encode("./original_png/dice.png", "./encoded/dice.qoi");
-  encode("./original_png/edgecase.png", "./encoded/edgecase.qoi");
-  encode("./original_png/kodim10.png", "./encoded/kodim10.qoi");
-  encode("./original_png/kodim23.png", "./encoded/kodim23.qoi");
-  encode("./original_png/qoi_logo.png", "./encoded/qoi_logo.qoi");
-  encode("./original_png/testcard_rgba.png", "./encoded/testcard_rgba.qoi");
-  encode("./original_png/testcard.png", "./encoded/testcard.qoi");
-  encode("./original_png/wikipedia_008.png", "./encoded/wikipedia_008.qoi");
+  for (int i = 0; i < benchmarkImageCount; i++) {
+    snprintf(inPath, sizeof(inPath), "./original_png/%s.png", benchmarkImages[i]);
+    snprintf(outPath, sizeof(outPath), "./encoded/%s.qoi", benchmarkImages[i]);
+    failed |= printReport(encodeWithOptions(inPath, outPath, &defaultEncodeOptions, &report), &report);
+#ifdef QOI_STATS
+    // Note: with stats enabled the printing is included in the encode timing.
+    printEncodeStats(stdout, benchmarkImages[i]);
+#endif
+  }
 
   clock_t mid = clock();
 
-  decode("./encoded/dice.qoi", "./decoded/dice.png");
-  decode("./encoded/edgecase.qoi", "./decoded/edgecase.png");
-  decode("./encoded/kodim10.qoi", "./decoded/kodim10.png");
-  decode("./encoded/kodim23.qoi", "./decoded/kodim23.png");
-  decode("./encoded/qoi_logo.qoi", "./decoded/qoi_logo.png");
-  decode("./encoded/testcard_rgba.qoi", "./decoded/testcard_rgba.png");
-  decode("./encoded/testcard.qoi", "./decoded/testcard.png");
-  decode("./encoded/wikipedia_008.qoi", "./decoded/wikipedia_008.png");
+  for (int i = 0; i < benchmarkImageCount; i++) {
+    snprintf(inPath, sizeof(inPath), "./encoded/%s.qoi", benchmarkImages[i]);
+    snprintf(outPath, sizeof(outPath), "./decoded/%s.png", benchmarkImages[i]);
+    failed |= printReport(decodeWithOptions(inPath, outPath, &defaultDecodeOptions, &report), &report);
+  }
 
   clock_t end = clock();
   double time_spent_mid = (double)(mid - begin) / CLOCKS_PER_SEC;
@@ -383,6 +7766,6 @@ int main(int argc, char** argv) {
   printf("Totaltim: %f sec.\n", time_spent_tot);
   printf("\n");
 
-  return 0;
+  return failed;
 }
 